@@ -28,6 +28,7 @@ extern "C" {
 #include <rtl-sdr_export.h>
 
 typedef struct rtlsdr_dev rtlsdr_dev_t;
+typedef struct rtlsdr_context rtlsdr_context_t;
 
 RTLSDR_API uint32_t rtlsdr_get_device_count(void);
 
@@ -60,8 +61,111 @@ RTLSDR_API int rtlsdr_get_device_usb_strings(uint32_t index,
  */
 RTLSDR_API int rtlsdr_get_index_by_serial(const char *serial);
 
+typedef struct rtlsdr_device_info {
+	uint32_t index;		/* index to pass to rtlsdr_open() */
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t bus;
+	uint8_t address;
+	const char *name;	/* same as rtlsdr_get_device_name() */
+	char manufact[256];	/* empty if the device could not be opened */
+	char product[256];
+	char serial[256];
+} rtlsdr_device_info_t;
+
+/*!
+ * Take a snapshot of all supported devices, including their USB strings.
+ * The bus is scanned once and every device is opened once, which is much
+ * cheaper than repeated calls of the per index functions above.
+ *
+ * \param list array of device descriptions, free with
+ *	       rtlsdr_free_device_list()
+ * \return number of devices found, negative on error
+ */
+RTLSDR_API int rtlsdr_get_device_list(rtlsdr_device_info_t **list);
+
+RTLSDR_API void rtlsdr_free_device_list(rtlsdr_device_info_t *list);
+
 RTLSDR_API int rtlsdr_open(rtlsdr_dev_t **dev, uint32_t index);
 
+/*!
+ * Open the device with the given USB serial string descriptor.
+ *
+ * \param dev the device handle
+ * \param serial serial string of the device
+ * \return 0 on success
+ * \return -1 if serial is NULL
+ * \return -2 if no devices were found at all
+ * \return -3 if devices were found, but none with matching serial
+ */
+RTLSDR_API int rtlsdr_open_by_serial(rtlsdr_dev_t **dev, const char *serial);
+
+/*!
+ * Open a simulated device that needs no hardware. It streams through
+ * rtlsdr_read_sync(), rtlsdr_read_async() and the other streaming calls
+ * like a real device, and accepts all tuner and gain settings. The
+ * samples are either played from a recorded cu8 file or synthesized as
+ * a tone in noise whose level follows the manual tuner gain.
+ *
+ * The spec is a comma separated list of options:
+ *   file=<path>	play a recorded file instead of the tone
+ *   loop=<0|1>		rewind the file at its end, otherwise the stream
+ *			ends like on an unplugged device (default 1)
+ *   tone=<Hz>		offset of the tone (default 100000)
+ *   amp=<LSB>		tone amplitude (default 40)
+ *   noise=<LSB>	noise amplitude (default 4)
+ *   realtime=<0|1>	deliver the samples at the configured sample rate,
+ *			or as fast as they are read (default 1)
+ *
+ * When the environment variable RTLSDR_SIM is set, its value is used as
+ * spec and the simulated device replaces all hardware: it is the only one
+ * enumerated and rtlsdr_open() with index 0 opens it.
+ *
+ * \param dev the device handle
+ * \param spec option string, may be NULL or empty for the defaults
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_open_sim(rtlsdr_dev_t **dev, const char *spec);
+
+/*!
+ * Create a context that several devices can be opened on, to be serviced
+ * by a fixed number of event threads instead of one thread per device.
+ * Each thread has a libusb context of its own, devices opened with
+ * rtlsdr_open_shared() are distributed evenly among them.
+ *
+ * Streams of these devices, whether started with rtlsdr_read_async(),
+ * rtlsdr_start_async() or rtlsdr_start_stream(), are handled by the event
+ * thread of the device. The callbacks of all devices on a thread share
+ * it, so they must not block, and rtlsdr_set_async_thread_opts() has no
+ * effect.
+ *
+ * \param ctx the context handle
+ * \param num_threads number of event threads, 0 for one
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_context_create(rtlsdr_context_t **ctx,
+				     uint32_t num_threads);
+
+/*!
+ * Stop the event threads and free the context.
+ *
+ * \param ctx the context handle given by rtlsdr_context_create()
+ * \return 0 on success, -2 if devices are still open on the context
+ */
+RTLSDR_API int rtlsdr_context_destroy(rtlsdr_context_t *ctx);
+
+/*!
+ * Open a device on a shared context.
+ *
+ * \param dev the device handle
+ * \param index the device index
+ * \param ctx context given by rtlsdr_context_create(), NULL behaves
+ *	      like rtlsdr_open()
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_open_shared(rtlsdr_dev_t **dev, uint32_t index,
+				  rtlsdr_context_t *ctx);
+
 RTLSDR_API int rtlsdr_close(rtlsdr_dev_t *dev);
 
 /* configuration functions */
@@ -152,6 +256,105 @@ RTLSDR_API int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq);
  */
 RTLSDR_API uint32_t rtlsdr_get_center_freq(rtlsdr_dev_t *dev);
 
+/*!
+ * Set a table of frequencies to hop between with rtlsdr_hop().
+ *
+ * The tuner register writes of every entry are recorded in advance, so a
+ * hop replays them in order, skipping those that don't change a register.
+ * This is done for E4000 and R820T/R828D tuners, for all others
+ * rtlsdr_hop() behaves like rtlsdr_set_center_freq(). The table is
+ * recomputed on the next hop after the sample rate, bandwidth, offset
+ * tuning or frequency correction have been changed.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param freqs array of frequencies in Hz
+ * \param n number of entries, 0 to clear the table
+ * \return 0 on success, -1 on error or if a frequency can't be tuned
+ */
+RTLSDR_API int rtlsdr_set_hop_table(rtlsdr_dev_t *dev, const uint32_t *freqs,
+				    uint32_t n);
+
+/*!
+ * Tune to an entry of the hop table.
+ *
+ * On R820T/R828D tuners the PLL lock is checked after the hop. If it
+ * didn't lock, the frequency is tuned again like rtlsdr_set_center_freq()
+ * does, which raises the VCO current.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param index entry of the table set with rtlsdr_set_hop_table()
+ * \return 0 on success, -1 on error
+ */
+RTLSDR_API int rtlsdr_hop(rtlsdr_dev_t *dev, uint32_t index);
+
+/*!
+ * Set a channel raster the tuner settings are computed for in advance, so
+ * tuning to a frequency on the raster with rtlsdr_set_center_freq() takes
+ * them from a table. Only the E4000 driver uses this, other tuners accept
+ * and ignore the raster. With offset tuning, the raster applies to the
+ * center frequency minus the offset.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param start frequency of the first channel in Hz
+ * \param step channel spacing in Hz
+ * \param count number of channels, 0 to drop the raster
+ * \return 0 on success, -1 on error
+ */
+RTLSDR_API int rtlsdr_set_tuner_raster(rtlsdr_dev_t *dev, uint32_t start,
+				       uint32_t step, uint32_t count);
+
+/*!
+ * Get the I2C traffic to the tuner caused by the last rtlsdr_set_center_freq()
+ * or rtlsdr_hop(), for profiling. Every transaction is a round trip through
+ * the I2C repeater of the RTL2832. Tuner accesses after the retune, e.g. gain
+ * changes, don't count. The PLL lock check after a hop doesn't count either,
+ * a hop that falls back to a regular retune counts the writes of both.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param xfers number of I2C reads and writes, may be NULL
+ * \param bytes bytes transferred including register addresses, may be NULL
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_tune_i2c_stats(rtlsdr_dev_t *dev, uint32_t *xfers,
+					 uint32_t *bytes);
+
+/*!
+ * Start a tuner session. Every tuner operation opens the I2C repeater of
+ * the RTL2832 and closes it again, which takes two control transfers per
+ * toggle. Within a session the repeater is opened once and stays open until
+ * the matching rtlsdr_tuner_session_end(). Sessions may be nested.
+ *
+ * The EEPROM functions close the repeater even within a session.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_tuner_session_begin(rtlsdr_dev_t *dev);
+
+/*!
+ * End a tuner session started with rtlsdr_tuner_session_begin(). The
+ * outermost session closes the I2C repeater.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 0 on success, -1 if no session was open
+ */
+RTLSDR_API int rtlsdr_tuner_session_end(rtlsdr_dev_t *dev);
+
+/* keep the repeater open while streaming, for E4000 and R820T/R828D only */
+#define RTLSDR_REPEATER_STREAMING	(1 << 0)
+
+/*!
+ * Set when the I2C repeater may be left open outside of tuner sessions.
+ * With RTLSDR_REPEATER_STREAMING it stays open from the first tuner
+ * operation of a stream to the first one after the stream has ended,
+ * if the tuner is known to tolerate this.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param flags combination of RTLSDR_REPEATER_* flags, 0 for the default
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_repeater_policy(rtlsdr_dev_t *dev, int flags);
+
 /*!
  * Set the frequency correction value for the device.
  *
@@ -215,6 +418,32 @@ RTLSDR_API int rtlsdr_get_tuner_gains(rtlsdr_dev_t *dev, int *gains);
  */
 RTLSDR_API int rtlsdr_set_tuner_gain(rtlsdr_dev_t *dev, int gain);
 
+/*!
+ * Set one of the gains returned by rtlsdr_get_tuner_gains(), selected by
+ * its position in the list. For the R820T and R828D the register values
+ * of each gain are taken from a table and written in one go, without
+ * searching for the gain, so this is the cheapest way to change the gain.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param index position of the gain in the list
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_tuner_gain_index(rtlsdr_dev_t *dev,
+					   unsigned int index);
+
+/*!
+ * Move the gain up or down by a number of entries in the list returned by
+ * rtlsdr_get_tuner_gains(), starting at the listed gain closest to the
+ * current one. The result is limited to the ends of the list. Meant for
+ * software AGC loops, which can avoid the repeater toggling of every step
+ * by wrapping their updates in rtlsdr_tuner_session_begin().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param steps entries to move, positive for more gain
+ * \return index of the new gain in the list, negative on error
+ */
+RTLSDR_API int rtlsdr_step_tuner_gain(rtlsdr_dev_t *dev, int steps);
+
 /*!
  * Set the bandwidth for the device.
  *
@@ -337,6 +566,31 @@ RTLSDR_API int rtlsdr_reset_buffer(rtlsdr_dev_t *dev);
 
 RTLSDR_API int rtlsdr_read_sync(rtlsdr_dev_t *dev, void *buf, int len, int *n_read);
 
+/* returned by rtlsdr_read_sync() when samples were lost before this read */
+#define RTLSDR_READ_GAP		1
+
+/*!
+ * Serve rtlsdr_read_sync() from a queue of transfers kept in flight by a
+ * library owned event thread instead of one bulk transfer per call, so the
+ * samples of consecutive reads are contiguous. The stream is started by
+ * the first read and runs until the queue is disabled or the device is
+ * closed, the async functions can't be used meanwhile.
+ *
+ * A read never spans a gap: if the reads don't keep up and samples are
+ * lost, the read stops short before them and the next one returns
+ * RTLSDR_READ_GAP along with the samples after the gap. rtlsdr_reset_buffer()
+ * drops the queued samples, including those still in flight, e.g. to skip
+ * samples received before a retune.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf_num number of transfers in flight, 0 to disable the queue
+ * \param buf_len transfer length, must be multiple of 512,
+ *		  should be a multiple of 16384 (URB size), 0 for default
+ * \return 0 on success, -2 while the device is streaming otherwise
+ */
+RTLSDR_API int rtlsdr_set_sync_queue(rtlsdr_dev_t *dev, uint32_t buf_num,
+				     uint32_t buf_len);
+
 typedef void(*rtlsdr_read_async_cb_t)(unsigned char *buf, uint32_t len, void *ctx);
 
 /*!
@@ -372,6 +626,69 @@ RTLSDR_API int rtlsdr_read_async(rtlsdr_dev_t *dev,
 				 uint32_t buf_num,
 				 uint32_t buf_len);
 
+/*!
+ * Stream metadata passed along with each buffer by rtlsdr_read_async_ex()
+ * and rtlsdr_stream_get_info().
+ */
+typedef struct rtlsdr_buf_info {
+	uint64_t sample_index;	/* index of the first I/Q sample since start */
+	uint64_t timestamp_ns;	/* host monotonic clock at transfer completion */
+	uint32_t xfer_index;	/* index of the USB transfer that was used */
+	uint32_t flags;		/* RTLSDR_BUF_* flags */
+} rtlsdr_buf_info_t;
+
+/* samples were lost between the previous buffer and this one */
+#define RTLSDR_BUF_GAP		(1 << 0)
+/* the buffer holds the position of at least one tag, see rtlsdr_get_tags() */
+#define RTLSDR_BUF_TAG		(1 << 1)
+
+/*!
+ * Marks the position in the stream where a setting was changed. The index
+ * is estimated from the sample rate and the time the change was committed
+ * to the device, so it is accurate to within the USB completion jitter.
+ * Tuner settling time is not included.
+ */
+typedef struct rtlsdr_tag {
+	uint64_t sample_index;	/* first sample taken with the new setting */
+	uint32_t type;		/* RTLSDR_TAG_* */
+	uint32_t value;		/* Hz for frequency and rate, tenth dB for gain */
+} rtlsdr_tag_t;
+
+#define RTLSDR_TAG_FREQ		1
+#define RTLSDR_TAG_GAIN		2
+#define RTLSDR_TAG_RATE		3
+
+typedef void(*rtlsdr_read_async_ex_cb_t)(unsigned char *buf, uint32_t len,
+					  const rtlsdr_buf_info_t *info,
+					  void *ctx);
+
+/*!
+ * Read samples from the device asynchronously, like rtlsdr_read_async(), but
+ * pass stream metadata with every buffer. This function will block until
+ * it is being canceled using rtlsdr_cancel_async()
+ *
+ * The sample index counts I/Q samples delivered by the USB transfers since
+ * the start of streaming. RTLSDR_BUF_GAP is set when samples went missing
+ * before the buffer: after failed transfers, or when the elapsed time
+ * indicates that the device FIFO has overflown. Samples lost inside the
+ * device are not accounted in the sample index.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param cb callback function to return received samples and metadata
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional buffer count, buf_num * buf_len = overall buffer size
+ *		  set to 0 for default buffer count (15)
+ * \param buf_len optional buffer length, must be multiple of 512,
+ *		  should be a multiple of 16384 (URB size), set to 0
+ *		  for default buffer length (16 * 32 * 512)
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_read_async_ex(rtlsdr_dev_t *dev,
+				    rtlsdr_read_async_ex_cb_t cb,
+				    void *ctx,
+				    uint32_t buf_num,
+				    uint32_t buf_len);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -380,6 +697,511 @@ RTLSDR_API int rtlsdr_read_async(rtlsdr_dev_t *dev,
  */
 RTLSDR_API int rtlsdr_cancel_async(rtlsdr_dev_t *dev);
 
+enum rtlsdr_output_format {
+	RTLSDR_OUTPUT_CU8 = 0,	/* unsigned 8 bit I/Q as sent by the device */
+	RTLSDR_OUTPUT_CS16,	/* signed 16 bit I/Q */
+	RTLSDR_OUTPUT_CF32	/* 32 bit float I/Q */
+};
+
+/*!
+ * Set the sample format delivered by rtlsdr_read_sync() and the async
+ * callbacks. The len of rtlsdr_read_sync() and the len passed to the
+ * callbacks count bytes of the selected format. The buf_len of the async
+ * functions still is the size of the USB transfers in raw bytes, so without
+ * a down-converter a callback gets buf_len times the size of one I or Q
+ * value of the format. Buffers handed out by rtlsdr_stream_acquire() are
+ * always RTLSDR_OUTPUT_CU8.
+ *
+ * RTLSDR_OUTPUT_CS16 yields (x - 127) * scale, scale being rounded to an
+ * integer between 1 and 128. RTLSDR_OUTPUT_CF32 yields (x - 127.5) * scale.
+ * With DC correction the fixed center is replaced by a running estimate of
+ * the I and Q means, RTLSDR_OUTPUT_CU8 is then corrected in place. Integer
+ * formats are rounded, so up to half a step of the output remains of the
+ * offset, with RTLSDR_OUTPUT_CS16 a larger scale makes that smaller. SIMD
+ * kernels are selected at runtime and produce the same results as the
+ * plain C code. See rtlsdr_set_correction() for IQ imbalance correction.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param format output format
+ * \param scale multiplier, 0 for default (1 for cs16, 1/127.5 for cf32)
+ * \param dc_correct 1 to track and remove the DC offset, 0 to disable
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_set_output_format(rtlsdr_dev_t *dev,
+					enum rtlsdr_output_format format,
+					float scale, int dc_correct);
+
+/*!
+ * Put a digital down-converter in front of the output format conversion.
+ * It shifts the signal at offset Hz from the center frequency to 0 Hz and
+ * decimates it, so rtlsdr_read_sync() and the async callbacks receive the
+ * narrowband channel at sample rate / decimation.
+ *
+ * The mixer uses SIMD kernels where available. A fourth order CIC does
+ * the bulk of the decimation, followed by up to two halfband stages and
+ * a FIR that compensates the CIC droop and decimates by two. The usable
+ * bandwidth is 80% of the output rate with 0.4 dB of ripple. Aliases into
+ * it are suppressed by about 64 dB for a decimation of 2 or a multiple of
+ * 4, and by only 44 to 49 dB for twice an odd number, where the CIC has to
+ * take a ratio that is not a power of two. Odd ratios other than 1 are not
+ * supported.
+ *
+ * The output has the format set by rtlsdr_set_output_format(), scaled
+ * like raw samples: RTLSDR_OUTPUT_CU8 is rounded back to 8 bit and loses
+ * the resolution gained by the decimation. Buffer lengths are given in
+ * output bytes. rtlsdr_read_sync() reads and decimates the raw samples in
+ * chunks of at most 256 KiB until len is filled, the last output sample
+ * of len may be left unused.
+ * Async buffers that don't complete an output sample are not passed to
+ * the callback. The sample indices of the buffer
+ * info and tags keep counting raw samples. Buffers handed out by
+ * rtlsdr_stream_acquire() are not processed.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param offset frequency in Hz relative to the center frequency
+ * \param decimation 1 or an even number up to 8192, 0 to disable
+ * \return 0 on success, -1 on an unsupported decimation, -2 on a change of
+ *	   the decimation while streaming, the offset may always be changed
+ */
+RTLSDR_API int rtlsdr_set_ddc(rtlsdr_dev_t *dev, int32_t offset,
+			      uint32_t decimation);
+
+#define RTLSDR_CORRECT_DC	(1 << 0)
+#define RTLSDR_CORRECT_IQ	(1 << 1)
+
+/*!
+ * Enable the correction stage of the output conversion. RTLSDR_CORRECT_DC
+ * removes a running estimate of the I and Q means like the dc_correct
+ * argument of rtlsdr_set_output_format(). RTLSDR_CORRECT_IQ estimates the
+ * gain and phase imbalance between I and Q from the statistics of every
+ * buffer and rotates Q back into quadrature, which suppresses the image
+ * of strong signals mirrored around the center frequency.
+ *
+ * The corrections apply to all output formats including RTLSDR_OUTPUT_CU8
+ * and to the input of the digital down-converter. They may be changed while
+ * streaming, disabling a correction drops its estimate. Buffers handed out
+ * by rtlsdr_stream_acquire() are not corrected.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param flags RTLSDR_CORRECT_DC and RTLSDR_CORRECT_IQ, 0 to disable
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_correction(rtlsdr_dev_t *dev, int flags);
+
+typedef struct rtlsdr_iq_stats {
+	float dc_i;		/* I mean in raw units, the center when not tracked */
+	float dc_q;		/* Q mean in raw units */
+	float gain;		/* Q to I amplitude ratio */
+	float phase;		/* deviation from quadrature in degrees */
+	float irr;		/* image rejection before correction in dB */
+	uint64_t buffers;	/* buffers the IQ estimate is based on */
+} rtlsdr_iq_stats_t;
+
+/*!
+ * Get the current estimates of the correction stage. The DC levels are
+ * tracked with RTLSDR_CORRECT_DC, the IQ imbalance with RTLSDR_CORRECT_IQ;
+ * without an IQ estimate gain is 1 and phase and irr are 0.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param stats receives the estimates
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_iq_stats(rtlsdr_dev_t *dev,
+				   rtlsdr_iq_stats_t *stats);
+
+/*!
+ * Read samples from the device asynchronously. Unlike rtlsdr_read_async()
+ * this function returns immediately, the USB transfers are serviced and the
+ * callback is invoked from an event thread owned by the library. Stop
+ * streaming with rtlsdr_stop_async().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param cb callback function to return received samples
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional buffer count, buf_num * buf_len = overall buffer size
+ *		  set to 0 for default buffer count (15)
+ * \param buf_len optional buffer length, must be multiple of 512,
+ *		  should be a multiple of 16384 (URB size), set to 0
+ *		  for default buffer length (16 * 32 * 512)
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_start_async(rtlsdr_dev_t *dev,
+				  rtlsdr_read_async_cb_t cb,
+				  void *ctx,
+				  uint32_t buf_num,
+				  uint32_t buf_len);
+
+/*!
+ * Cancel streaming started with rtlsdr_start_async() or rtlsdr_start_stream()
+ * and wait for the event thread to finish. Must not be called from within
+ * the callback.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 0 on success, -2 if no event thread is running
+ */
+RTLSDR_API int rtlsdr_stop_async(rtlsdr_dev_t *dev);
+
+/*!
+ * Allocate the transfers and buffers of a stream ahead of time and keep
+ * them between streams. Without this they are allocated, including the
+ * zero-copy mapping, when a stream starts and freed when it ends. A stream
+ * started with the same buffer setup afterwards only has to submit its
+ * transfers, a different setup replaces the kept buffers by its own.
+ *
+ * This prepares the callback based functions, use rtlsdr_prepare_stream()
+ * for rtlsdr_start_stream().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf_num number of transfers as given to the async functions
+ * \param buf_len length of the transfers as given to the async functions
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_prepare_async(rtlsdr_dev_t *dev, uint32_t buf_num,
+				    uint32_t buf_len);
+
+/*!
+ * Like rtlsdr_prepare_async(), but for a stream started with
+ * rtlsdr_start_stream(). The sync queue of rtlsdr_set_sync_queue() is such a
+ * stream with its buf_num and buf_len and a ring_len of 0.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf_num buf_num as given to rtlsdr_start_stream()
+ * \param buf_len buf_len as given to rtlsdr_start_stream()
+ * \param ring_len ring_len as given to rtlsdr_start_stream()
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_prepare_stream(rtlsdr_dev_t *dev, uint32_t buf_num,
+				     uint32_t buf_len, uint32_t ring_len);
+
+/*!
+ * Free the buffers kept by rtlsdr_prepare_async() or rtlsdr_prepare_stream(),
+ * later streams allocate their own again. rtlsdr_close() releases them as
+ * well.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_release_async(rtlsdr_dev_t *dev);
+
+/*!
+ * Let the async engine adapt the number of in-flight transfers and their
+ * length while streaming. Callback service time and completion jitter are
+ * watched: the queue is deepened (and transfers lengthened once at the
+ * maximum depth) when stalls approach the buffered time, transfers are
+ * shortened (then the queue made shallower) after a period of ample
+ * headroom to lower latency. The buf_num and buf_len passed to the read
+ * functions become the initial setup, clamped to the given limits.
+ *
+ * NOTE: Buffers for max_buf_num transfers of max_buf_len are allocated.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param min_buf_num minimum number of in-flight transfers
+ * \param max_buf_num maximum number of in-flight transfers,
+ *		      set to 0 to disable adaptive buffering (default)
+ * \param min_buf_len minimum transfer length, must be multiple of 512
+ * \param max_buf_len maximum transfer length, must be multiple of 512
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_set_adaptive_buffers(rtlsdr_dev_t *dev,
+					   uint32_t min_buf_num,
+					   uint32_t max_buf_num,
+					   uint32_t min_buf_len,
+					   uint32_t max_buf_len);
+
+/* flags for rtlsdr_set_buffer_pool() */
+#define RTLSDR_POOL_HUGEPAGES	(1 << 0)	/* back the pool by huge pages */
+#define RTLSDR_POOL_MLOCK	(1 << 1)	/* lock the pool in memory */
+
+/*!
+ * Allocate the transfer buffers from one page aligned, prefaulted arena
+ * instead of separate heap blocks. Only used when zero-copy buffers are
+ * unavailable. Huge pages and NUMA placement are supported on Linux only,
+ * failing to honor them (or to lock the memory) is reported but not fatal.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param enable 1 to use the pool, 0 for separate buffers (default)
+ * \param flags bitmask of RTLSDR_POOL_* flags
+ * \param numa_node NUMA node to place the pool on, -1 for any
+ * \return 0 on success, -2 while streaming
+ */
+RTLSDR_API int rtlsdr_set_buffer_pool(rtlsdr_dev_t *dev, int enable,
+				      uint32_t flags, int numa_node);
+
+/*!
+ * Get the current number of in-flight transfers and their length.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf_num current number of in-flight transfers
+ * \param buf_len current transfer length in bytes
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_buffer_config(rtlsdr_dev_t *dev, uint32_t *buf_num,
+					uint32_t *buf_len);
+
+/*!
+ * Set scheduling options for the event thread created by rtlsdr_start_async()
+ * and rtlsdr_start_stream(). Takes effect when the next thread is started.
+ *
+ * NOTE: Real-time scheduling usually requires elevated privileges, failures
+ * are reported but do not prevent streaming.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param cpu CPU to bind the thread to, -1 for no affinity
+ * \param rt_priority SCHED_FIFO priority (1 to 99), 0 for default scheduling
+ * \return 0 on success, -2 if an event thread is running
+ */
+RTLSDR_API int rtlsdr_set_async_thread_opts(rtlsdr_dev_t *dev, int cpu,
+					    int rt_priority);
+
+/*!
+ * Start streaming samples into an internal ring of transfer buffers. This
+ * function returns immediately, the USB transfers are serviced by an event
+ * thread owned by the library. Completed buffers are fetched without copying
+ * with rtlsdr_stream_acquire() and handed back with rtlsdr_stream_release().
+ *
+ * If the consumer falls behind and no spare buffer is left, the data of the
+ * just completed transfer is dropped and counted as an overrun.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf_num optional number of transfers kept in flight,
+ *		  set to 0 for default buffer count (15)
+ * \param buf_len optional buffer length, must be multiple of 512,
+ *		  set to 0 for default buffer length (16 * 32 * 512)
+ * \param ring_len optional number of spare buffers the consumer may hold
+ *		   or have queued, set to 0 to use buf_num
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_start_stream(rtlsdr_dev_t *dev,
+				   uint32_t buf_num,
+				   uint32_t buf_len,
+				   uint32_t ring_len);
+
+/*!
+ * Stop a stream started with rtlsdr_start_stream() and join the event thread.
+ *
+ * Buffers that were queued or acquired before stopping remain valid until the
+ * next stream is started or the device is closed. Queued buffers can still be
+ * drained with rtlsdr_stream_acquire().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 0 on success, -2 if no stream is running
+ */
+RTLSDR_API int rtlsdr_stop_stream(rtlsdr_dev_t *dev);
+
+/*!
+ * Fetch the oldest completed buffer of a ring stream.
+ *
+ * NOTE: Acquire and release must be called from a single consumer thread
+ * (or be serialized by the caller). Every acquired buffer has to be released
+ * exactly once.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf pointer to the sample data, valid until released
+ * \param len number of valid bytes in the buffer, may be NULL
+ * \param timeout_ms time to wait for data in milliseconds, 0 to poll,
+ *		     negative to wait forever
+ * \return buffer id (>= 0) to be passed to rtlsdr_stream_release()
+ * \return -ETIMEDOUT if no buffer became available in time
+ * \return -2 if the stream has ended and all buffers have been drained
+ */
+RTLSDR_API int rtlsdr_stream_acquire(rtlsdr_dev_t *dev,
+				     unsigned char **buf,
+				     uint32_t *len,
+				     int timeout_ms);
+
+/*!
+ * Get the stream metadata of an acquired ring buffer. Buffers dropped on
+ * overrun advance the sample index and flag the next buffer with
+ * RTLSDR_BUF_GAP.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param id buffer id returned by rtlsdr_stream_acquire()
+ * \param info metadata of the buffer
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_stream_get_info(rtlsdr_dev_t *dev, int id,
+				      rtlsdr_buf_info_t *info);
+
+/*!
+ * Hand a buffer fetched with rtlsdr_stream_acquire() back to the library.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param id buffer id returned by rtlsdr_stream_acquire()
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_stream_release(rtlsdr_dev_t *dev, int id);
+
+/*!
+ * Get the overrun counters of the current (or last) ring stream.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buffers number of buffers dropped because the consumer lagged behind,
+ *		  may be NULL
+ * \param bytes number of sample bytes dropped, may be NULL
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_stream_overruns(rtlsdr_dev_t *dev,
+					  uint32_t *buffers,
+					  uint64_t *bytes);
+
+enum rtlsdr_sub_policy {
+	RTLSDR_SUB_BLOCK = 0,		/* never lose buffers, hold up the stream */
+	RTLSDR_SUB_DROP_OLDEST = 1	/* drop the oldest queued buffer instead */
+};
+
+/*!
+ * Add a consumer to the ring stream of the device. As long as subscribers
+ * exist, every completed buffer is queued for each of them instead of being
+ * handed to rtlsdr_stream_acquire(). The buffers are shared without copying
+ * and only reused once all subscribers have released them.
+ *
+ * A RTLSDR_SUB_BLOCK subscriber sees every buffer of the stream. When it
+ * falls behind, the spare buffers run out and the stream overruns for all
+ * subscribers. A RTLSDR_SUB_DROP_OLDEST subscriber loses its oldest queued
+ * buffer instead, whenever more than queue_len buffers are queued or the
+ * stream would run out of spare buffers otherwise.
+ *
+ * Subscribers may be added and removed at any time and are kept across
+ * streams. At most 8 subscribers are supported.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param policy how the subscriber deals with lagging behind
+ * \param queue_len maximum number of queued buffers of a drop oldest
+ *		    subscriber, 0 for no limit
+ * \return subscriber id (>= 0) on success, -2 if no slot is left
+ */
+RTLSDR_API int rtlsdr_subscribe(rtlsdr_dev_t *dev, int policy,
+				uint32_t queue_len);
+
+/*!
+ * Remove a subscriber. Its queued buffers are released, buffers it has
+ * acquired still have to be released with rtlsdr_sub_release().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param id subscriber id returned by rtlsdr_subscribe()
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_unsubscribe(rtlsdr_dev_t *dev, int id);
+
+/*!
+ * Fetch the oldest buffer queued for a subscriber. Each subscriber may be
+ * served by its own thread. rtlsdr_stream_get_info() gives the metadata of
+ * the buffer.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param id subscriber id returned by rtlsdr_subscribe()
+ * \param buf pointer to the sample data, valid until released
+ * \param len number of valid bytes in the buffer, may be NULL
+ * \param timeout_ms time to wait for data in milliseconds, 0 to poll,
+ *		     negative to wait forever
+ * \return buffer id (>= 0) to be passed to rtlsdr_sub_release()
+ * \return -ETIMEDOUT if no buffer became available in time
+ * \return -2 if no stream is running and all buffers have been drained
+ */
+RTLSDR_API int rtlsdr_sub_acquire(rtlsdr_dev_t *dev, int id,
+				  unsigned char **buf, uint32_t *len,
+				  int timeout_ms);
+
+/*!
+ * Release a buffer fetched with rtlsdr_sub_acquire().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param id subscriber id returned by rtlsdr_subscribe()
+ * \param buf_id buffer id returned by rtlsdr_sub_acquire()
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_sub_release(rtlsdr_dev_t *dev, int id, int buf_id);
+
+/*!
+ * Get the number of buffers a drop oldest subscriber has lost.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param id subscriber id returned by rtlsdr_subscribe()
+ * \param buffers number of dropped buffers
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_sub_get_drops(rtlsdr_dev_t *dev, int id,
+				    uint64_t *buffers);
+
+#define RTLSDR_STATS_HIST_BINS	32
+
+typedef struct rtlsdr_stream_stats {
+	uint64_t transfers;	/* completed transfers */
+	uint64_t bytes;		/* bytes received */
+	uint64_t errors;	/* failed transfers, sum of the err_* counters */
+	uint64_t err_io;	/* LIBUSB_TRANSFER_ERROR */
+	uint64_t err_timeout;	/* LIBUSB_TRANSFER_TIMED_OUT */
+	uint64_t err_stall;	/* LIBUSB_TRANSFER_STALL */
+	uint64_t err_no_device;	/* LIBUSB_TRANSFER_NO_DEVICE */
+	uint64_t err_overflow;	/* LIBUSB_TRANSFER_OVERFLOW */
+	uint64_t gaps;		/* buffers flagged with RTLSDR_BUF_GAP */
+	uint64_t dropped_samples; /* estimated from sample rate and wall clock */
+	uint64_t recoveries;	/* streams recovered, see rtlsdr_set_recovery() */
+	uint64_t reattaches;	/* recoveries that had to reopen the device */
+	/* callback execution time, bin 0 counts callbacks below 1 us,
+	 * bin n those between 2^(n-1) and 2^n us, the last bin the rest */
+	uint64_t cb_hist[RTLSDR_STATS_HIST_BINS];
+	uint32_t cb_p50_us;	/* percentiles as upper bounds of their bin */
+	uint32_t cb_p90_us;
+	uint32_t cb_p99_us;
+	uint32_t cb_p999_us;
+	uint32_t cb_max_us;
+} rtlsdr_stream_stats_t;
+
+/*!
+ * Get statistics of the current (or last) stream. The counters are reset
+ * whenever streaming is started and may be read from any thread.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param stats statistics
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_stream_stats(rtlsdr_dev_t *dev,
+				       rtlsdr_stream_stats_t *stats);
+
+#define RTLSDR_RECOVER_RESET	(1 << 0)
+#define RTLSDR_RECOVER_REATTACH	(1 << 1)
+
+/*!
+ * Recover a stream from USB errors instead of ending it. Normally the
+ * stream is canceled when every transfer failed in a row or the device is
+ * gone, and the device has to be closed and opened again.
+ *
+ * With RTLSDR_RECOVER_RESET the transfers are reaped, the endpoint halt is
+ * cleared, the FIFO of the device is reset and the same transfers are
+ * submitted again. With RTLSDR_RECOVER_REATTACH a device that disappeared,
+ * or couldn't be reset, is waited for: once a device with the same serial
+ * number shows up (libusb hotplug events are used where supported) it is
+ * opened in place of the old one, initialised and the sample rate, center
+ * frequency, gain and the other settings are restored. The stream resumes
+ * with the next buffer flagged RTLSDR_BUF_GAP, the sample indices keep
+ * counting. Recoveries are counted in the stream statistics.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param flags RTLSDR_RECOVER_RESET and RTLSDR_RECOVER_REATTACH, 0 to disable
+ * \param timeout_ms how long to wait for the device to come back before the
+ *	  stream is canceled, 0 to wait forever
+ * \return 0 on success, -2 while streaming, -3 if the device has no serial
+ *	   number to be found by
+ */
+RTLSDR_API int rtlsdr_set_recovery(rtlsdr_dev_t *dev, int flags,
+				   uint32_t timeout_ms);
+
+/*!
+ * Get the tags of the current stream that fall into a range of samples.
+ * The most recent 64 tags are kept, buffers containing a tag position are
+ * flagged with RTLSDR_BUF_TAG.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param start sample index of the first sample of the range
+ * \param end sample index after the last sample of the range
+ * \param tags array receiving the tags, in stream order
+ * \param max size of the array
+ * \return number of tags copied
+ */
+RTLSDR_API int rtlsdr_get_tags(rtlsdr_dev_t *dev, uint64_t start, uint64_t end,
+			       rtlsdr_tag_t *tags, int max);
+
 /*!
  * Enable or disable the bias tee on GPIO PIN 0.
  *
@@ -399,6 +1221,74 @@ RTLSDR_API int rtlsdr_set_bias_tee(rtlsdr_dev_t *dev, int on);
  */
 RTLSDR_API int rtlsdr_set_bias_tee_gpio(rtlsdr_dev_t *dev, int gpio, int on);
 
+/* commands for rtlsdr_submit_ctrl(), numbered like the rtl_tcp protocol */
+enum rtlsdr_ctrl_cmd {
+	RTLSDR_CTRL_CENTER_FREQ = 0x01,
+	RTLSDR_CTRL_SAMPLE_RATE = 0x02,
+	RTLSDR_CTRL_TUNER_GAIN_MODE = 0x03,
+	RTLSDR_CTRL_TUNER_GAIN = 0x04,
+	RTLSDR_CTRL_FREQ_CORRECTION = 0x05,
+	RTLSDR_CTRL_TUNER_IF_GAIN = 0x06,	/* stage << 16 | (uint16_t)gain */
+	RTLSDR_CTRL_TESTMODE = 0x07,
+	RTLSDR_CTRL_AGC_MODE = 0x08,
+	RTLSDR_CTRL_DIRECT_SAMPLING = 0x09,
+	RTLSDR_CTRL_OFFSET_TUNING = 0x0a,
+	RTLSDR_CTRL_RTL_XTAL = 0x0b,
+	RTLSDR_CTRL_TUNER_XTAL = 0x0c,
+	RTLSDR_CTRL_TUNER_GAIN_INDEX = 0x0d,	/* index into rtlsdr_get_tuner_gains() */
+	RTLSDR_CTRL_BIAS_TEE = 0x0e
+};
+
+typedef void(*rtlsdr_ctrl_cb_t)(enum rtlsdr_ctrl_cmd cmd, uint32_t param,
+				int result, void *ctx);
+
+/*!
+ * Queue a control command without waiting for it. While streaming, the
+ * commands are executed in order by the thread handling the stream events,
+ * in between transfer completions. Otherwise the command is executed right
+ * away by the calling thread. May be called from any thread.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param cmd command to execute
+ * \param param parameter of the command, as for the matching rtlsdr_set_*()
+ * \param cb optional callback receiving the result of the matching
+ *	     rtlsdr_set_*() call once the command has been executed
+ * \param ctx user specific context to pass via the callback function
+ * \return 0 on success, -EBUSY if the queue is full
+ */
+RTLSDR_API int rtlsdr_submit_ctrl(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_cmd cmd,
+				  uint32_t param, rtlsdr_ctrl_cb_t cb,
+				  void *ctx);
+
+/*!
+ * Record every control transfer to the device into a binary trace file:
+ * the request, its data, the result and how long it took. The
+ * rtlsdr_set_*() calls matching an enum rtlsdr_ctrl_cmd are marked in
+ * the trace, so the transfers can be attributed to the call issuing them.
+ *
+ * When the environment variable RTLSDR_TRACE is set, rtlsdr_open()
+ * starts a trace to the file it names before the device is set up.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param path file to write the trace to, an existing file is replaced.
+ *	       NULL stops tracing.
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_trace(rtlsdr_dev_t *dev, const char *path);
+
+/*!
+ * Issue the API calls recorded in a trace again, against a device that
+ * answers the control reads with the data from the trace instead of
+ * hardware. The replay starts from the tuner and the settings the trace
+ * was started with. Tracing the replay shows how many transfers each
+ * call takes with this version of the library.
+ *
+ * \param path trace written by rtlsdr_set_trace()
+ * \param out_path file to write the trace of the replay to, may be NULL
+ * \return number of calls replayed, or a negative value on error
+ */
+RTLSDR_API int rtlsdr_replay_trace(const char *path, const char *out_path);
+
 
 #ifdef __cplusplus
 }
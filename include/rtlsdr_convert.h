@@ -0,0 +1,48 @@
+#ifndef __RTLSDR_CONVERT_H
+#define __RTLSDR_CONVERT_H
+
+#include <stdint.h>
+
+struct rtlsdr_iq_stats;
+
+/* sample format conversion state, see rtlsdr_set_output_format() */
+typedef struct rtlsdr_convert {
+	int format;		/* enum rtlsdr_output_format */
+	int16_t gain;		/* cs16 multiplier */
+	float scale;		/* cf32 multiplier */
+	int dc_correct;
+	float dc[2];		/* I/Q DC level in raw units */
+	/* IQ imbalance correction, Q is replaced by iq_d * Q + iq_c * I */
+	int iq_correct;
+	float iq_c;
+	float iq_d;
+	float var[3];		/* I and Q variance, I/Q covariance */
+	uint64_t iq_n;		/* buffers the estimates are based on */
+	/* kernels selected for the running CPU */
+	void (*cs16)(const uint8_t *in, int16_t *out, uint32_t len,
+		     const int16_t *off, int16_t gain);
+	void (*cf32)(const uint8_t *in, float *out, uint32_t len,
+		     const float *off, float scale);
+	void (*sum)(const uint8_t *in, uint32_t len, uint64_t *sum);
+	void (*moments)(const uint8_t *in, uint32_t len, int64_t *m);
+	void (*iq)(float *buf, uint32_t len, float c, float d);
+	void (*f_cs16)(const float *in, int16_t *out, uint32_t len,
+		       float gain);
+	void (*f_cu8)(const float *in, uint8_t *out, uint32_t len);
+	void (*f_scale)(const float *in, float *out, uint32_t len,
+			float scale);
+} rtlsdr_convert_t;
+
+void rtlsdr_convert_init(rtlsdr_convert_t *c, int format, float scale,
+			 int dc_correct, int iq_correct);
+unsigned int rtlsdr_convert_size(const rtlsdr_convert_t *c);
+void rtlsdr_convert(rtlsdr_convert_t *c, const uint8_t *in, void *out,
+		    uint32_t len);
+void rtlsdr_convert_correct(rtlsdr_convert_t *c, int dc_correct,
+			   int iq_correct);
+void rtlsdr_convert_stats(const rtlsdr_convert_t *c,
+			  struct rtlsdr_iq_stats *stats);
+void rtlsdr_convert_float(const rtlsdr_convert_t *c, const float *in,
+			  void *out, uint32_t len);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __RTLSDR_DDC_H
+#define __RTLSDR_DDC_H
+
+#include <stdint.h>
+
+#define DDC_CIC_ORDER	4
+#define DDC_MAX_HB	2	/* halfband stages between CIC and FIR */
+#define DDC_HB_TAPS	23
+#define DDC_FIR_TAPS	63
+#define DDC_MAX_DECIM	8192
+#define DDC_MAX_CIC	1024
+
+/* decimating FIR on complex samples */
+typedef struct rtlsdr_ddc_fir {
+	int taps;		/* 0 for a disabled stage */
+	int decim;
+	int phase;		/* inputs until the next output */
+	int pos;
+	const float *h;
+	float dl[2][2 * DDC_FIR_TAPS];	/* I and Q history, stored twice */
+} rtlsdr_ddc_fir_t;
+
+/* digital down-converter state, see rtlsdr_set_ddc() */
+typedef struct rtlsdr_ddc {
+	uint32_t decim;		/* total decimation */
+	uint32_t cic_r;		/* CIC decimation, 1 for none */
+	int hb_num;
+	int32_t offset;		/* Hz, shifted down to 0 Hz */
+	/* NCO, the step is computed for rate and step_offset */
+	uint32_t rate;
+	int32_t step_offset;
+	double phase;
+	double step;
+	/* CIC decimator, wraps around modulo 2^64 */
+	uint32_t cic_cnt;
+	float cic_gain;
+	uint64_t integ[2][DDC_CIC_ORDER];
+	uint64_t comb[2][DDC_CIC_ORDER];
+	/* halfband stages and the CIC compensating FIR */
+	float hb_h[DDC_HB_TAPS];
+	float fir_h[DDC_FIR_TAPS];
+	rtlsdr_ddc_fir_t hb[DDC_MAX_HB];
+	rtlsdr_ddc_fir_t fir;
+	/* mixer output */
+	int32_t *mix_buf;
+	uint32_t mix_len;	/* complex samples */
+	/* mixer kernel selected for the running CPU */
+	void (*mix)(const float *in, int32_t *out, uint32_t n,
+		    double phase, double step);
+} rtlsdr_ddc_t;
+
+int rtlsdr_ddc_init(rtlsdr_ddc_t *d, uint32_t decim);
+void rtlsdr_ddc_free(rtlsdr_ddc_t *d);
+void rtlsdr_ddc_reset(rtlsdr_ddc_t *d);
+int rtlsdr_ddc_reserve(rtlsdr_ddc_t *d, uint32_t n);
+int rtlsdr_ddc_process(rtlsdr_ddc_t *d, float *buf, uint32_t n,
+		       uint32_t rate);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __RTLSDR_SIM_H
+#define __RTLSDR_SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* sample source of a simulated device, see rtlsdr_open_sim() */
+typedef struct rtlsdr_sim {
+	FILE *file;		/* recorded cu8 samples, NULL for synthetic */
+	int loop;		/* rewind the file at its end */
+	int realtime;		/* deliver at the sample rate */
+	double tone;		/* Hz from the center frequency */
+	double amp;		/* tone amplitude at 30 dB gain, in LSB */
+	double noise;		/* noise amplitude at 30 dB gain, in LSB */
+	double re, im;		/* tone phasor */
+	uint32_t seed;
+} rtlsdr_sim_t;
+
+int rtlsdr_sim_init(rtlsdr_sim_t *sim, const char *spec);
+void rtlsdr_sim_free(rtlsdr_sim_t *sim);
+int rtlsdr_sim_read(rtlsdr_sim_t *sim, uint8_t *buf, uint32_t len,
+		    uint32_t rate, int gain);
+
+#endif
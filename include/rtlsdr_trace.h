@@ -0,0 +1,96 @@
+#ifndef __RTLSDR_TRACE_H
+#define __RTLSDR_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * A trace starts with the magic, followed by records of a fixed size
+ * header and a payload of len bytes. All fields are little endian.
+ */
+#define RTLSDR_TRACE_MAGIC	"RTLTRC01"
+#define RTLSDR_TRACE_MAGIC_LEN	8
+#define RTLSDR_TRACE_REC_LEN	20
+
+enum rtlsdr_trace_type {
+	RTLSDR_TRACE_CTRL = 1,	/* control transfer, payload is its data */
+	RTLSDR_TRACE_CALL = 2,	/* API call, value is the command */
+	RTLSDR_TRACE_RET = 3,	/* end of the call */
+	RTLSDR_TRACE_INFO = 4	/* device state, see rtlsdr_trace_info_t */
+};
+
+#define RTLSDR_TRACE_IN		(1 << 0)	/* device to host */
+#define RTLSDR_TRACE_BATCHED	(1 << 1)	/* submitted without waiting */
+
+typedef struct rtlsdr_trace_rec {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t len;		/* payload bytes */
+	uint16_t value;		/* wValue or command */
+	uint16_t index;		/* wIndex */
+	int32_t status;		/* transfer result, call parameter or result */
+	uint32_t time_us;	/* since the trace was started */
+	uint32_t dur_us;
+} rtlsdr_trace_rec_t;
+
+/* state a replay starts from */
+typedef struct rtlsdr_trace_info {
+	uint32_t tuner_type;
+	uint32_t rtl_xtal;
+	uint32_t tun_xtal;
+	int32_t corr;
+	uint32_t rate;
+	uint32_t freq;
+	int32_t direct_sampling;
+	int32_t offset_tuning;
+	int32_t gain_manual;
+	int32_t gain;
+	int32_t agc_on;
+	uint32_t bias_gpio;
+	char manufact[256];
+	char product[256];
+} rtlsdr_trace_info_t;
+
+int rtlsdr_trace_write(FILE *f, const rtlsdr_trace_rec_t *rec,
+		       const uint8_t *payload);
+int rtlsdr_trace_read(FILE *f, rtlsdr_trace_rec_t *rec, uint8_t *payload);
+int rtlsdr_trace_check(FILE *f);
+uint16_t rtlsdr_trace_pack_info(const rtlsdr_trace_info_t *info,
+				uint8_t *buf);
+void rtlsdr_trace_unpack_info(rtlsdr_trace_info_t *info, const uint8_t *buf,
+			      uint16_t len);
+
+/* a control read answered from a trace */
+typedef struct rtlsdr_mock_read {
+	uint16_t value;
+	uint16_t index;
+	uint16_t len;
+	uint8_t ptr;		/* I2C register pointer the read was done at */
+	uint32_t off;		/* data in rtlsdr_mock_t.data */
+} rtlsdr_mock_read_t;
+
+typedef struct rtlsdr_mock_call {
+	uint16_t cmd;
+	uint32_t param;
+	uint32_t read;		/* first read after the call was started */
+} rtlsdr_mock_call_t;
+
+/* control transport that plays back the device side of a trace */
+typedef struct rtlsdr_mock {
+	rtlsdr_trace_info_t info;
+	rtlsdr_mock_read_t *reads;
+	uint32_t reads_num;
+	uint8_t *data;
+	rtlsdr_mock_call_t *calls;
+	uint32_t calls_num;
+	uint32_t next;		/* read to try first */
+	uint8_t ptr[256];	/* register pointer per I2C address */
+} rtlsdr_mock_t;
+
+int rtlsdr_mock_init(rtlsdr_mock_t *m, const char *path);
+void rtlsdr_mock_free(rtlsdr_mock_t *m);
+void rtlsdr_mock_seek(rtlsdr_mock_t *m, uint32_t call);
+int rtlsdr_mock_ctrl(rtlsdr_mock_t *m, int in, uint16_t value,
+		     uint16_t index, uint8_t *data, uint16_t len);
+
+#endif
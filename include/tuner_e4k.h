@@ -190,12 +190,36 @@ struct e4k_pll_params {
 	uint8_t threephase;
 };
 
+/* PLL and filter settings of one raster channel */
+struct e4k_chan {
+	uint32_t flo;
+	uint16_t x;
+	uint8_t z;
+	uint8_t r;
+	uint8_t r_idx;
+	uint8_t band;
+	uint8_t rf_filt;
+};
+
+#define E4K_NUM_SHADOW	0x80
+
 struct e4k_state {
 	void *i2c_dev;
 	uint8_t i2c_addr;
 	enum e4k_band band;
 	struct e4k_pll_params vco;
 	void *rtl_dev;
+
+	/* register contents last written or read */
+	uint8_t regs[E4K_NUM_SHADOW];
+	uint8_t regs_valid[E4K_NUM_SHADOW / 8];
+
+	/* channel raster, see e4k_set_raster() */
+	struct e4k_chan *chan;
+	uint32_t chan_start;
+	uint32_t chan_step;
+	uint32_t chan_num;
+	uint32_t chan_fosc;	/* the table was computed for */
 };
 
 int e4k_init(struct e4k_state *e4k);
@@ -204,6 +228,9 @@ int e4k_if_gain_set(struct e4k_state *e4k, uint8_t stage, int8_t value);
 int e4k_mixer_gain_set(struct e4k_state *e4k, int8_t value);
 int e4k_commonmode_set(struct e4k_state *e4k, int8_t value);
 int e4k_tune_freq(struct e4k_state *e4k, uint32_t freq);
+int e4k_get_lock(struct e4k_state *e4k);
+int e4k_set_raster(struct e4k_state *e4k, uint32_t start, uint32_t step,
+		   uint32_t num);
 int e4k_tune_params(struct e4k_state *e4k, struct e4k_pll_params *p);
 uint32_t e4k_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint32_t intended_flo);
 int e4k_if_filter_bw_get(struct e4k_state *e4k, enum e4k_if_filter filter);
@@ -77,12 +77,16 @@ struct r82xx_priv {
 
 	uint8_t				regs[NUM_REGS];
 	uint8_t				buf[NUM_REGS + 1];
+	uint8_t				img[NUM_REGS];	/* target while staging */
+	uint32_t			touched;	/* registers set in img */
+	int				staging;
 	enum r82xx_xtal_cap_value	xtal_cap_sel;
 	uint16_t			pll;	/* kHz */
 	uint32_t			int_freq;
 	uint8_t				fil_cal_code;
 	uint8_t				input;
 	int				has_lock;
+	int				recording;	/* see rtlsdr_set_hop_table() */
 	int				init_done;
 
 	/* Store current mode */
@@ -114,7 +118,9 @@ enum r82xx_delivery_system {
 int r82xx_standby(struct r82xx_priv *priv);
 int r82xx_init(struct r82xx_priv *priv);
 int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq);
+int r82xx_get_lock(struct r82xx_priv *priv);
 int r82xx_set_gain(struct r82xx_priv *priv, int set_manual_gain, int gain);
+int r82xx_set_gain_index(struct r82xx_priv *priv, unsigned int index);
 int r82xx_set_bandwidth(struct r82xx_priv *priv, int bandwidth,  uint32_t rate);
 
 #endif
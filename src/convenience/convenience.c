@@ -249,60 +249,54 @@ int verbose_device_search(char *s)
 {
 	int i, device_count, device, offset;
 	char *s2;
-	char vendor[256], product[256], serial[256];
-	device_count = rtlsdr_get_device_count();
-	if (!device_count) {
+	rtlsdr_device_info_t *list;
+	device_count = rtlsdr_get_device_list(&list);
+	if (device_count <= 0) {
+		rtlsdr_free_device_list(list);
 		fprintf(stderr, "No supported devices found.\n");
 		return -1;
 	}
 	fprintf(stderr, "Found %d device(s):\n", device_count);
 	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		fprintf(stderr, "  %d:  %s, %s, SN: %s\n", i, vendor, product, serial);
+		fprintf(stderr, "  %d:  %s, %s, SN: %s\n", i, list[i].manufact, list[i].product, list[i].serial);
 	}
 	fprintf(stderr, "\n");
 	/* does string look like raw id number */
 	device = (int)strtol(s, &s2, 0);
 	if (s2[0] == '\0' && device >= 0 && device < device_count) {
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+		goto found;
 	}
 	/* does string exact match a serial */
 	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		if (strcmp(s, serial) != 0) {
+		if (strcmp(s, list[i].serial) != 0) {
 			continue;}
 		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+		goto found;
 	}
 	/* does string prefix match a serial */
 	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		if (strncmp(s, serial, strlen(s)) != 0) {
+		if (strncmp(s, list[i].serial, strlen(s)) != 0) {
 			continue;}
 		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+		goto found;
 	}
 	/* does string suffix match a serial */
 	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		offset = strlen(serial) - strlen(s);
+		offset = strlen(list[i].serial) - strlen(s);
 		if (offset < 0) {
 			continue;}
-		if (strncmp(s, serial+offset, strlen(s)) != 0) {
+		if (strncmp(s, list[i].serial+offset, strlen(s)) != 0) {
 			continue;}
 		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
+		goto found;
 	}
+	rtlsdr_free_device_list(list);
 	fprintf(stderr, "No matching devices found.\n");
 	return -1;
+found:
+	fprintf(stderr, "Using device %d: %s\n", device, list[device].name);
+	rtlsdr_free_device_list(list);
+	return device;
 }
 
 // vim: tabstop=8:softtabstop=8:shiftwidth=8:noexpandtab
@@ -17,6 +17,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
@@ -24,10 +28,18 @@
 #include <stdlib.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #define min(a, b) (((a) < (b)) ? (a) : (b))
+#else
+#include <sys/timeb.h>
 #endif
 
 #include <libusb.h>
+#include <pthread.h>
 
 /*
  * All libusb callback functions should be marked with the LIBUSB_CALL macro
@@ -42,12 +54,36 @@
 /* two raised to the power of n */
 #define TWO_POW(n)		((double)(1ULL<<(n)))
 
+/*
+ * Atomic accessors for state shared between the libusb event thread and
+ * consumer threads. Only naturally aligned 32 and 64 bit integers are used.
+ */
+#ifdef _MSC_VER
+#define ATOMIC_LOAD(p)		InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define ATOMIC_STORE(p, v)	InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define ATOMIC_ADD(p, v)	InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+#define ATOMIC_LOAD64(p)	InterlockedCompareExchange64((volatile LONGLONG *)(p), 0, 0)
+#define ATOMIC_STORE64(p, v)	InterlockedExchange64((volatile LONGLONG *)(p), (LONGLONG)(v))
+#define ATOMIC_ADD64(p, v)	InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v))
+#else
+#define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD64(p)	__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE64(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD64(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
 #include "rtl-sdr.h"
 #include "tuner_e4k.h"
 #include "tuner_fc0012.h"
 #include "tuner_fc0013.h"
 #include "tuner_fc2580.h"
 #include "tuner_r82xx.h"
+#include "rtlsdr_convert.h"
+#include "rtlsdr_ddc.h"
+#include "rtlsdr_sim.h"
+#include "rtlsdr_trace.h"
 
 typedef struct rtlsdr_tuner_iface {
 	/* tuner interface */
@@ -66,6 +102,121 @@ enum rtlsdr_async_status {
 	RTLSDR_RUNNING
 };
 
+enum rtlsdr_async_mode {
+	RTLSDR_ASYNC_CALLBACK = 0,
+	RTLSDR_ASYNC_RING
+};
+
+/* per transfer bookkeeping, passed to libusb as user data */
+typedef struct rtlsdr_xfer_ctx {
+	struct rtlsdr_dev *dev;
+	uint32_t idx;	/* transfer index */
+	uint32_t buf;	/* index of the buffer currently attached */
+	int parked;	/* held back by the adaptive depth control */
+	int busy;	/* submitted and not completed yet */
+	int sim_queued;	/* waiting in the queue of a simulated device */
+	int sim_cancel;
+} rtlsdr_xfer_ctx_t;
+
+enum rtlsdr_recover_state {
+	RTLSDR_RECOVER_IDLE = 0,
+	RTLSDR_RECOVER_CANCEL,	/* cancel the outstanding transfers */
+	RTLSDR_RECOVER_REAP,	/* wait for them to come back */
+	RTLSDR_RECOVER_ATTACH,	/* wait for the device to reappear */
+};
+
+/* queued command, see rtlsdr_submit_ctrl() */
+#define CTRL_QUEUE_LEN	32
+#define TAG_RING_LEN	64
+
+typedef struct rtlsdr_ctrl_req {
+	enum rtlsdr_ctrl_cmd cmd;
+	uint32_t param;
+	rtlsdr_ctrl_cb_t cb;
+	void *ctx;
+} rtlsdr_ctrl_req_t;
+
+/* control transfer of a batch, see _rtlsdr_batch_submit() */
+typedef struct rtlsdr_ctrl_op {
+	struct libusb_transfer *xfer;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 256];
+} rtlsdr_ctrl_op_t;
+
+/* precomputed tuner register writes, see rtlsdr_set_hop_table() */
+#define HOP_KEY_LEN	4
+#define HOP_SEQ_MAX	128
+
+typedef struct rtlsdr_hop {
+	uint32_t freq;
+	uint8_t val[256];	/* final register values, indexed by register */
+	uint8_t mask[32];	/* bitmap of registers written while tuning */
+	uint8_t seq[HOP_SEQ_MAX][2];	/* register and value, in driver order */
+	unsigned int seq_n;
+	struct e4k_pll_params vco;
+	enum e4k_band band;
+} rtlsdr_hop_t;
+
+/* event thread with its own libusb context, serving the devices of a
+ * shared context that were assigned to it */
+typedef struct rtlsdr_loop {
+	libusb_context *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled when a stream has ended */
+	struct rtlsdr_dev *pending;	/* streams not yet picked up */
+	unsigned int users;	/* devices opened on this loop */
+	int quit;
+} rtlsdr_loop_t;
+
+struct rtlsdr_context {
+	uint32_t num_loops;
+	rtlsdr_loop_t *loops;
+};
+
+/*
+ * Single-producer/single-consumer queue of buffer indices. The producer
+ * only ever writes head, the consumer only ever writes tail.
+ */
+typedef struct rtlsdr_spsc {
+	uint32_t *slot;
+	uint32_t mask;
+	uint32_t head;
+	uint32_t tail;
+} rtlsdr_spsc_t;
+
+/* consumer of a fanned out ring stream, see rtlsdr_subscribe() */
+#define RING_MAX_SUBS	8
+
+typedef struct rtlsdr_sub {
+	int used;
+	int policy;
+	uint32_t queue_len;	/* as requested, 0 for no limit */
+	uint32_t *slot;		/* queued buffer ids */
+	uint32_t size;		/* capacity of slot */
+	uint32_t head;
+	uint32_t tail;
+	uint64_t drops;
+} rtlsdr_sub_t;
+
+typedef struct rtlsdr_ring {
+	rtlsdr_spsc_t fill;	/* event thread -> consumer */
+	rtlsdr_spsc_t free;	/* consumers -> event thread, pushed under lock */
+	uint32_t *len;		/* valid bytes per buffer */
+	rtlsdr_buf_info_t *info;	/* metadata per buffer */
+	uint32_t overruns;
+	uint64_t overrun_bytes;
+	int active;
+	int waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* with subscribers, buffers go to them instead of the fill queue
+	 * and return to the free queue once all references are dropped,
+	 * both under lock */
+	int nsubs;
+	rtlsdr_sub_t subs[RING_MAX_SUBS];
+	uint32_t *ref;		/* subscribers holding each buffer */
+} rtlsdr_ring_t;
+
 #define FIR_LEN 16
 
 /*
@@ -91,13 +242,114 @@ struct rtlsdr_dev {
 	struct libusb_device_handle *devh;
 	uint32_t xfer_buf_num;
 	uint32_t xfer_buf_len;
+	uint32_t xfer_buf_cnt; /* allocated buffers, >= xfer_buf_num */
 	struct libusb_transfer **xfer;
+	rtlsdr_xfer_ctx_t *xfer_ctx;
 	unsigned char **xfer_buf;
+	int xfer_keep; /* keep the buffers between streams */
 	rtlsdr_read_async_cb_t cb;
+	rtlsdr_read_async_ex_cb_t cb_ex;
 	void *cb_ctx;
 	enum rtlsdr_async_status async_status;
+	enum rtlsdr_async_mode async_mode;
 	int async_cancel;
 	int use_zerocopy;
+	/* stream continuity tracking */
+	uint64_t sample_count; /* complex samples received so far */
+	uint64_t anchor_ns; /* time base for the overflow heuristic */
+	uint64_t anchor_samples;
+	uint32_t anchor_seq; /* odd while the anchor is being updated */
+	/* stream tags, written by any thread under tag_lock */
+	pthread_mutex_t tag_lock;
+	rtlsdr_tag_t tags[TAG_RING_LEN];
+	uint32_t tag_head; /* tags written */
+	uint32_t tag_seen; /* tags flagged in a buffer by the event thread */
+	uint64_t tag_last; /* index of the latest tag */
+	int gap_pending;
+	/* library owned event thread */
+	pthread_t async_thread;
+	int async_thread_active;
+	int async_cpu; /* -1 for no affinity */
+	int async_rt_prio; /* 0 for default scheduling */
+	pthread_t async_loop_thread; /* thread handling the stream events */
+	int async_loop_active;
+	rtlsdr_ring_t ring;
+	/* adaptive transfer depth and size */
+	int adapt;
+	uint32_t adapt_min_num;
+	uint32_t adapt_max_num;
+	uint32_t adapt_min_len;
+	uint32_t adapt_max_len;
+	uint32_t xfer_active; /* transfers to keep in flight */
+	uint32_t xfer_inflight;
+	uint32_t xfer_len; /* length of (re)submitted transfers */
+	uint64_t adapt_last_ns; /* previous completion */
+	uint64_t adapt_window_ns; /* start of the measurement window */
+	uint64_t adapt_stall_ns; /* worst stall seen in the window */
+	uint32_t adapt_calm; /* consecutive windows with plenty headroom */
+	/* pooled transfer buffers */
+	int pool_enabled;
+	uint32_t pool_flags;
+	int pool_node; /* NUMA node, -1 for any */
+	unsigned char *pool_mem;
+	size_t pool_size;
+	/* coalesced control writes */
+	int batch_depth;
+	int batch_bypass;
+	rtlsdr_ctrl_op_t *batch;
+	unsigned int batch_used;
+	int batch_pending;
+	int batch_status; /* first error of the batch */
+	/* shared event thread, NULL if the device has its own context */
+	rtlsdr_loop_t *loop;
+	struct rtlsdr_dev *loop_next;
+	int loop_attached;
+	/* frequency hop table */
+	rtlsdr_hop_t *hop;
+	uint32_t hop_n;
+	uint8_t hop_regs[32]; /* union of all entry masks */
+	uint32_t hop_key[HOP_KEY_LEN]; /* tuner setup the table was built for */
+	rtlsdr_hop_t *hop_cap; /* entry being captured */
+	uint8_t hop_ptr; /* register pointer of the next capture read */
+	/* last values written to the tuner registers */
+	uint8_t i2c_img[256];
+	uint8_t i2c_valid[32];
+	/* I2C traffic, running and of the last retune */
+	uint32_t i2c_xfers;
+	uint32_t i2c_bytes;
+	uint32_t last_tune_xfers;
+	uint32_t last_tune_bytes;
+	/* I2C repeater, see rtlsdr_tuner_session_begin() */
+	int i2c_rep; /* state last written, -1 if unknown */
+	int i2c_session; /* nesting depth of open sessions */
+	int i2c_policy;
+	/* commands executed by the event loop */
+	pthread_mutex_t ctrl_lock;
+	rtlsdr_ctrl_req_t ctrl_q[CTRL_QUEUE_LEN];
+	uint32_t ctrl_head;
+	uint32_t ctrl_tail;
+	int ctrl_accept;
+	/* stream statistics, written by the event thread only */
+	rtlsdr_stream_stats_t stats;
+	/* output format conversion */
+	rtlsdr_convert_t conv;
+	unsigned char *conv_buf;
+	size_t conv_buf_len;
+	/* digital down-converter, NULL when disabled */
+	rtlsdr_ddc_t *ddc;
+	rtlsdr_convert_t ddc_conv; /* raw samples to floats for the DDC */
+	float *ddc_buf;
+	size_t ddc_buf_len; /* floats */
+	/* rtlsdr_read_sync() served from a ring stream */
+	uint32_t sync_num; /* 0 for a bulk transfer per read */
+	uint32_t sync_len;
+	int sync_active;
+	int sync_id; /* buffer being read, -1 for none */
+	unsigned char *sync_buf;
+	uint32_t sync_off;
+	uint32_t sync_avail;
+	int sync_gap; /* samples were lost before sync_buf */
+	uint64_t sync_skip; /* samples before this index are dropped */
 	/* rtl demod context */
 	uint32_t rate; /* Hz */
 	uint32_t rtl_xtal; /* Hz */
@@ -115,16 +367,60 @@ struct rtlsdr_dev {
 	struct e4k_state e4k_s;
 	struct r82xx_config r82xx_c;
 	struct r82xx_priv r82xx_p;
+	/* settings that aren't read back from the device */
+	int gain_manual;
+	int agc_on;
+	uint8_t bias_gpio; /* GPIOs driven high by rtlsdr_set_bias_tee_gpio() */
 	/* status */
 	int dev_lost;
 	int driver_active;
 	unsigned int xfer_errors;
+	/* stream recovery, see rtlsdr_set_recovery() */
+	int recover_flags;
+	uint32_t recover_timeout_ms;
+	enum rtlsdr_recover_state recover_state;
+	uint64_t recover_deadline_ns;
+	uint64_t recover_next_ns; /* next reattach attempt */
+	int recover_lost; /* the device has to be reattached */
+	unsigned int recover_tries;
+	int recover_arrived; /* set by the hotplug callback */
+	int hotplug_registered;
+	libusb_hotplug_callback_handle hotplug;
+	char serial[256];
+	/* simulated device, NULL for a real one */
+	rtlsdr_sim_t *sim;
+	uint32_t *sim_q; /* submitted transfers in order */
+	uint32_t sim_head;
+	uint32_t sim_tail;
+	uint64_t sim_t0; /* pacing time base */
+	uint64_t sim_samples;
+	uint32_t sim_rate; /* rate the time base was set up for */
+	int sim_agc;
+	/* control transfer trace, see rtlsdr_set_trace() */
+	FILE *trace;
+	pthread_mutex_t trace_lock;
+	uint64_t trace_t0;
+	uint64_t trace_call_t0;
+	int trace_depth; /* nesting of the traced API calls */
+	rtlsdr_mock_t *mock; /* transport of rtlsdr_replay_trace() */
 	char manufact[256];
 	char product[256];
 };
 
 void rtlsdr_set_gpio_bit(rtlsdr_dev_t *dev, uint8_t gpio, int val);
+int rtlsdr_check_dongle_model(void *dev, char *manufact_check, char *product_check);
+int rtlsdr_i2c_write_fn(void *dev, uint8_t addr, uint8_t *buf, int len);
+int rtlsdr_i2c_read_fn(void *dev, uint8_t addr, uint8_t *buf, int len);
 static int rtlsdr_set_if_freq(rtlsdr_dev_t *dev, uint32_t freq);
+static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev);
+static int _rtlsdr_sim_fill(rtlsdr_dev_t *dev, unsigned char *buf,
+			    uint32_t len);
+static void _rtlsdr_add_tag(rtlsdr_dev_t *dev, uint32_t type, uint32_t value);
+static uint64_t _rtlsdr_stream_position(rtlsdr_dev_t *dev);
+static void _rtlsdr_sync_flush(rtlsdr_dev_t *dev);
+static void _rtlsdr_hotplug_deregister(rtlsdr_dev_t *dev);
+static void *_rtlsdr_loop_fn(void *arg);
+static uint64_t _rtlsdr_monotonic_ns(void);
 
 /* generic tuner interface functions, shall be moved to the tuner implementations */
 int e4000_init(void *dev) {
@@ -260,6 +556,24 @@ int r820t_set_gain_mode(void *dev, int manual) {
 	return r82xx_set_gain(&devt->r82xx_p, manual, 0);
 }
 
+/* the simulated device accepts every setting */
+static int sim_tuner_nop(void *dev) { return 0; }
+static int sim_set_freq(void *dev, uint32_t freq) { return 0; }
+static int sim_set_bw(void *dev, int bw) { return 0; }
+static int sim_set_gain(void *dev, int gain) { return 0; }
+static int sim_set_if_gain(void *dev, int stage, int gain) { return 0; }
+static int sim_set_gain_mode(void *dev, int manual) {
+	rtlsdr_dev_t* devt = (rtlsdr_dev_t*)dev;
+	devt->sim_agc = !manual;
+	return 0;
+}
+
+static rtlsdr_tuner_iface_t sim_tuner = {
+	sim_tuner_nop, sim_tuner_nop,
+	sim_set_freq, sim_set_bw, sim_set_gain, sim_set_if_gain,
+	sim_set_gain_mode
+};
+
 /* definition order must match enum rtlsdr_tuner */
 static rtlsdr_tuner_iface_t tuners[] = {
 	{
@@ -354,6 +668,22 @@ static rtlsdr_dongle_t known_devices[] = {
 #define DEFAULT_BUF_NUMBER	15
 #define DEFAULT_BUF_LENGTH	(16 * 32 * 512)
 
+/* adaptive buffering, see _rtlsdr_adapt_complete() */
+#define ADAPT_WINDOW_NS		100000000ULL
+#define ADAPT_CALM_WINDOWS	20
+
+/* stream recovery, see _rtlsdr_recover_poll() */
+#define RECOVER_POLL_NS		500000000ULL
+#define RECOVER_RETRIES		10	/* without a transfer completing */
+
+/* pooled transfer buffers, see _rtlsdr_pool_alloc() */
+#define POOL_ALIGN		4096
+#define POOL_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS		MAP_ANON
+#endif
+
 #define DEF_RTL_XTAL_FREQ	28800000
 #define MIN_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ - 1000)
 #define MAX_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ + 1000)
@@ -362,6 +692,7 @@ static rtlsdr_dongle_t known_devices[] = {
 #define CTRL_OUT	(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT)
 #define CTRL_TIMEOUT	300
 #define BULK_TIMEOUT	0
+#define CTRL_BATCH_MAX	64
 
 #define EEPROM_ADDR	0xa0
 
@@ -402,12 +733,317 @@ enum blocks {
 	IICB			= 6,
 };
 
+/*
+ * Control writes issued between _rtlsdr_batch_begin() and _rtlsdr_batch_end()
+ * are submitted as async transfers right away without waiting for them, so
+ * their USB round trips overlap. The device executes them in order. Reads
+ * are a barrier and wait for the queued writes first, so does the final
+ * _rtlsdr_batch_end(), which also reports the first error of the batch.
+ */
+static void LIBUSB_CALL _rtlsdr_batch_cb(struct libusb_transfer *xfer)
+{
+	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)xfer->user_data;
+
+	if (LIBUSB_TRANSFER_COMPLETED != xfer->status && !dev->batch_status)
+		dev->batch_status = LIBUSB_ERROR_IO;
+
+	ATOMIC_ADD(&dev->batch_pending, -1);
+}
+
+static int _rtlsdr_batch_flush(rtlsdr_dev_t *dev)
+{
+	struct timeval tv = { 1, 0 };
+	int r = 0;
+
+	while (ATOMIC_LOAD(&dev->batch_pending) > 0) {
+		r = libusb_handle_events_timeout_completed(dev->ctx, &tv, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
+			return r;
+		}
+	}
+
+	dev->batch_used = 0;
+
+	return 0;
+}
+
+static int _rtlsdr_batch_submit(rtlsdr_dev_t *dev, uint8_t type,
+				uint16_t value, uint16_t index,
+				const uint8_t *data, uint16_t len)
+{
+	rtlsdr_ctrl_op_t *op;
+
+	if (!dev->batch_depth || dev->batch_bypass || dev->sim || dev->mock)
+		return -1;
+
+	if (!dev->batch) {
+		dev->batch = calloc(CTRL_BATCH_MAX, sizeof(rtlsdr_ctrl_op_t));
+		if (!dev->batch)
+			return -1;
+	}
+
+	if (dev->batch_used == CTRL_BATCH_MAX) {
+		_rtlsdr_batch_flush(dev);
+		if (dev->batch_used == CTRL_BATCH_MAX)
+			return -1;
+	}
+
+	op = &dev->batch[dev->batch_used];
+	if (!op->xfer) {
+		op->xfer = libusb_alloc_transfer(0);
+		if (!op->xfer)
+			return -1;
+	}
+
+	libusb_fill_control_setup(op->buf, type, 0, value, index, len);
+	if (!(type & LIBUSB_ENDPOINT_IN))
+		memcpy(op->buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+	libusb_fill_control_transfer(op->xfer, dev->devh, op->buf,
+				     _rtlsdr_batch_cb, dev, CTRL_TIMEOUT);
+
+	ATOMIC_ADD(&dev->batch_pending, 1);
+	if (libusb_submit_transfer(op->xfer) < 0) {
+		ATOMIC_ADD(&dev->batch_pending, -1);
+		/* keep the order for the synchronous fallback */
+		_rtlsdr_batch_flush(dev);
+		return -1;
+	}
+
+	dev->batch_used++;
+
+	return 0;
+}
+
+static void _rtlsdr_batch_begin(rtlsdr_dev_t *dev)
+{
+	if (dev->batch_depth++)
+		return;
+
+	/* callbacks run inside the libusb event handling of the stream,
+	 * which must not be re-entered to wait for the batch */
+	dev->batch_bypass = dev->async_loop_active &&
+			    pthread_equal(pthread_self(), dev->async_loop_thread);
+}
+
+static int _rtlsdr_batch_end(rtlsdr_dev_t *dev)
+{
+	int r;
+
+	if (--dev->batch_depth)
+		return 0;
+
+	r = _rtlsdr_batch_flush(dev);
+	if (!r)
+		r = dev->batch_status;
+	dev->batch_status = 0;
+
+	/* we can't tell which of the tuner writes made it */
+	if (r < 0)
+		memset(dev->i2c_valid, 0, sizeof(dev->i2c_valid));
+
+	return r;
+}
+
+static void _rtlsdr_batch_free(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev->batch)
+		return;
+
+	if (_rtlsdr_batch_flush(dev) < 0) {
+		/* transfers may still be in flight, they must not be freed
+		 * before their callback ran */
+		for (i = 0; i < dev->batch_used; i++)
+			libusb_cancel_transfer(dev->batch[i].xfer);
+
+		if (_rtlsdr_batch_flush(dev) < 0) {
+			fprintf(stderr, "%s: leaking %d control transfers\n",
+				__FUNCTION__, ATOMIC_LOAD(&dev->batch_pending));
+			dev->batch = NULL;
+			return;
+		}
+	}
+
+	for (i = 0; i < CTRL_BATCH_MAX; i++)
+		if (dev->batch[i].xfer)
+			libusb_free_transfer(dev->batch[i].xfer);
+
+	free(dev->batch);
+	dev->batch = NULL;
+}
+
+static void _rtlsdr_trace_put(rtlsdr_dev_t *dev, rtlsdr_trace_rec_t *rec,
+			      const uint8_t *payload, uint64_t t0)
+{
+	uint64_t now = _rtlsdr_monotonic_ns();
+
+	rec->time_us = (uint32_t)((t0 - dev->trace_t0) / 1000);
+	rec->dur_us = (uint32_t)((now - t0) / 1000);
+
+	pthread_mutex_lock(&dev->trace_lock);
+	if (dev->trace && rtlsdr_trace_write(dev->trace, rec, payload) < 0) {
+		fprintf(stderr, "Writing the trace failed, stopped tracing\n");
+		fclose(dev->trace);
+		dev->trace = NULL;
+	}
+	pthread_mutex_unlock(&dev->trace_lock);
+}
+
+static void _rtlsdr_trace_ctrl(rtlsdr_dev_t *dev, uint8_t flags,
+			       uint16_t value, uint16_t index,
+			       const uint8_t *data, uint16_t len, int r,
+			       uint64_t t0)
+{
+	rtlsdr_trace_rec_t rec;
+
+	rec.type = RTLSDR_TRACE_CTRL;
+	rec.flags = flags;
+	rec.value = value;
+	rec.index = index;
+	rec.status = r;
+	/* reads carry what was actually returned */
+	if (!data)
+		rec.len = 0;
+	else if (flags & RTLSDR_TRACE_IN)
+		rec.len = r > 0 ? r : 0;
+	else
+		rec.len = len;
+
+	_rtlsdr_trace_put(dev, &rec, data, t0);
+}
+
+static void _rtlsdr_trace_info(rtlsdr_dev_t *dev)
+{
+	rtlsdr_trace_info_t info;
+	rtlsdr_trace_rec_t rec;
+	uint8_t buf[sizeof(info)];
+
+	memset(&info, 0, sizeof(info));
+	info.tuner_type = dev->tuner_type;
+	info.rtl_xtal = dev->rtl_xtal;
+	info.tun_xtal = dev->tun_xtal;
+	info.corr = dev->corr;
+	info.rate = dev->rate;
+	info.freq = dev->freq;
+	info.direct_sampling = dev->direct_sampling;
+	info.offset_tuning = dev->offs_freq != 0;
+	info.gain_manual = dev->gain_manual;
+	info.gain = dev->gain;
+	info.agc_on = dev->agc_on;
+	info.bias_gpio = dev->bias_gpio;
+	memcpy(info.manufact, dev->manufact, sizeof(info.manufact));
+	memcpy(info.product, dev->product, sizeof(info.product));
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = RTLSDR_TRACE_INFO;
+	rec.len = rtlsdr_trace_pack_info(&info, buf);
+
+	_rtlsdr_trace_put(dev, &rec, buf, _rtlsdr_monotonic_ns());
+}
+
+/* marks an API call, transfers of nested calls belong to the outer one */
+static void _rtlsdr_trace_enter(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_cmd cmd,
+				uint32_t param)
+{
+	rtlsdr_trace_rec_t rec;
+
+	if (!dev->trace || dev->trace_depth++)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = RTLSDR_TRACE_CALL;
+	rec.value = cmd;
+	rec.status = (int32_t)param;
+
+	dev->trace_call_t0 = _rtlsdr_monotonic_ns();
+	_rtlsdr_trace_put(dev, &rec, NULL, dev->trace_call_t0);
+}
+
+static int _rtlsdr_trace_leave(rtlsdr_dev_t *dev, int r)
+{
+	rtlsdr_trace_rec_t rec;
+
+	if (!dev->trace_depth || --dev->trace_depth || !dev->trace)
+		return r;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = RTLSDR_TRACE_RET;
+	rec.status = r;
+
+	_rtlsdr_trace_put(dev, &rec, NULL, dev->trace_call_t0);
+
+	return r;
+}
+
+/* all vendor control transfers go through these two */
+static int _rtlsdr_ctrl_write(rtlsdr_dev_t *dev, uint16_t value,
+			      uint16_t index, uint8_t *data, uint16_t len)
+{
+	uint64_t t0 = 0;
+	uint8_t flags = 0;
+	int r;
+
+	if (dev->sim)
+		return len;
+
+	if (dev->trace)
+		t0 = _rtlsdr_monotonic_ns();
+
+	if (dev->mock) {
+		r = rtlsdr_mock_ctrl(dev->mock, 0, value, index, data, len);
+	} else if (!_rtlsdr_batch_submit(dev, CTRL_OUT, value, index, data,
+					 len)) {
+		r = len;
+		flags = RTLSDR_TRACE_BATCHED;
+	} else {
+		r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, value,
+					    index, data, len, CTRL_TIMEOUT);
+	}
+
+	if (dev->trace)
+		_rtlsdr_trace_ctrl(dev, flags, value, index, data, len, r, t0);
+
+	return r;
+}
+
+static int _rtlsdr_ctrl_read(rtlsdr_dev_t *dev, uint16_t value,
+			     uint16_t index, uint8_t *data, uint16_t len)
+{
+	uint64_t t0 = 0;
+	int r;
+
+	if (dev->sim) {
+		memset(data, 0, len);
+		return len;
+	}
+
+	if (ATOMIC_LOAD(&dev->batch_pending))
+		_rtlsdr_batch_flush(dev);
+
+	if (dev->trace)
+		t0 = _rtlsdr_monotonic_ns();
+
+	if (dev->mock)
+		r = rtlsdr_mock_ctrl(dev->mock, 1, value, index, data, len);
+	else
+		r = libusb_control_transfer(dev->devh, CTRL_IN, 0, value,
+					    index, data, len, CTRL_TIMEOUT);
+
+	if (dev->trace)
+		_rtlsdr_trace_ctrl(dev, RTLSDR_TRACE_IN, value, index, data,
+				   len, r, t0);
+
+	return r;
+}
+
 int rtlsdr_read_array(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_t *array, uint8_t len)
 {
 	int r;
 	uint16_t index = (block << 8);
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, array, len, CTRL_TIMEOUT);
+	r = _rtlsdr_ctrl_read(dev, addr, index, array, len);
 #if 0
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -420,7 +1056,7 @@ int rtlsdr_write_array(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_t
 	int r;
 	uint16_t index = (block << 8) | 0x10;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, array, len, CTRL_TIMEOUT);
+	r = _rtlsdr_ctrl_write(dev, addr, index, array, len);
 #if 0
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -456,6 +1092,9 @@ int rtlsdr_i2c_write(rtlsdr_dev_t *dev, uint8_t i2c_addr, uint8_t *buffer, int l
 	if (!dev)
 		return -1;
 
+	dev->i2c_xfers++;
+	dev->i2c_bytes += len;
+
 	return rtlsdr_write_array(dev, IICB, addr, buffer, len);
 }
 
@@ -466,6 +1105,9 @@ int rtlsdr_i2c_read(rtlsdr_dev_t *dev, uint8_t i2c_addr, uint8_t *buffer, int le
 	if (!dev)
 		return -1;
 
+	dev->i2c_xfers++;
+	dev->i2c_bytes += len;
+
 	return rtlsdr_read_array(dev, IICB, addr, buffer, len);
 }
 
@@ -476,7 +1118,7 @@ uint16_t rtlsdr_read_reg(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_
 	uint16_t index = (block << 8);
 	uint16_t reg;
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_ctrl_read(dev, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -500,7 +1142,7 @@ int rtlsdr_write_reg(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint16_t v
 
 	data[1] = val & 0xff;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_ctrl_write(dev, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -517,7 +1159,7 @@ uint16_t rtlsdr_demod_read_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, u
 	uint16_t reg;
 	addr = (addr << 8) | 0x20;
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_ctrl_read(dev, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -541,12 +1183,20 @@ int rtlsdr_demod_write_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, uint1
 
 	data[1] = val & 0xff;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = _rtlsdr_ctrl_write(dev, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
 
-	rtlsdr_demod_read_reg(dev, 0x0a, 0x01, 1);
+	/* dummy read, its result is not needed so it does not
+	 * have to wait for the batch */
+	if (_rtlsdr_batch_submit(dev, CTRL_IN, (0x01 << 8) | 0x20, 0x0a,
+				 NULL, 1))
+		rtlsdr_demod_read_reg(dev, 0x0a, 0x01, 1);
+	else if (dev->trace)
+		_rtlsdr_trace_ctrl(dev, RTLSDR_TRACE_IN | RTLSDR_TRACE_BATCHED,
+				   (0x01 << 8) | 0x20, 0x0a, NULL, 1, 1,
+				   _rtlsdr_monotonic_ns());
 
 	return (r == len) ? 0 : -1;
 }
@@ -572,9 +1222,43 @@ void rtlsdr_set_gpio_output(rtlsdr_dev_t *dev, uint8_t gpio)
 	rtlsdr_write_reg(dev, SYSB, GPOE, r | gpio, 1);
 }
 
+static void _rtlsdr_i2c_repeater(rtlsdr_dev_t *dev, int on)
+{
+	if (dev->i2c_rep == on)
+		return;
+
+	if (rtlsdr_demod_write_reg(dev, 1, 0x01, on ? 0x18 : 0x10, 1) < 0)
+		dev->i2c_rep = -1;
+	else
+		dev->i2c_rep = on;
+}
+
+/* tuners known to work with the repeater left open while streaming */
+static int _rtlsdr_i2c_keep(rtlsdr_dev_t *dev)
+{
+	if (dev->i2c_session)
+		return 1;
+
+	if (!(dev->i2c_policy & RTLSDR_REPEATER_STREAMING) ||
+	    RTLSDR_INACTIVE == dev->async_status)
+		return 0;
+
+	switch (dev->tuner_type) {
+	case RTLSDR_TUNER_E4000:
+	case RTLSDR_TUNER_R820T:
+	case RTLSDR_TUNER_R828D:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 void rtlsdr_set_i2c_repeater(rtlsdr_dev_t *dev, int on)
 {
-	rtlsdr_demod_write_reg(dev, 1, 0x01, on ? 0x18 : 0x10, 1);
+	if (!on && _rtlsdr_i2c_keep(dev))
+		return;
+
+	_rtlsdr_i2c_repeater(dev, on);
 }
 
 int rtlsdr_set_fir(rtlsdr_dev_t *dev)
@@ -614,6 +1298,8 @@ void rtlsdr_init_baseband(rtlsdr_dev_t *dev)
 {
 	unsigned int i;
 
+	_rtlsdr_batch_begin(dev);
+
 	/* initialize USB */
 	rtlsdr_write_reg(dev, USBB, USB_SYSCTL, 0x09, 1);
 	rtlsdr_write_reg(dev, USBB, USB_EPA_MAXPKT, 0x0002, 2);
@@ -623,9 +1309,10 @@ void rtlsdr_init_baseband(rtlsdr_dev_t *dev)
 	rtlsdr_write_reg(dev, SYSB, DEMOD_CTL_1, 0x22, 1);
 	rtlsdr_write_reg(dev, SYSB, DEMOD_CTL, 0xe8, 1);
 
-	/* reset demod (bit 3, soft_rst) */
+	/* reset demod (bit 3, soft_rst), this also closes the I2C repeater */
 	rtlsdr_demod_write_reg(dev, 1, 0x01, 0x14, 1);
 	rtlsdr_demod_write_reg(dev, 1, 0x01, 0x10, 1);
+	dev->i2c_rep = 0;
 
 	/* disable spectrum inversion and adjacent channel rejection */
 	rtlsdr_demod_write_reg(dev, 1, 0x15, 0x00, 1);
@@ -662,6 +1349,8 @@ void rtlsdr_init_baseband(rtlsdr_dev_t *dev)
 
 	/* disable 4.096 MHz clock output on pin TP_CK0 */
 	rtlsdr_demod_write_reg(dev, 0, 0x0d, 0x83, 1);
+
+	_rtlsdr_batch_end(dev);
 }
 
 int rtlsdr_deinit_baseband(rtlsdr_dev_t *dev)
@@ -777,18 +1466,40 @@ int rtlsdr_get_xtal_freq(rtlsdr_dev_t *dev, uint32_t *rtl_freq, uint32_t *tuner_
 	return 0;
 }
 
-int rtlsdr_get_usb_strings(rtlsdr_dev_t *dev, char *manufact, char *product,
-			    char *serial)
+#define SIM_MANUFACT	"rtl-sdr"
+#define SIM_PRODUCT	"Simulated RTL-SDR"
+#define SIM_SERIAL	"SIM00001"
+#define SIM_DEFAULT_RATE	2048000
+
+/* a simulated device takes the place of the hardware while this is set */
+static const char *_rtlsdr_sim_spec(void)
+{
+	return getenv("RTLSDR_SIM");
+}
+
+static void _rtlsdr_sim_strings(char *manufact, char *product, char *serial)
+{
+	if (manufact)
+		strcpy(manufact, SIM_MANUFACT);
+	if (product)
+		strcpy(product, SIM_PRODUCT);
+	if (serial)
+		strcpy(serial, SIM_SERIAL);
+}
+
+/* the device list reads the strings without opening an rtlsdr_dev_t */
+static int _rtlsdr_get_usb_strings(libusb_device_handle *devh, char *manufact,
+				   char *product, char *serial)
 {
 	struct libusb_device_descriptor dd;
 	libusb_device *device = NULL;
 	const int buf_max = 256;
 	int r = 0;
 
-	if (!dev || !dev->devh)
+	if (!devh)
 		return -1;
 
-	device = libusb_get_device(dev->devh);
+	device = libusb_get_device(devh);
 
 	r = libusb_get_device_descriptor(device, &dd);
 	if (r < 0)
@@ -796,21 +1507,21 @@ int rtlsdr_get_usb_strings(rtlsdr_dev_t *dev, char *manufact, char *product,
 
 	if (manufact) {
 		memset(manufact, 0, buf_max);
-		libusb_get_string_descriptor_ascii(dev->devh, dd.iManufacturer,
+		libusb_get_string_descriptor_ascii(devh, dd.iManufacturer,
 						   (unsigned char *)manufact,
 						   buf_max);
 	}
 
 	if (product) {
 		memset(product, 0, buf_max);
-		libusb_get_string_descriptor_ascii(dev->devh, dd.iProduct,
+		libusb_get_string_descriptor_ascii(devh, dd.iProduct,
 						   (unsigned char *)product,
 						   buf_max);
 	}
 
 	if (serial) {
 		memset(serial, 0, buf_max);
-		libusb_get_string_descriptor_ascii(dev->devh, dd.iSerialNumber,
+		libusb_get_string_descriptor_ascii(devh, dd.iSerialNumber,
 						   (unsigned char *)serial,
 						   buf_max);
 	}
@@ -818,6 +1529,20 @@ int rtlsdr_get_usb_strings(rtlsdr_dev_t *dev, char *manufact, char *product,
 	return 0;
 }
 
+int rtlsdr_get_usb_strings(rtlsdr_dev_t *dev, char *manufact, char *product,
+			    char *serial)
+{
+	if (!dev)
+		return -1;
+
+	if (dev->sim) {
+		_rtlsdr_sim_strings(manufact, product, serial);
+		return 0;
+	}
+
+	return _rtlsdr_get_usb_strings(dev->devh, manufact, product, serial);
+}
+
 int rtlsdr_write_eeprom(rtlsdr_dev_t *dev, uint8_t *data, uint8_t offset, uint16_t len)
 {
 	int r = 0;
@@ -830,6 +1555,9 @@ int rtlsdr_write_eeprom(rtlsdr_dev_t *dev, uint8_t *data, uint8_t offset, uint16
 	if ((len + offset) > 256)
 		return -2;
 
+	/* the EEPROM is not on the tuner side of the repeater */
+	_rtlsdr_i2c_repeater(dev, 0);
+
 	for (i = 0; i < len; i++) {
 		cmd[0] = i + offset;
 		r = rtlsdr_write_array(dev, IICB, EEPROM_ADDR, cmd, 1);
@@ -867,6 +1595,8 @@ int rtlsdr_read_eeprom(rtlsdr_dev_t *dev, uint8_t *data, uint8_t offset, uint16_
 	if ((len + offset) > 256)
 		return -2;
 
+	_rtlsdr_i2c_repeater(dev, 0);
+
 	r = rtlsdr_write_array(dev, IICB, EEPROM_ADDR, &offset, 1);
 	if (r < 0)
 		return -3;
@@ -881,13 +1611,29 @@ int rtlsdr_read_eeprom(rtlsdr_dev_t *dev, uint8_t *data, uint8_t offset, uint16_
 	return r;
 }
 
+/* record the I2C traffic since the running counters read xfers and bytes */
+static void _rtlsdr_tune_stats(rtlsdr_dev_t *dev, uint32_t xfers,
+			       uint32_t bytes)
+{
+	dev->last_tune_xfers = dev->i2c_xfers - xfers;
+	dev->last_tune_bytes = dev->i2c_bytes - bytes;
+}
+
 int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
 {
-	int r = -1;
+	uint32_t xfers, bytes;
+	int r = -1, e;
 
 	if (!dev || !dev->tuner)
 		return -1;
 
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_CENTER_FREQ, freq);
+
+	xfers = dev->i2c_xfers;
+	bytes = dev->i2c_bytes;
+
+	_rtlsdr_batch_begin(dev);
+
 	if (dev->direct_sampling) {
 		r = rtlsdr_set_if_freq(dev, freq);
 	} else if (dev->tuner && dev->tuner->set_freq) {
@@ -896,12 +1642,20 @@ int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
 		rtlsdr_set_i2c_repeater(dev, 0);
 	}
 
+	e = _rtlsdr_batch_end(dev);
 	if (!r)
+		r = e;
+
+	_rtlsdr_tune_stats(dev, xfers, bytes);
+
+	if (!r) {
 		dev->freq = freq;
-	else
+		_rtlsdr_add_tag(dev, RTLSDR_TAG_FREQ, freq);
+	} else {
 		dev->freq = 0;
+	}
 
-	return r;
+	return _rtlsdr_trace_leave(dev, r);
 }
 
 uint32_t rtlsdr_get_center_freq(rtlsdr_dev_t *dev)
@@ -912,56 +1666,467 @@ uint32_t rtlsdr_get_center_freq(rtlsdr_dev_t *dev)
 	return dev->freq;
 }
 
-int rtlsdr_set_freq_correction(rtlsdr_dev_t *dev, int ppm)
+int rtlsdr_get_tune_i2c_stats(rtlsdr_dev_t *dev, uint32_t *xfers,
+			      uint32_t *bytes)
 {
-	int r = 0;
-
 	if (!dev)
 		return -1;
 
-	if (dev->corr == ppm)
-		return -2;
-
-	dev->corr = ppm;
+	if (xfers)
+		*xfers = dev->last_tune_xfers;
+	if (bytes)
+		*bytes = dev->last_tune_bytes;
 
-	r |= rtlsdr_set_sample_freq_correction(dev, ppm);
+	return 0;
+}
 
-	/* read corrected clock value into e4k and r82xx structure */
-	if (rtlsdr_get_xtal_freq(dev, NULL, &dev->e4k_s.vco.fosc) ||
-	    rtlsdr_get_xtal_freq(dev, NULL, &dev->r82xx_c.xtal))
-		return -3;
+int rtlsdr_tuner_session_begin(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
 
-	if (dev->freq) /* retune to apply new correction value */
-		r |= rtlsdr_set_center_freq(dev, dev->freq);
+	/* the repeater is opened by the first tuner operation */
+	dev->i2c_session++;
 
-	return r;
+	return 0;
 }
 
-int rtlsdr_get_freq_correction(rtlsdr_dev_t *dev)
+int rtlsdr_tuner_session_end(rtlsdr_dev_t *dev)
 {
-	if (!dev)
-		return 0;
+	if (!dev || !dev->i2c_session)
+		return -1;
 
-	return dev->corr;
+	if (!--dev->i2c_session)
+		rtlsdr_set_i2c_repeater(dev, 0);
+
+	return 0;
 }
 
-enum rtlsdr_tuner rtlsdr_get_tuner_type(rtlsdr_dev_t *dev)
+int rtlsdr_set_repeater_policy(rtlsdr_dev_t *dev, int flags)
 {
 	if (!dev)
-		return RTLSDR_TUNER_UNKNOWN;
+		return -1;
 
-	return dev->tuner_type;
+	dev->i2c_policy = flags;
+
+	/* close a repeater the old policy kept open */
+	rtlsdr_set_i2c_repeater(dev, 0);
+
+	return 0;
 }
 
-int rtlsdr_get_tuner_gains(rtlsdr_dev_t *dev, int *gains)
+/* tuners whose tuning is fully described by the registers it writes */
+static int _rtlsdr_hop_native(rtlsdr_dev_t *dev)
 {
-	/* all gain values are expressed in tenths of a dB */
-	const int e4k_gains[] = { -10, 15, 40, 65, 90, 115, 140, 165, 190, 215,
-				  240, 290, 340, 420 };
-	const int fc0012_gains[] = { -99, -40, 71, 179, 192 };
-	const int fc0013_gains[] = { -99, -73, -65, -63, -60, -58, -54, 58, 61,
-				       63, 65, 67, 68, 70, 71, 179, 181, 182,
-				       184, 186, 188, 191, 197 };
+	if (dev->direct_sampling || dev->sim)
+		return 0;
+
+	switch (dev->tuner_type) {
+	case RTLSDR_TUNER_E4000:
+		return 1;
+	case RTLSDR_TUNER_R820T:
+	case RTLSDR_TUNER_R828D:
+		/* the Blog V4 input switching also drives a GPIO */
+		return !rtlsdr_check_dongle_model(dev, "RTLSDRBlog", "Blog V4");
+	default:
+		return 0;
+	}
+}
+
+static void _rtlsdr_hop_key(rtlsdr_dev_t *dev, uint32_t *key)
+{
+	key[0] = dev->offs_freq;
+	key[1] = dev->r82xx_p.int_freq;
+	key[2] = dev->r82xx_c.xtal;
+	key[3] = dev->e4k_s.vco.fosc;
+}
+
+/* run the tuner driver for one entry with its register writes diverted
+ * into the entry, the driver state is left untouched. The PLL can't be
+ * checked for lock before the writes reach the tuner, see rtlsdr_hop() */
+static int _rtlsdr_hop_capture(rtlsdr_dev_t *dev, rtlsdr_hop_t *h)
+{
+	struct r82xx_priv r82xx_p;
+	struct e4k_pll_params vco;
+	enum e4k_band band;
+	uint8_t regs[E4K_NUM_SHADOW];
+	uint8_t regs_valid[E4K_NUM_SHADOW / 8];
+	int r;
+
+	/* the E4000 channel raster is owned by the state and may be
+	 * rebuilt while tuning, so only the tuning state is put back */
+	memcpy(&r82xx_p, &dev->r82xx_p, sizeof(r82xx_p));
+	vco = dev->e4k_s.vco;
+	band = dev->e4k_s.band;
+	memcpy(regs, dev->e4k_s.regs, sizeof(regs));
+	memcpy(regs_valid, dev->e4k_s.regs_valid, sizeof(regs_valid));
+	memset(h->mask, 0, sizeof(h->mask));
+	h->seq_n = 0;
+
+	dev->r82xx_p.recording = 1;
+	dev->hop_cap = h;
+	r = dev->tuner->set_freq(dev, h->freq - dev->offs_freq);
+	dev->hop_cap = NULL;
+
+	h->vco = dev->e4k_s.vco;
+	h->band = dev->e4k_s.band;
+
+	memcpy(&dev->r82xx_p, &r82xx_p, sizeof(r82xx_p));
+	dev->e4k_s.vco = vco;
+	dev->e4k_s.band = band;
+	memcpy(dev->e4k_s.regs, regs, sizeof(regs));
+	memcpy(dev->e4k_s.regs_valid, regs_valid, sizeof(regs_valid));
+
+	return r;
+}
+
+/* value a register had before any capture, for entries that didn't write it */
+static int _rtlsdr_hop_baseline(rtlsdr_dev_t *dev, uint8_t reg, uint8_t *val)
+{
+	int r;
+
+	if (dev->tuner_type == RTLSDR_TUNER_E4000) {
+		r = rtlsdr_i2c_write_fn(dev, dev->e4k_s.i2c_addr, &reg, 1);
+		if (r == 1)
+			r = rtlsdr_i2c_read_fn(dev, dev->e4k_s.i2c_addr, val, 1);
+		return r == 1 ? 0 : -1;
+	}
+
+	if (reg < REG_SHADOW_START || reg >= REG_SHADOW_START + NUM_REGS)
+		return -1;
+
+	*val = dev->r82xx_p.regs[reg - REG_SHADOW_START];
+	return 0;
+}
+
+/*
+ * Capture the register image of every entry. A driver skips registers
+ * that already hold the right value, so registers written for any entry
+ * are completed with their current contents for entries that didn't.
+ */
+static int _rtlsdr_hop_build(rtlsdr_dev_t *dev)
+{
+	rtlsdr_hop_t *h;
+	uint32_t i;
+	unsigned int reg;
+	uint8_t val;
+	int r = 0;
+
+	memset(dev->hop_regs, 0, sizeof(dev->hop_regs));
+	_rtlsdr_hop_key(dev, dev->hop_key);
+
+	rtlsdr_set_i2c_repeater(dev, 1);
+
+	for (i = 0; i < dev->hop_n; i++) {
+		h = &dev->hop[i];
+		if (_rtlsdr_hop_capture(dev, h) < 0) {
+			fprintf(stderr, "Failed to precompute hop to %u Hz\n",
+				h->freq);
+			r = -1;
+			break;
+		}
+		for (reg = 0; reg < sizeof(dev->hop_regs); reg++)
+			dev->hop_regs[reg] |= h->mask[reg];
+	}
+
+	for (reg = 0; !r && reg < 256; reg++) {
+		if (!(dev->hop_regs[reg >> 3] & (1 << (reg & 7))))
+			continue;
+
+		if (_rtlsdr_hop_baseline(dev, reg, &val) < 0) {
+			r = -1;
+			break;
+		}
+
+		for (i = 0; i < dev->hop_n; i++) {
+			h = &dev->hop[i];
+			if (!(h->mask[reg >> 3] & (1 << (reg & 7))))
+				h->val[reg] = val;
+		}
+	}
+
+	rtlsdr_set_i2c_repeater(dev, 0);
+
+	/* forces a rebuild on the next hop */
+	if (r)
+		dev->hop_key[0] = ~dev->offs_freq;
+
+	return r;
+}
+
+/*
+ * Restore the registers other entries wrote, then replay the writes of
+ * the driver in their order. The tuner acts on some registers when they
+ * are written, so a register may be written more than once. Writes of
+ * the value last written are skipped, like the drivers do.
+ */
+static int _rtlsdr_hop_write(rtlsdr_dev_t *dev, rtlsdr_hop_t *h)
+{
+	uint8_t buf[256];
+	uint8_t addr;
+	unsigned int reg, max, n, i, j, end;
+	int r;
+
+	if (dev->tuner_type == RTLSDR_TUNER_E4000) {
+		addr = dev->e4k_s.i2c_addr;
+		max = 1;
+	} else {
+		addr = dev->r82xx_c.i2c_addr;
+		max = dev->r82xx_c.max_i2c_msg_len - 1;
+	}
+
+#define HOP_DIFFERS(reg, val) \
+	(!(dev->i2c_valid[(reg) >> 3] & (1 << ((reg) & 7))) || \
+	 dev->i2c_img[(reg)] != (val))
+#define HOP_RESTORE(reg) \
+	((dev->hop_regs[(reg) >> 3] & (1 << ((reg) & 7))) && \
+	 !(h->mask[(reg) >> 3] & (1 << ((reg) & 7))) && \
+	 HOP_DIFFERS(reg, h->val[(reg)]))
+
+	for (reg = 0; reg < 256; ) {
+		if (!HOP_RESTORE(reg)) {
+			reg++;
+			continue;
+		}
+
+		buf[0] = reg;
+		for (n = 0; n < max && reg < 256 && HOP_RESTORE(reg); n++)
+			buf[1 + n] = h->val[reg++];
+
+		r = rtlsdr_i2c_write_fn(dev, addr, buf, n + 1);
+		if (r != (int)n + 1)
+			return -1;
+	}
+
+	for (i = 0; i < h->seq_n; i = end) {
+		end = i + 1;
+		if (!HOP_DIFFERS(h->seq[i][0], h->seq[i][1]))
+			continue;
+
+		/* a burst the driver wrote carries unchanged registers
+		 * between two changed ones along, like the driver does */
+		for (j = i + 1; j < h->seq_n && j < i + max &&
+		     h->seq[j][0] == h->seq[i][0] + (j - i); j++) {
+			if (HOP_DIFFERS(h->seq[j][0], h->seq[j][1]))
+				end = j + 1;
+		}
+
+		buf[0] = h->seq[i][0];
+		for (n = 0; i + n < end; n++)
+			buf[1 + n] = h->seq[i + n][1];
+
+		r = rtlsdr_i2c_write_fn(dev, addr, buf, n + 1);
+		if (r != (int)n + 1)
+			return -1;
+	}
+
+#undef HOP_RESTORE
+#undef HOP_DIFFERS
+
+	return 0;
+}
+
+int rtlsdr_set_tuner_raster(rtlsdr_dev_t *dev, uint32_t start, uint32_t step,
+			    uint32_t count)
+{
+	if (!dev)
+		return -1;
+
+	if (dev->tuner_type != RTLSDR_TUNER_E4000)
+		return 0;
+
+	return e4k_set_raster(&dev->e4k_s, start, step, count) < 0 ? -1 : 0;
+}
+
+int rtlsdr_set_hop_table(rtlsdr_dev_t *dev, const uint32_t *freqs, uint32_t n)
+{
+	rtlsdr_hop_t *hop = NULL;
+	uint32_t i;
+
+	if (!dev || !dev->tuner || (n && !freqs))
+		return -1;
+
+	if (n) {
+		hop = calloc(n, sizeof(rtlsdr_hop_t));
+		if (!hop)
+			return -1;
+		for (i = 0; i < n; i++)
+			hop[i].freq = freqs[i];
+	}
+
+	free(dev->hop);
+	dev->hop = hop;
+	dev->hop_n = n;
+
+	if (!n || !_rtlsdr_hop_native(dev))
+		return 0;
+
+	if (_rtlsdr_hop_build(dev) < 0) {
+		free(dev->hop);
+		dev->hop = NULL;
+		dev->hop_n = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* tune the regular way after a hop didn't lock, counting both retunes */
+static int _rtlsdr_hop_fallback(rtlsdr_dev_t *dev, rtlsdr_hop_t *h)
+{
+	uint32_t xfers = dev->last_tune_xfers;
+	uint32_t bytes = dev->last_tune_bytes;
+	int r;
+
+	r = rtlsdr_set_center_freq(dev, h->freq);
+
+	dev->last_tune_xfers += xfers;
+	dev->last_tune_bytes += bytes;
+
+	return r;
+}
+
+int rtlsdr_hop(rtlsdr_dev_t *dev, uint32_t index)
+{
+	uint32_t key[HOP_KEY_LEN];
+	uint32_t xfers, bytes;
+	rtlsdr_hop_t *h;
+	unsigned int reg;
+	int r, e;
+
+	if (!dev || !dev->tuner || index >= dev->hop_n)
+		return -1;
+
+	h = &dev->hop[index];
+
+	if (!_rtlsdr_hop_native(dev))
+		return rtlsdr_set_center_freq(dev, h->freq);
+
+	/* offset, IF or crystal changed since the table was built */
+	_rtlsdr_hop_key(dev, key);
+	if (memcmp(key, dev->hop_key, sizeof(key)) &&
+	    _rtlsdr_hop_build(dev) < 0)
+		return -1;
+
+	xfers = dev->i2c_xfers;
+	bytes = dev->i2c_bytes;
+
+	_rtlsdr_batch_begin(dev);
+	rtlsdr_set_i2c_repeater(dev, 1);
+	r = _rtlsdr_hop_write(dev, h);
+	rtlsdr_set_i2c_repeater(dev, 0);
+	e = _rtlsdr_batch_end(dev);
+	if (!r)
+		r = e;
+
+	/* the lock check below isn't part of the retune */
+	_rtlsdr_tune_stats(dev, xfers, bytes);
+
+	if (r) {
+		/* some registers may have been written */
+		memset(dev->e4k_s.regs_valid, 0, sizeof(dev->e4k_s.regs_valid));
+		dev->freq = 0;
+		return r;
+	}
+
+	/* bring the driver state in line with the registers */
+	if (dev->tuner_type == RTLSDR_TUNER_E4000) {
+		dev->e4k_s.vco = h->vco;
+		dev->e4k_s.band = h->band;
+		for (reg = 0; reg < E4K_NUM_SHADOW; reg++) {
+			if (!(dev->hop_regs[reg >> 3] & (1 << (reg & 7))))
+				continue;
+			dev->e4k_s.regs[reg] = h->val[reg];
+			dev->e4k_s.regs_valid[reg >> 3] |= 1 << (reg & 7);
+		}
+
+		/* the lock bit seen during the capture was the one of the
+		 * old channel, check the new one like e4k_tune_freq() */
+		rtlsdr_set_i2c_repeater(dev, 1);
+		r = e4k_get_lock(&dev->e4k_s);
+		rtlsdr_set_i2c_repeater(dev, 0);
+		if (r < 0) {
+			dev->freq = 0;
+			return r;
+		}
+		if (!r)
+			return _rtlsdr_hop_fallback(dev, h);
+	} else {
+		for (reg = REG_SHADOW_START; reg < REG_SHADOW_START + NUM_REGS; reg++)
+			if (dev->hop_regs[reg >> 3] & (1 << (reg & 7)))
+				dev->r82xx_p.regs[reg - REG_SHADOW_START] = h->val[reg];
+
+		/* the driver raises the VCO current when the PLL doesn't
+		 * lock, which only a tune on the real tuner can find out */
+		rtlsdr_set_i2c_repeater(dev, 1);
+		r = r82xx_get_lock(&dev->r82xx_p);
+		rtlsdr_set_i2c_repeater(dev, 0);
+		if (r < 0) {
+			dev->freq = 0;
+			return r;
+		}
+		if (!r)
+			return _rtlsdr_hop_fallback(dev, h);
+	}
+
+	dev->freq = h->freq;
+	_rtlsdr_add_tag(dev, RTLSDR_TAG_FREQ, h->freq);
+
+	return 0;
+}
+
+int rtlsdr_set_freq_correction(rtlsdr_dev_t *dev, int ppm)
+{
+	int r = 0;
+
+	if (!dev)
+		return -1;
+
+	if (dev->corr == ppm)
+		return -2;
+
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_FREQ_CORRECTION, (uint32_t)ppm);
+
+	dev->corr = ppm;
+
+	r |= rtlsdr_set_sample_freq_correction(dev, ppm);
+
+	/* read corrected clock value into e4k and r82xx structure */
+	if (rtlsdr_get_xtal_freq(dev, NULL, &dev->e4k_s.vco.fosc) ||
+	    rtlsdr_get_xtal_freq(dev, NULL, &dev->r82xx_c.xtal))
+		return _rtlsdr_trace_leave(dev, -3);
+
+	if (dev->freq) /* retune to apply new correction value */
+		r |= rtlsdr_set_center_freq(dev, dev->freq);
+
+	return _rtlsdr_trace_leave(dev, r);
+}
+
+int rtlsdr_get_freq_correction(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	return dev->corr;
+}
+
+enum rtlsdr_tuner rtlsdr_get_tuner_type(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return RTLSDR_TUNER_UNKNOWN;
+
+	return dev->tuner_type;
+}
+
+int rtlsdr_get_tuner_gains(rtlsdr_dev_t *dev, int *gains)
+{
+	/* all gain values are expressed in tenths of a dB */
+	const int e4k_gains[] = { -10, 15, 40, 65, 90, 115, 140, 165, 190, 215,
+				  240, 290, 340, 420 };
+	const int fc0012_gains[] = { -99, -40, 71, 179, 192 };
+	const int fc0013_gains[] = { -99, -73, -65, -63, -60, -58, -54, 58, 61,
+				       63, 65, 67, 68, 70, 71, 179, 181, 182,
+				       184, 186, 188, 191, 197 };
 	const int fc2580_gains[] = { 0 /* no gain values */ };
 	const int r82xx_gains[] = { 0, 9, 14, 27, 37, 77, 87, 125, 144, 157,
 				     166, 197, 207, 229, 254, 280, 297, 328,
@@ -1009,15 +2174,19 @@ int rtlsdr_get_tuner_gains(rtlsdr_dev_t *dev, int *gains)
 
 int rtlsdr_set_tuner_bandwidth(rtlsdr_dev_t *dev, uint32_t bw)
 {
-	int r = 0;
+	int r = 0, e;
 
 	if (!dev || !dev->tuner)
 		return -1;
 
 	if (dev->tuner->set_bw) {
+		_rtlsdr_batch_begin(dev);
 		rtlsdr_set_i2c_repeater(dev, 1);
 		r = dev->tuner->set_bw(dev, bw > 0 ? bw : dev->rate);
 		rtlsdr_set_i2c_repeater(dev, 0);
+		e = _rtlsdr_batch_end(dev);
+		if (!r)
+			r = e;
 		if (r)
 			return r;
 		dev->bw = bw;
@@ -1027,23 +2196,104 @@ int rtlsdr_set_tuner_bandwidth(rtlsdr_dev_t *dev, uint32_t bw)
 
 int rtlsdr_set_tuner_gain(rtlsdr_dev_t *dev, int gain)
 {
-	int r = 0;
+	int r = 0, e;
 
 	if (!dev || !dev->tuner)
 		return -1;
 
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_TUNER_GAIN, (uint32_t)gain);
+
 	if (dev->tuner->set_gain) {
+		_rtlsdr_batch_begin(dev);
 		rtlsdr_set_i2c_repeater(dev, 1);
 		r = dev->tuner->set_gain((void *)dev, gain);
 		rtlsdr_set_i2c_repeater(dev, 0);
+		e = _rtlsdr_batch_end(dev);
+		if (!r)
+			r = e;
 	}
 
-	if (!r)
+	if (!r) {
 		dev->gain = gain;
-	else
+		_rtlsdr_add_tag(dev, RTLSDR_TAG_GAIN, (uint32_t)gain);
+	} else {
 		dev->gain = 0;
+	}
 
-	return r;
+	return _rtlsdr_trace_leave(dev, r);
+}
+
+int rtlsdr_set_tuner_gain_index(rtlsdr_dev_t *dev, unsigned int index)
+{
+	int gains[32];
+	int count, r, e;
+
+	if (!dev || !dev->tuner)
+		return -1;
+
+	count = rtlsdr_get_tuner_gains(dev, NULL);
+	if (count <= 0 || count > 32 || index >= (unsigned int)count)
+		return -1;
+
+	rtlsdr_get_tuner_gains(dev, gains);
+
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_TUNER_GAIN_INDEX, index);
+
+	/* the R82xx registers of each listed gain are known up front */
+	if (dev->sim || (dev->tuner_type != RTLSDR_TUNER_R820T &&
+			 dev->tuner_type != RTLSDR_TUNER_R828D)) {
+		r = rtlsdr_set_tuner_gain(dev, gains[index]);
+		return _rtlsdr_trace_leave(dev, r);
+	}
+
+	_rtlsdr_batch_begin(dev);
+	rtlsdr_set_i2c_repeater(dev, 1);
+	r = r82xx_set_gain_index(&dev->r82xx_p, index);
+	rtlsdr_set_i2c_repeater(dev, 0);
+	e = _rtlsdr_batch_end(dev);
+	if (!r)
+		r = e;
+
+	if (!r) {
+		dev->gain = gains[index];
+		_rtlsdr_add_tag(dev, RTLSDR_TAG_GAIN, (uint32_t)dev->gain);
+	} else {
+		dev->gain = 0;
+	}
+
+	return _rtlsdr_trace_leave(dev, r);
+}
+
+int rtlsdr_step_tuner_gain(rtlsdr_dev_t *dev, int steps)
+{
+	int gains[32];
+	int count, i, best = 0;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	count = rtlsdr_get_tuner_gains(dev, NULL);
+	if (count <= 0 || count > 32)
+		return -1;
+
+	rtlsdr_get_tuner_gains(dev, gains);
+
+	/* start from the listed gain closest to the current one */
+	for (i = 1; i < count; i++) {
+		if (abs(gains[i] - dev->gain) < abs(gains[best] - dev->gain))
+			best = i;
+	}
+
+	i = best + steps;
+	if (i < 0)
+		i = 0;
+	else if (i >= count)
+		i = count - 1;
+
+	r = rtlsdr_set_tuner_gain_index(dev, (unsigned int)i);
+
+	return r < 0 ? r : i;
 }
 
 int rtlsdr_get_tuner_gain(rtlsdr_dev_t *dev)
@@ -1061,13 +2311,16 @@ int rtlsdr_set_tuner_if_gain(rtlsdr_dev_t *dev, int stage, int gain)
 	if (!dev || !dev->tuner)
 		return -1;
 
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_TUNER_IF_GAIN,
+			    ((uint32_t)stage << 16) | (uint16_t)gain);
+
 	if (dev->tuner->set_if_gain) {
 		rtlsdr_set_i2c_repeater(dev, 1);
 		r = dev->tuner->set_if_gain(dev, stage, gain);
 		rtlsdr_set_i2c_repeater(dev, 0);
 	}
 
-	return r;
+	return _rtlsdr_trace_leave(dev, r);
 }
 
 int rtlsdr_set_tuner_gain_mode(rtlsdr_dev_t *dev, int mode)
@@ -1077,14 +2330,19 @@ int rtlsdr_set_tuner_gain_mode(rtlsdr_dev_t *dev, int mode)
 	if (!dev || !dev->tuner)
 		return -1;
 
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_TUNER_GAIN_MODE, (uint32_t)mode);
+
 	if (dev->tuner->set_gain_mode) {
 		rtlsdr_set_i2c_repeater(dev, 1);
 		r = dev->tuner->set_gain_mode((void *)dev, mode);
 		rtlsdr_set_i2c_repeater(dev, 0);
 	}
 
-	return r;
-}
+	if (!r)
+		dev->gain_manual = mode;
+
+	return _rtlsdr_trace_leave(dev, r);
+}
 
 int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t samp_rate)
 {
@@ -1112,8 +2370,12 @@ int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t samp_rate)
 	if ( ((double)samp_rate) != real_rate )
 		fprintf(stderr, "Exact sample rate is: %f Hz\n", real_rate);
 
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_SAMPLE_RATE, samp_rate);
+
 	dev->rate = (uint32_t)real_rate;
 
+	_rtlsdr_batch_begin(dev);
+
 	if (dev->tuner && dev->tuner->set_bw) {
 		rtlsdr_set_i2c_repeater(dev, 1);
 		dev->tuner->set_bw(dev, dev->bw > 0 ? dev->bw : dev->rate);
@@ -1127,15 +2389,21 @@ int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t samp_rate)
 
 	r |= rtlsdr_set_sample_freq_correction(dev, dev->corr);
 
-	/* reset demod (bit 3, soft_rst) */
+	/* reset demod (bit 3, soft_rst), this also closes the I2C repeater */
 	r |= rtlsdr_demod_write_reg(dev, 1, 0x01, 0x14, 1);
 	r |= rtlsdr_demod_write_reg(dev, 1, 0x01, 0x10, 1);
+	dev->i2c_rep = 0;
 
 	/* recalculate offset frequency if offset tuning is enabled */
 	if (dev->offs_freq)
 		rtlsdr_set_offset_tuning(dev, 1);
 
-	return r;
+	r |= _rtlsdr_batch_end(dev);
+
+	if (!r)
+		_rtlsdr_add_tag(dev, RTLSDR_TAG_RATE, dev->rate);
+
+	return _rtlsdr_trace_leave(dev, r);
 }
 
 uint32_t rtlsdr_get_sample_rate(rtlsdr_dev_t *dev)
@@ -1148,18 +2416,30 @@ uint32_t rtlsdr_get_sample_rate(rtlsdr_dev_t *dev)
 
 int rtlsdr_set_testmode(rtlsdr_dev_t *dev, int on)
 {
+	int r;
+
 	if (!dev)
 		return -1;
 
-	return rtlsdr_demod_write_reg(dev, 0, 0x19, on ? 0x03 : 0x05, 1);
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_TESTMODE, (uint32_t)on);
+	r = rtlsdr_demod_write_reg(dev, 0, 0x19, on ? 0x03 : 0x05, 1);
+
+	return _rtlsdr_trace_leave(dev, r);
 }
 
 int rtlsdr_set_agc_mode(rtlsdr_dev_t *dev, int on)
 {
+	int r;
+
 	if (!dev)
 		return -1;
 
-	return rtlsdr_demod_write_reg(dev, 0, 0x19, on ? 0x25 : 0x05, 1);
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_AGC_MODE, (uint32_t)on);
+
+	dev->agc_on = on;
+	r = rtlsdr_demod_write_reg(dev, 0, 0x19, on ? 0x25 : 0x05, 1);
+
+	return _rtlsdr_trace_leave(dev, r);
 }
 
 int rtlsdr_set_direct_sampling(rtlsdr_dev_t *dev, int on)
@@ -1169,6 +2449,8 @@ int rtlsdr_set_direct_sampling(rtlsdr_dev_t *dev, int on)
 	if (!dev)
 		return -1;
 
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_DIRECT_SAMPLING, (uint32_t)on);
+
 	if (on) {
 		if (dev->tuner && dev->tuner->exit) {
 			rtlsdr_set_i2c_repeater(dev, 1);
@@ -1222,7 +2504,7 @@ int rtlsdr_set_direct_sampling(rtlsdr_dev_t *dev, int on)
 
 	r |= rtlsdr_set_center_freq(dev, dev->freq);
 
-	return r;
+	return _rtlsdr_trace_leave(dev, r);
 }
 
 int rtlsdr_get_direct_sampling(rtlsdr_dev_t *dev)
@@ -1248,6 +2530,8 @@ int rtlsdr_set_offset_tuning(rtlsdr_dev_t *dev, int on)
 	if (dev->direct_sampling)
 		return -3;
 
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_OFFSET_TUNING, (uint32_t)on);
+
 	/* based on keenerds 1/f noise measurements */
 	dev->offs_freq = on ? ((dev->rate / 2) * 170 / 100) : 0;
 	r |= rtlsdr_set_if_freq(dev, dev->offs_freq);
@@ -1268,7 +2552,7 @@ int rtlsdr_set_offset_tuning(rtlsdr_dev_t *dev, int on)
 	if (dev->freq > dev->offs_freq)
 		r |= rtlsdr_set_center_freq(dev, dev->freq);
 
-	return r;
+	return _rtlsdr_trace_leave(dev, r);
 }
 
 int rtlsdr_get_offset_tuning(rtlsdr_dev_t *dev)
@@ -1303,6 +2587,9 @@ uint32_t rtlsdr_get_device_count(void)
 	struct libusb_device_descriptor dd;
 	ssize_t cnt;
 
+	if (_rtlsdr_sim_spec())
+		return 1;
+
 	r = libusb_init(&ctx);
 	if(r < 0)
 		return 0;
@@ -1333,6 +2620,9 @@ const char *rtlsdr_get_device_name(uint32_t index)
 	uint32_t device_count = 0;
 	ssize_t cnt;
 
+	if (_rtlsdr_sim_spec())
+		return index ? "" : SIM_PRODUCT;
+
 	r = libusb_init(&ctx);
 	if(r < 0)
 		return "";
@@ -1371,10 +2661,17 @@ int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact,
 	libusb_device **list;
 	struct libusb_device_descriptor dd;
 	rtlsdr_dongle_t *device = NULL;
-	rtlsdr_dev_t devt;
+	libusb_device_handle *devh;
 	uint32_t device_count = 0;
 	ssize_t cnt;
 
+	if (_rtlsdr_sim_spec()) {
+		if (index)
+			return -2;
+		_rtlsdr_sim_strings(manufact, product, serial);
+		return 0;
+	}
+
 	r = libusb_init(&ctx);
 	if(r < 0)
 		return r;
@@ -1390,13 +2687,13 @@ int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact,
 			device_count++;
 
 			if (index == device_count - 1) {
-				r = libusb_open(list[i], &devt.devh);
+				r = libusb_open(list[i], &devh);
 				if (!r) {
-					r = rtlsdr_get_usb_strings(&devt,
-								   manufact,
-								   product,
-								   serial);
-					libusb_close(devt.devh);
+					r = _rtlsdr_get_usb_strings(devh,
+								    manufact,
+								    product,
+								    serial);
+					libusb_close(devh);
 				}
 				break;
 			}
@@ -1410,26 +2707,116 @@ int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact,
 	return r;
 }
 
+int rtlsdr_get_device_list(rtlsdr_device_info_t **out_list)
+{
+	int i, r;
+	libusb_context *ctx;
+	libusb_device **list;
+	struct libusb_device_descriptor dd;
+	rtlsdr_dongle_t *device;
+	rtlsdr_device_info_t *info;
+	libusb_device_handle *devh;
+	uint32_t device_count = 0;
+	ssize_t cnt;
+
+	if (!out_list)
+		return -1;
+
+	*out_list = NULL;
+
+	if (_rtlsdr_sim_spec()) {
+		info = calloc(1, sizeof(rtlsdr_device_info_t));
+		if (!info)
+			return -ENOMEM;
+
+		info->name = SIM_PRODUCT;
+		_rtlsdr_sim_strings(info->manufact, info->product,
+				    info->serial);
+		*out_list = info;
+
+		return 1;
+	}
+
+	r = libusb_init(&ctx);
+	if (r < 0)
+		return r;
+
+	cnt = libusb_get_device_list(ctx, &list);
+	if (cnt < 0) {
+		libusb_exit(ctx);
+		return (int)cnt;
+	}
+
+	/* one spare entry so an empty list is still a valid allocation */
+	info = calloc(cnt + 1, sizeof(rtlsdr_device_info_t));
+	if (!info) {
+		libusb_free_device_list(list, 1);
+		libusb_exit(ctx);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		libusb_get_device_descriptor(list[i], &dd);
+
+		device = find_known_device(dd.idVendor, dd.idProduct);
+		if (!device)
+			continue;
+
+		info[device_count].index = device_count;
+		info[device_count].vid = dd.idVendor;
+		info[device_count].pid = dd.idProduct;
+		info[device_count].bus = libusb_get_bus_number(list[i]);
+		info[device_count].address = libusb_get_device_address(list[i]);
+		info[device_count].name = device->name;
+
+		if (!libusb_open(list[i], &devh)) {
+			_rtlsdr_get_usb_strings(devh,
+						info[device_count].manufact,
+						info[device_count].product,
+						info[device_count].serial);
+			libusb_close(devh);
+		}
+
+		device_count++;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	libusb_exit(ctx);
+
+	*out_list = info;
+
+	return (int)device_count;
+}
+
+void rtlsdr_free_device_list(rtlsdr_device_info_t *list)
+{
+	free(list);
+}
+
 int rtlsdr_get_index_by_serial(const char *serial)
 {
-	int i, cnt, r;
-	char str[256];
+	int i, cnt;
+	rtlsdr_device_info_t *list;
 
 	if (!serial)
 		return -1;
 
-	cnt = rtlsdr_get_device_count();
+	cnt = rtlsdr_get_device_list(&list);
 
-	if (!cnt)
+	if (cnt <= 0) {
+		rtlsdr_free_device_list(list);
 		return -2;
+	}
 
 	for (i = 0; i < cnt; i++) {
-		r = rtlsdr_get_device_usb_strings(i, NULL, NULL, str);
-		if (!r && !strcmp(serial, str))
-			return i;
+		if (!strcmp(serial, list[i].serial))
+			break;
 	}
 
-	return -3;
+	rtlsdr_free_device_list(list);
+
+	return (i < cnt) ? i : -3;
 }
 
 /* Returns true if the manufact_check and product_check strings match what is in the dongles EEPROM */
@@ -1442,7 +2829,92 @@ int rtlsdr_check_dongle_model(void *dev, char *manufact_check, char *product_che
 }
 
 
-int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
+/* claim the interface of a freshly opened device handle */
+static int _rtlsdr_claim(rtlsdr_dev_t *dev)
+{
+	int r;
+
+	if (libusb_kernel_driver_active(dev->devh, 0) == 1) {
+		dev->driver_active = 1;
+
+#ifdef DETACH_KERNEL_DRIVER
+		if (!libusb_detach_kernel_driver(dev->devh, 0)) {
+			fprintf(stderr, "Detached kernel driver\n");
+		} else {
+			fprintf(stderr, "Detaching kernel driver failed!");
+			return -1;
+		}
+#else
+		fprintf(stderr, "\nKernel driver is active, or device is "
+				"claimed by second instance of librtlsdr."
+				"\nIn the first case, please either detach"
+				" or blacklist the kernel module\n"
+				"(dvb_usb_rtl28xxu), or enable automatic"
+				" detaching at compile time.\n\n");
+#endif
+	}
+
+	r = libusb_claim_interface(dev->devh, 0);
+	if (r < 0) {
+		fprintf(stderr, "usb_claim_interface error %d\n", r);
+		return r;
+	}
+
+	return 0;
+}
+
+/* bring the RTL2832 up, also when a device is reattached */
+static void _rtlsdr_init_device(rtlsdr_dev_t *dev)
+{
+	/* perform a dummy write, if it fails, reset the device */
+	if (rtlsdr_write_reg(dev, USBB, USB_SYSCTL, 0x09, 1) < 0) {
+		fprintf(stderr, "Resetting device...\n");
+		libusb_reset_device(dev->devh);
+	}
+
+	rtlsdr_init_baseband(dev);
+}
+
+/* set up the demod for the tuner found and initialise it, repeater on */
+static int _rtlsdr_init_tuner(rtlsdr_dev_t *dev)
+{
+	switch (dev->tuner_type) {
+	case RTLSDR_TUNER_R828D:
+		/* If NOT an RTL-SDR Blog V4, set typical R828D 16 MHz freq. Otherwise, keep at 28.8 MHz. */
+		if (!(rtlsdr_check_dongle_model(dev, "RTLSDRBlog", "Blog V4"))) {
+			dev->tun_xtal = R828D_XTAL_FREQ;
+		}
+		/* fall-through */
+	case RTLSDR_TUNER_R820T:
+		/* disable Zero-IF mode */
+		rtlsdr_demod_write_reg(dev, 1, 0xb1, 0x1a, 1);
+
+		/* only enable In-phase ADC input */
+		rtlsdr_demod_write_reg(dev, 0, 0x08, 0x4d, 1);
+
+		/* the R82XX use 3.57 MHz IF for the DVB-T 6 MHz mode, and
+		 * 4.57 MHz for the 8 MHz mode */
+		rtlsdr_set_if_freq(dev, R82XX_IF_FREQ);
+
+		/* enable spectrum inversion */
+		rtlsdr_demod_write_reg(dev, 1, 0x15, 0x01, 1);
+		break;
+	case RTLSDR_TUNER_UNKNOWN:
+		fprintf(stderr, "No supported tuner found\n");
+		rtlsdr_set_direct_sampling(dev, 1);
+		break;
+	default:
+		break;
+	}
+
+	if (dev->tuner->init)
+		return dev->tuner->init(dev);
+
+	return 0;
+}
+
+static int _rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index,
+			rtlsdr_loop_t *loop)
 {
 	int r;
 	int i;
@@ -1460,13 +2932,28 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 
 	memset(dev, 0, sizeof(rtlsdr_dev_t));
 	memcpy(dev->fir, fir_default, sizeof(fir_default));
+	rtlsdr_convert_init(&dev->conv, RTLSDR_OUTPUT_CU8, 0.0f, 0, 0);
+	rtlsdr_convert_init(&dev->ddc_conv, RTLSDR_OUTPUT_CF32, 1.0f, 0, 0);
 
-	r = libusb_init(&dev->ctx);
-	if(r < 0){
-		free(dev);
-		return -1;
+	if (loop) {
+		dev->loop = loop;
+		dev->ctx = loop->ctx;
+	} else {
+		r = libusb_init(&dev->ctx);
+		if(r < 0){
+			free(dev);
+			return -1;
+		}
 	}
 
+	pthread_mutex_init(&dev->ring.lock, NULL);
+	pthread_cond_init(&dev->ring.cond, NULL);
+	pthread_mutex_init(&dev->ctrl_lock, NULL);
+	pthread_mutex_init(&dev->tag_lock, NULL);
+	pthread_mutex_init(&dev->trace_lock, NULL);
+	dev->async_cpu = -1;
+	dev->pool_node = -1;
+
 	dev->dev_lost = 1;
 
 	cnt = libusb_get_device_list(dev->ctx, &list);
@@ -1503,41 +2990,17 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 
 	libusb_free_device_list(list, 1);
 
-	if (libusb_kernel_driver_active(dev->devh, 0) == 1) {
-		dev->driver_active = 1;
-
-#ifdef DETACH_KERNEL_DRIVER
-		if (!libusb_detach_kernel_driver(dev->devh, 0)) {
-			fprintf(stderr, "Detached kernel driver\n");
-		} else {
-			fprintf(stderr, "Detaching kernel driver failed!");
-			goto err;
-		}
-#else
-		fprintf(stderr, "\nKernel driver is active, or device is "
-				"claimed by second instance of librtlsdr."
-				"\nIn the first case, please either detach"
-				" or blacklist the kernel module\n"
-				"(dvb_usb_rtl28xxu), or enable automatic"
-				" detaching at compile time.\n\n");
-#endif
-	}
-
-	r = libusb_claim_interface(dev->devh, 0);
-	if (r < 0) {
-		fprintf(stderr, "usb_claim_interface error %d\n", r);
+	r = _rtlsdr_claim(dev);
+	if (r < 0)
 		goto err;
-	}
 
 	dev->rtl_xtal = DEF_RTL_XTAL_FREQ;
 
-	/* perform a dummy write, if it fails, reset the device */
-	if (rtlsdr_write_reg(dev, USBB, USB_SYSCTL, 0x09, 1) < 0) {
-		fprintf(stderr, "Resetting device...\n");
-		libusb_reset_device(dev->devh);
-	}
+	/* trace the whole setup when asked for by the environment */
+	if (getenv("RTLSDR_TRACE"))
+		rtlsdr_set_trace(dev, getenv("RTLSDR_TRACE"));
 
-	rtlsdr_init_baseband(dev);
+	_rtlsdr_init_device(dev);
 	dev->dev_lost = 0;
 
 	/* Get device manufacturer and product id */
@@ -1605,375 +3068,3406 @@ found:
 	dev->tun_xtal = dev->rtl_xtal;
 	dev->tuner = &tuners[dev->tuner_type];
 
-	switch (dev->tuner_type) {
-	case RTLSDR_TUNER_R828D:
-		/* If NOT an RTL-SDR Blog V4, set typical R828D 16 MHz freq. Otherwise, keep at 28.8 MHz. */
-		if (!(rtlsdr_check_dongle_model(dev, "RTLSDRBlog", "Blog V4"))) {
-			dev->tun_xtal = R828D_XTAL_FREQ;
-		}
-		/* fall-through */
-	case RTLSDR_TUNER_R820T:
-		/* disable Zero-IF mode */
-		rtlsdr_demod_write_reg(dev, 1, 0xb1, 0x1a, 1);
-
-		/* only enable In-phase ADC input */
-		rtlsdr_demod_write_reg(dev, 0, 0x08, 0x4d, 1);
-
-		/* the R82XX use 3.57 MHz IF for the DVB-T 6 MHz mode, and
-		 * 4.57 MHz for the 8 MHz mode */
-		rtlsdr_set_if_freq(dev, R82XX_IF_FREQ);
-
-		/* enable spectrum inversion */
-		rtlsdr_demod_write_reg(dev, 1, 0x15, 0x01, 1);
-		break;
-	case RTLSDR_TUNER_UNKNOWN:
-		fprintf(stderr, "No supported tuner found\n");
-		rtlsdr_set_direct_sampling(dev, 1);
-		break;
-	default:
-		break;
-	}
-
-	if (dev->tuner->init)
-		r = dev->tuner->init(dev);
+	r = _rtlsdr_init_tuner(dev);
 
 	rtlsdr_set_i2c_repeater(dev, 0);
 
+	/* a replay starts from the probed tuner */
+	if (dev->trace)
+		_rtlsdr_trace_info(dev);
+
 	*out_dev = dev;
 
 	return 0;
 err:
 	if (dev) {
+		_rtlsdr_batch_free(dev);
+		rtlsdr_set_trace(dev, NULL);
+
 		if (dev->devh)
 			libusb_close(dev->devh);
 
-		if (dev->ctx)
+		if (dev->ctx && !dev->loop)
 			libusb_exit(dev->ctx);
 
+		pthread_mutex_destroy(&dev->ring.lock);
+		pthread_cond_destroy(&dev->ring.cond);
+		pthread_mutex_destroy(&dev->ctrl_lock);
+		pthread_mutex_destroy(&dev->tag_lock);
+		pthread_mutex_destroy(&dev->trace_lock);
 		free(dev);
 	}
 
 	return r;
 }
 
-int rtlsdr_close(rtlsdr_dev_t *dev)
+int rtlsdr_open_sim(rtlsdr_dev_t **out_dev, const char *spec)
 {
-	if (!dev)
+	rtlsdr_dev_t *dev;
+
+	if (!out_dev)
 		return -1;
 
-	if(!dev->dev_lost) {
-		/* block until all async operations have been completed (if any) */
-		while (RTLSDR_INACTIVE != dev->async_status) {
-#ifdef _WIN32
-			Sleep(1);
-#else
-			usleep(1000);
-#endif
-		}
+	dev = calloc(1, sizeof(rtlsdr_dev_t));
+	if (!dev)
+		return -ENOMEM;
 
-		rtlsdr_deinit_baseband(dev);
+	dev->sim = malloc(sizeof(rtlsdr_sim_t));
+	if (!dev->sim) {
+		free(dev);
+		return -ENOMEM;
 	}
 
-	libusb_release_interface(dev->devh, 0);
-
-#ifdef DETACH_KERNEL_DRIVER
-	if (dev->driver_active) {
-		if (!libusb_attach_kernel_driver(dev->devh, 0))
-			fprintf(stderr, "Reattached kernel driver\n");
-		else
-			fprintf(stderr, "Reattaching kernel driver failed!\n");
+	if (rtlsdr_sim_init(dev->sim, spec) < 0) {
+		rtlsdr_sim_free(dev->sim);
+		free(dev->sim);
+		free(dev);
+		return -1;
 	}
-#endif
 
-	libusb_close(dev->devh);
+	memcpy(dev->fir, fir_default, sizeof(fir_default));
+	rtlsdr_convert_init(&dev->conv, RTLSDR_OUTPUT_CU8, 0.0f, 0, 0);
+	rtlsdr_convert_init(&dev->ddc_conv, RTLSDR_OUTPUT_CF32, 1.0f, 0, 0);
+	pthread_mutex_init(&dev->ring.lock, NULL);
+	pthread_cond_init(&dev->ring.cond, NULL);
+	pthread_mutex_init(&dev->ctrl_lock, NULL);
+	pthread_mutex_init(&dev->tag_lock, NULL);
+	pthread_mutex_init(&dev->trace_lock, NULL);
+	dev->async_cpu = -1;
+	dev->pool_node = -1;
+
+	dev->rtl_xtal = DEF_RTL_XTAL_FREQ;
+	dev->tun_xtal = DEF_RTL_XTAL_FREQ;
+	_rtlsdr_sim_strings(dev->manufact, dev->product, NULL);
+
+	/* report the gain steps of the most common tuner */
+	dev->tuner_type = RTLSDR_TUNER_R820T;
+	dev->tuner = &sim_tuner;
+	dev->sim_agc = 1;
+
+	*out_dev = dev;
+
+	return 0;
+}
+
+int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
+{
+	const char *spec = _rtlsdr_sim_spec();
+
+	if (spec)
+		return index ? -1 : rtlsdr_open_sim(out_dev, spec);
+
+	return _rtlsdr_open(out_dev, index, NULL);
+}
+
+int rtlsdr_open_by_serial(rtlsdr_dev_t **out_dev, const char *serial)
+{
+	int index = rtlsdr_get_index_by_serial(serial);
+
+	if (index < 0)
+		return index;
+
+	return rtlsdr_open(out_dev, (uint32_t)index);
+}
+
+static void _rtlsdr_loop_stop(rtlsdr_loop_t *loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	loop->quit = 1;
+	pthread_mutex_unlock(&loop->lock);
+
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(loop->ctx);
+#endif
+	pthread_join(loop->thread, NULL);
+
+	pthread_mutex_destroy(&loop->lock);
+	pthread_cond_destroy(&loop->cond);
+	libusb_exit(loop->ctx);
+}
+
+int rtlsdr_context_create(rtlsdr_context_t **out_ctx, uint32_t num_threads)
+{
+	rtlsdr_context_t *ctx;
+	rtlsdr_loop_t *loop;
+	uint32_t i;
+
+	if (!out_ctx)
+		return -1;
+
+	if (!num_threads)
+		num_threads = 1;
+
+	ctx = calloc(1, sizeof(rtlsdr_context_t));
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->loops = calloc(num_threads, sizeof(rtlsdr_loop_t));
+	if (!ctx->loops) {
+		free(ctx);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		loop = &ctx->loops[i];
+
+		if (libusb_init(&loop->ctx) < 0)
+			break;
+
+		pthread_mutex_init(&loop->lock, NULL);
+		pthread_cond_init(&loop->cond, NULL);
+
+		if (pthread_create(&loop->thread, NULL, _rtlsdr_loop_fn,
+				   (void *)loop)) {
+			pthread_mutex_destroy(&loop->lock);
+			pthread_cond_destroy(&loop->cond);
+			libusb_exit(loop->ctx);
+			break;
+		}
+	}
+
+	if (i < num_threads) {
+		while (i--)
+			_rtlsdr_loop_stop(&ctx->loops[i]);
+		free(ctx->loops);
+		free(ctx);
+		return -1;
+	}
+
+	ctx->num_loops = num_threads;
+	*out_ctx = ctx;
+
+	return 0;
+}
+
+int rtlsdr_context_destroy(rtlsdr_context_t *ctx)
+{
+	uint32_t i;
+	unsigned int users = 0;
+
+	if (!ctx)
+		return -1;
+
+	for (i = 0; i < ctx->num_loops; i++) {
+		pthread_mutex_lock(&ctx->loops[i].lock);
+		users += ctx->loops[i].users;
+		pthread_mutex_unlock(&ctx->loops[i].lock);
+	}
+
+	if (users)
+		return -2;
+
+	for (i = 0; i < ctx->num_loops; i++)
+		_rtlsdr_loop_stop(&ctx->loops[i]);
+
+	free(ctx->loops);
+	free(ctx);
+
+	return 0;
+}
+
+int rtlsdr_open_shared(rtlsdr_dev_t **out_dev, uint32_t index,
+		       rtlsdr_context_t *ctx)
+{
+	rtlsdr_loop_t *loop = NULL;
+	uint32_t i;
+	int r;
+
+	/* a simulated device has no libusb events to share */
+	if (!ctx || _rtlsdr_sim_spec())
+		return rtlsdr_open(out_dev, index);
+
+	/* spread the devices evenly over the event threads */
+	for (i = 0; i < ctx->num_loops; i++) {
+		pthread_mutex_lock(&ctx->loops[i].lock);
+		if (!loop || ctx->loops[i].users < loop->users)
+			loop = &ctx->loops[i];
+		pthread_mutex_unlock(&ctx->loops[i].lock);
+	}
+
+	pthread_mutex_lock(&loop->lock);
+	loop->users++;
+	pthread_mutex_unlock(&loop->lock);
+
+	r = _rtlsdr_open(out_dev, index, loop);
+	if (r < 0) {
+		pthread_mutex_lock(&loop->lock);
+		loop->users--;
+		pthread_mutex_unlock(&loop->lock);
+	}
+
+	return r;
+}
+
+int rtlsdr_close(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	/* stop the library owned event thread (if any) */
+	if (dev->async_thread_active)
+		rtlsdr_stop_async(dev);
+
+	if(!dev->dev_lost) {
+		/* block until all async operations have been completed (if any) */
+		while (RTLSDR_INACTIVE != dev->async_status) {
+#ifdef _WIN32
+			Sleep(1);
+#else
+			usleep(1000);
+#endif
+		}
+
+		dev->i2c_session = 0;
+		dev->i2c_policy = 0;
+		rtlsdr_deinit_baseband(dev);
+	}
+
+	/* buffers of a stopped ring stream are kept until now */
+	_rtlsdr_free_async_buffers(dev);
+	_rtlsdr_batch_free(dev);
+
+	if (dev->sim) {
+		rtlsdr_sim_free(dev->sim);
+		free(dev->sim);
+		goto done;
+	}
+
+	if (dev->mock) {
+		rtlsdr_mock_free(dev->mock);
+		free(dev->mock);
+		goto done;
+	}
+
+	_rtlsdr_hotplug_deregister(dev);
+
+	libusb_release_interface(dev->devh, 0);
+
+#ifdef DETACH_KERNEL_DRIVER
+	if (dev->driver_active) {
+		if (!libusb_attach_kernel_driver(dev->devh, 0))
+			fprintf(stderr, "Reattached kernel driver\n");
+		else
+			fprintf(stderr, "Reattaching kernel driver failed!\n");
+	}
+#endif
+
+	libusb_close(dev->devh);
+
+	if (dev->loop) {
+		pthread_mutex_lock(&dev->loop->lock);
+		dev->loop->users--;
+		pthread_mutex_unlock(&dev->loop->lock);
+	} else {
+		libusb_exit(dev->ctx);
+	}
+
+done:
+	rtlsdr_set_trace(dev, NULL);
+	pthread_mutex_destroy(&dev->ring.lock);
+	pthread_cond_destroy(&dev->ring.cond);
+	pthread_mutex_destroy(&dev->ctrl_lock);
+	pthread_mutex_destroy(&dev->tag_lock);
+	pthread_mutex_destroy(&dev->trace_lock);
+	free(dev->conv_buf);
+	if (dev->ddc)
+		rtlsdr_ddc_free(dev->ddc);
+	free(dev->ddc);
+	free(dev->ddc_buf);
+	free(dev->hop);
+	free(dev->e4k_s.chan);
+	free(dev);
+
+	return 0;
+}
+
+int rtlsdr_reset_buffer(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	/* the FIFO is drained continuously by the queued transfers */
+	if (dev->sync_active) {
+		_rtlsdr_sync_flush(dev);
+		return 0;
+	}
+
+	rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x1002, 2);
+	rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x0000, 2);
+
+	return 0;
+}
+
+/* make sure the conversion buffer holds at least len bytes */
+static int _rtlsdr_conv_buf_reserve(rtlsdr_dev_t *dev, size_t len)
+{
+	unsigned char *buf;
+
+	if (dev->conv_buf_len >= len)
+		return 0;
+
+	buf = realloc(dev->conv_buf, len);
+	if (!buf)
+		return -ENOMEM;
+
+	dev->conv_buf = buf;
+	dev->conv_buf_len = len;
+
+	return 0;
+}
+
+/* make sure the DDC can take buffers of len raw bytes */
+static int _rtlsdr_ddc_reserve(rtlsdr_dev_t *dev, size_t len)
+{
+	float *buf;
+
+	if (dev->ddc_buf_len < len) {
+		buf = realloc(dev->ddc_buf, len * sizeof(float));
+		if (!buf)
+			return -ENOMEM;
+
+		dev->ddc_buf = buf;
+		dev->ddc_buf_len = len;
+	}
+
+	if (rtlsdr_ddc_reserve(dev->ddc, (uint32_t)(len / 2)) < 0)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* down-convert raw samples into out, returns the bytes written */
+static uint32_t _rtlsdr_ddc_run(rtlsdr_dev_t *dev, const unsigned char *in,
+				uint32_t len, void *out)
+{
+	int n;
+
+	rtlsdr_convert(&dev->ddc_conv, in, dev->ddc_buf, len);
+
+	n = rtlsdr_ddc_process(dev->ddc, dev->ddc_buf, len / 2, dev->rate);
+	if (n <= 0)
+		return 0;
+
+	rtlsdr_convert_float(&dev->conv, dev->ddc_buf, out, 2 * n);
+
+	return 2 * n * rtlsdr_convert_size(&dev->conv);
+}
+
+static int _rtlsdr_sync_start(rtlsdr_dev_t *dev)
+{
+	int r;
+
+	r = rtlsdr_start_stream(dev, dev->sync_num, dev->sync_len, 0);
+	if (r < 0)
+		return r;
+
+	dev->sync_active = 1;
+	dev->sync_id = -1;
+	dev->sync_gap = 0;
+	dev->sync_skip = 0;
+
+	return 0;
+}
+
+static void _rtlsdr_sync_stop(rtlsdr_dev_t *dev)
+{
+	if (!dev->sync_active)
+		return;
+
+	/* the buffers are freed with the next stream */
+	dev->sync_active = 0;
+	dev->sync_id = -1;
+	rtlsdr_stop_stream(dev);
+}
+
+/* drop the buffered samples and those still in flight */
+static void _rtlsdr_sync_flush(rtlsdr_dev_t *dev)
+{
+	unsigned char *buf;
+	uint32_t len;
+	int id;
+
+	if (dev->sync_id >= 0)
+		rtlsdr_stream_release(dev, dev->sync_id);
+	dev->sync_id = -1;
+
+	while ((id = rtlsdr_stream_acquire(dev, &buf, &len, 0)) >= 0)
+		rtlsdr_stream_release(dev, id);
+
+	dev->sync_gap = 0;
+	dev->sync_skip = _rtlsdr_stream_position(dev);
+}
+
+/* take the next buffer of the stream, skipping flushed samples */
+static int _rtlsdr_sync_next(rtlsdr_dev_t *dev)
+{
+	rtlsdr_buf_info_t info;
+	uint64_t skip;
+	int id;
+
+	for (;;) {
+		id = rtlsdr_stream_acquire(dev, &dev->sync_buf,
+					   &dev->sync_avail, -1);
+		if (id < 0)
+			return id;
+
+		rtlsdr_stream_get_info(dev, id, &info);
+
+		skip = 0;
+		if (dev->sync_skip > info.sample_index)
+			skip = (dev->sync_skip - info.sample_index) * 2;
+		else if (info.flags & RTLSDR_BUF_GAP)
+			dev->sync_gap = 1;
+
+		if (skip < dev->sync_avail) {
+			dev->sync_id = id;
+			dev->sync_off = (uint32_t)skip;
+			return 0;
+		}
+
+		rtlsdr_stream_release(dev, id);
+	}
+}
+
+/* copy raw samples from the stream, a read never spans a gap */
+static int _rtlsdr_sync_read(rtlsdr_dev_t *dev, unsigned char *buf, int len,
+			     int *n_read)
+{
+	uint32_t n;
+	int gap = 0;
+	int r;
+
+	*n_read = 0;
+
+	if (!dev->sync_active) {
+		r = _rtlsdr_sync_start(dev);
+		if (r < 0)
+			return r;
+	}
+
+	while (*n_read < len) {
+		if (dev->sync_id < 0 && _rtlsdr_sync_next(dev) < 0) {
+			_rtlsdr_sync_stop(dev);
+			return dev->dev_lost ? LIBUSB_ERROR_NO_DEVICE :
+					       LIBUSB_ERROR_IO;
+		}
+
+		if (dev->sync_gap) {
+			if (*n_read)
+				break;
+			dev->sync_gap = 0;
+			gap = 1;
+		}
+
+		n = dev->sync_avail - dev->sync_off;
+		if (n > (uint32_t)(len - *n_read))
+			n = len - *n_read;
+
+		memcpy(buf + *n_read, dev->sync_buf + dev->sync_off, n);
+		dev->sync_off += n;
+		*n_read += n;
+
+		if (dev->sync_off == dev->sync_avail) {
+			rtlsdr_stream_release(dev, dev->sync_id);
+			dev->sync_id = -1;
+		}
+	}
+
+	return gap ? RTLSDR_READ_GAP : 0;
+}
+
+static int _rtlsdr_bulk_read(rtlsdr_dev_t *dev, unsigned char *buf, int len,
+			     int *n_read)
+{
+	int r;
+
+	if (dev->sync_num)
+		return _rtlsdr_sync_read(dev, buf, len, n_read);
+
+	if (!dev->sim)
+		return libusb_bulk_transfer(dev->devh, 0x81, buf, len, n_read,
+					    BULK_TIMEOUT);
+
+	r = len > 0 ? _rtlsdr_sim_fill(dev, buf, (uint32_t)len) : 0;
+	*n_read = r < 0 ? 0 : r;
+
+	return r < 0 ? LIBUSB_ERROR_NO_DEVICE : 0;
+}
+
+int rtlsdr_set_sync_queue(rtlsdr_dev_t *dev, uint32_t buf_num,
+			  uint32_t buf_len)
+{
+	if (!dev)
+		return -1;
+
+	/* a stream of its own is in the way */
+	if (!dev->sync_active && (RTLSDR_INACTIVE != dev->async_status ||
+				  dev->async_thread_active))
+		return -2;
+
+	/* the new setup applies from the next read on */
+	_rtlsdr_sync_stop(dev);
+
+	dev->sync_num = buf_num;
+	dev->sync_len = buf_len;
+
+	return 0;
+}
+
+/* raw bytes read and decimated at once by rtlsdr_read_sync() */
+#define DDC_SYNC_CHUNK		DEFAULT_BUF_LENGTH
+
+/*
+ * Reads and decimates raw chunks until out can't take the output of
+ * another one. n is the number of complex output samples out holds.
+ */
+static int _rtlsdr_ddc_read_sync(rtlsdr_dev_t *dev, uint8_t *out, int n,
+				 unsigned int size, int *n_read)
+{
+	uint64_t want;
+	uint32_t done;
+	int len, got;
+	int gap = 0;
+	int r = 0;
+
+	*n_read = 0;
+
+	/* the filter history may complete one more output sample
+	 * than the raw samples alone would give */
+	if (n < 2)
+		return -1;
+
+	if (_rtlsdr_conv_buf_reserve(dev, DDC_SYNC_CHUNK) < 0 ||
+	    _rtlsdr_ddc_reserve(dev, DDC_SYNC_CHUNK) < 0)
+		return -ENOMEM;
+
+	while (n >= 2) {
+		want = (uint64_t)(n - 1) * dev->ddc->decim * 2;
+		len = want < DDC_SYNC_CHUNK ? (int)want : DDC_SYNC_CHUNK;
+
+		r = _rtlsdr_bulk_read(dev, dev->conv_buf, len, &got);
+
+		/* the filter history doesn't belong to the samples after
+		 * a gap, a gap of any chunk is reported for the whole read */
+		if (RTLSDR_READ_GAP == r) {
+			rtlsdr_ddc_reset(dev->ddc);
+			gap = 1;
+		}
+
+		if (got > 0) {
+			done = _rtlsdr_ddc_run(dev, dev->conv_buf, got, out);
+			out += done;
+			*n_read += done;
+			n -= done / (2 * size);
+		}
+		if (r < 0 || got < len)
+			break;
+	}
+
+	if (r < 0)
+		return r;
+
+	return gap ? RTLSDR_READ_GAP : 0;
+}
+
+int rtlsdr_read_sync(rtlsdr_dev_t *dev, void *buf, int len, int *n_read)
+{
+	unsigned int size;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_OUTPUT_CU8 == dev->conv.format && !dev->ddc) {
+		r = _rtlsdr_bulk_read(dev, buf, len, n_read);
+		if (*n_read > 0 &&
+		    (dev->conv.dc_correct || dev->conv.iq_correct))
+			rtlsdr_convert(&dev->conv, buf, buf, *n_read);
+		return r;
+	}
+
+	/* read raw samples and convert them into the caller's buffer */
+	size = rtlsdr_convert_size(&dev->conv);
+	len /= size;
+
+	if (dev->ddc)
+		return _rtlsdr_ddc_read_sync(dev, buf, len / 2, size, n_read);
+
+	if (_rtlsdr_conv_buf_reserve(dev, len) < 0)
+		return -ENOMEM;
+
+	r = _rtlsdr_bulk_read(dev, dev->conv_buf, len, n_read);
+	if (*n_read > 0)
+		rtlsdr_convert(&dev->conv, dev->conv_buf, buf, *n_read);
+	*n_read *= size;
+
+	return r;
+}
+
+int rtlsdr_set_output_format(rtlsdr_dev_t *dev,
+			     enum rtlsdr_output_format format,
+			     float scale, int dc_correct)
+{
+	int iq_correct;
+
+	if (!dev)
+		return -1;
+
+	if (format < RTLSDR_OUTPUT_CU8 || format > RTLSDR_OUTPUT_CF32)
+		return -1;
+
+	/* queued sync reads are converted by the reading thread */
+	if (RTLSDR_INACTIVE != dev->async_status && !dev->sync_active)
+		return -2;
+
+	iq_correct = dev->conv.iq_correct;
+	rtlsdr_convert_init(&dev->conv, format, scale, dc_correct, iq_correct);
+	rtlsdr_convert_init(&dev->ddc_conv, RTLSDR_OUTPUT_CF32, 1.0f,
+			    dc_correct, iq_correct);
+
+	return 0;
+}
+
+int rtlsdr_set_ddc(rtlsdr_dev_t *dev, int32_t offset, uint32_t decimation)
+{
+	rtlsdr_ddc_t *ddc = NULL;
+
+	if (!dev)
+		return -1;
+
+	/* retuning the NCO is fine while streaming */
+	if (dev->ddc && decimation == dev->ddc->decim) {
+		dev->ddc->offset = offset;
+		return 0;
+	}
+
+	if (RTLSDR_INACTIVE != dev->async_status && !dev->sync_active)
+		return -2;
+
+	if (decimation) {
+		ddc = malloc(sizeof(rtlsdr_ddc_t));
+		if (!ddc)
+			return -ENOMEM;
+
+		if (rtlsdr_ddc_init(ddc, decimation) < 0) {
+			free(ddc);
+			return -1;
+		}
+		ddc->offset = offset;
+	}
+
+	if (dev->ddc) {
+		rtlsdr_ddc_free(dev->ddc);
+		free(dev->ddc);
+	}
+	dev->ddc = ddc;
+
+	rtlsdr_convert_init(&dev->ddc_conv, RTLSDR_OUTPUT_CF32, 1.0f,
+			    dev->conv.dc_correct, dev->conv.iq_correct);
+
+	return 0;
+}
+
+int rtlsdr_set_correction(rtlsdr_dev_t *dev, int flags)
+{
+	int dc = (flags & RTLSDR_CORRECT_DC) ? 1 : 0;
+	int iq = (flags & RTLSDR_CORRECT_IQ) ? 1 : 0;
+
+	if (!dev)
+		return -1;
+
+	rtlsdr_convert_correct(&dev->conv, dc, iq);
+	rtlsdr_convert_correct(&dev->ddc_conv, dc, iq);
+
+	return 0;
+}
+
+int rtlsdr_get_iq_stats(rtlsdr_dev_t *dev, rtlsdr_iq_stats_t *stats)
+{
+	if (!dev || !stats)
+		return -1;
+
+	/* the DDC corrects its input */
+	rtlsdr_convert_stats(dev->ddc ? &dev->ddc_conv : &dev->conv, stats);
+
+	return 0;
+}
+
+static void _rtlsdr_abstime(struct timespec *ts, int timeout_ms)
+{
+#ifdef _WIN32
+	struct _timeb tb;
+
+	_ftime(&tb);
+	ts->tv_sec = tb.time + timeout_ms / 1000;
+	ts->tv_nsec = (tb.millitm + timeout_ms % 1000) * 1000000L;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec + timeout_ms / 1000;
+	ts->tv_nsec = tv.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+#endif
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static uint64_t _rtlsdr_monotonic_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+
+	return (uint64_t)(cnt.QuadPart / freq.QuadPart) * 1000000000ULL +
+	       (uint64_t)(cnt.QuadPart % freq.QuadPart) * 1000000000ULL /
+	       (uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void _rtlsdr_sleep_ns(uint64_t ns)
+{
+#ifdef _WIN32
+	Sleep((DWORD)(ns / 1000000));
+#else
+	usleep((useconds_t)(ns / 1000));
+#endif
+}
+
+/* hold back simulated samples until the sample rate has produced them */
+static void _rtlsdr_sim_pace(rtlsdr_dev_t *dev, uint32_t len)
+{
+	uint32_t rate = dev->rate ? dev->rate : SIM_DEFAULT_RATE;
+	uint64_t now, due;
+
+	if (!dev->sim->realtime)
+		return;
+
+	now = _rtlsdr_monotonic_ns();
+
+	if (!dev->sim_t0 || dev->sim_rate != rate) {
+		dev->sim_t0 = now;
+		dev->sim_samples = 0;
+		dev->sim_rate = rate;
+	}
+
+	dev->sim_samples += len / 2;
+	due = dev->sim_t0 +
+	      dev->sim_samples / rate * 1000000000ULL +
+	      dev->sim_samples % rate * 1000000000ULL / rate;
+
+	if (due > now) {
+		_rtlsdr_sleep_ns(due - now);
+	} else if (now - due > 1000000000ULL) {
+		/* the reader fell far behind, drop the backlog like the
+		 * device FIFO would instead of bursting to catch up */
+		dev->sim_t0 = now;
+		dev->sim_samples = 0;
+	}
+}
+
+/* fill a buffer of a simulated device, returns the bytes or -1 at the end */
+static int _rtlsdr_sim_fill(rtlsdr_dev_t *dev, unsigned char *buf,
+			    uint32_t len)
+{
+	_rtlsdr_sim_pace(dev, len);
+
+	return rtlsdr_sim_read(dev->sim, buf, len, dev->rate,
+			       dev->sim_agc ? -1 : dev->gain);
+}
+
+/*
+ * Bulk transfers of a simulated device never reach libusb, they wait in
+ * sim_q in submission order and are completed by _rtlsdr_sim_events().
+ */
+static int _rtlsdr_xfer_submit(rtlsdr_dev_t *dev, struct libusb_transfer *xfer)
+{
+	rtlsdr_xfer_ctx_t *xc = (rtlsdr_xfer_ctx_t *)xfer->user_data;
+	int r;
+
+	if (!dev->sim) {
+		r = libusb_submit_transfer(xfer);
+		if (!r)
+			xc->busy = 1;
+		return r;
+	}
+
+	xc->busy = 1;
+	xc->sim_queued = 1;
+	xc->sim_cancel = 0;
+	dev->sim_q[dev->sim_head++ % dev->xfer_buf_num] = xc->idx;
+
+	return 0;
+}
+
+static int _rtlsdr_xfer_cancel(rtlsdr_dev_t *dev, struct libusb_transfer *xfer)
+{
+	rtlsdr_xfer_ctx_t *xc = (rtlsdr_xfer_ctx_t *)xfer->user_data;
+
+	if (!dev->sim)
+		return libusb_cancel_transfer(xfer);
+
+	if (!xc->sim_queued)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	xc->sim_cancel = 1;
+
+	return 0;
+}
+
+static int _rtlsdr_sim_events(rtlsdr_dev_t *dev, int *completed)
+{
+	struct libusb_transfer *xfer;
+	rtlsdr_xfer_ctx_t *xc;
+	int r;
+
+	if (completed && *completed)
+		return 0;
+
+	if (dev->sim_head == dev->sim_tail) {
+		_rtlsdr_sleep_ns(1000000);
+		return 0;
+	}
+
+	xc = &dev->xfer_ctx[dev->sim_q[dev->sim_tail++ % dev->xfer_buf_num]];
+	xfer = dev->xfer[xc->idx];
+	xc->sim_queued = 0;
+
+	if (xc->sim_cancel) {
+		xfer->status = LIBUSB_TRANSFER_CANCELLED;
+		xfer->actual_length = 0;
+	} else {
+		r = _rtlsdr_sim_fill(dev, xfer->buffer, xfer->length);
+		if (r < 0) {
+			/* a played out file ends the stream like an unplug */
+			xfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+			xfer->actual_length = 0;
+		} else {
+			xfer->status = LIBUSB_TRANSFER_COMPLETED;
+			xfer->actual_length = r;
+		}
+	}
+
+	xfer->callback(xfer);
+
+	return 0;
+}
+
+static int _rtlsdr_handle_events(rtlsdr_dev_t *dev, struct timeval *tv,
+				 int *completed)
+{
+	if (dev->sim)
+		return _rtlsdr_sim_events(dev, completed);
+
+	return libusb_handle_events_timeout_completed(dev->ctx, tv, completed);
+}
+
+static int _rtlsdr_spsc_push(rtlsdr_spsc_t *q, uint32_t val)
+{
+	uint32_t head = q->head;
+
+	if (head - (uint32_t)ATOMIC_LOAD(&q->tail) > q->mask)
+		return -1;
+
+	q->slot[head & q->mask] = val;
+	ATOMIC_STORE(&q->head, head + 1);
+
+	return 0;
+}
+
+static int _rtlsdr_spsc_pop(rtlsdr_spsc_t *q, uint32_t *val)
+{
+	uint32_t tail = q->tail;
+
+	if ((uint32_t)ATOMIC_LOAD(&q->head) == tail)
+		return -1;
+
+	*val = q->slot[tail & q->mask];
+	ATOMIC_STORE(&q->tail, tail + 1);
+
+	return 0;
+}
+
+/*
+ * Describe a completed transfer: position in the sample stream, completion
+ * time and whether samples went missing since the previous buffer.
+ */
+static void _rtlsdr_buf_info(rtlsdr_dev_t *dev, rtlsdr_xfer_ctx_t *xc,
+			     struct libusb_transfer *xfer,
+			     rtlsdr_buf_info_t *info)
+{
+	uint64_t now = _rtlsdr_monotonic_ns();
+	uint64_t dt, expected, received, backlog;
+	int reanchor = 1;
+
+	info->sample_index = dev->sample_count;
+	info->timestamp_ns = now;
+	info->xfer_index = xc->idx;
+	info->flags = 0;
+
+	ATOMIC_ADD64(&dev->sample_count, xfer->actual_length / 2);
+
+	/* tags are added in stream order, flag the buffer if the next
+	 * one not seen yet lies within it */
+	if (dev->tag_seen != ATOMIC_LOAD(&dev->tag_head)) {
+		pthread_mutex_lock(&dev->tag_lock);
+		if (dev->tag_head - dev->tag_seen > TAG_RING_LEN)
+			dev->tag_seen = dev->tag_head - TAG_RING_LEN;
+		while (dev->tag_seen != dev->tag_head &&
+		       dev->tags[dev->tag_seen % TAG_RING_LEN].sample_index <
+		       dev->sample_count) {
+			info->flags |= RTLSDR_BUF_TAG;
+			dev->tag_seen++;
+		}
+		pthread_mutex_unlock(&dev->tag_lock);
+	}
+
+	if (dev->anchor_ns && dev->rate) {
+		/* The host can buffer at most all in-flight transfers. If
+		 * the wall clock says the device produced more samples than
+		 * that on top of what we received, its FIFO has overflown. */
+		dt = now - dev->anchor_ns;
+		expected = (dt / 1000000000ULL) * dev->rate +
+			   (dt % 1000000000ULL) * dev->rate / 1000000000ULL;
+		received = dev->sample_count - dev->anchor_samples;
+		backlog = (uint64_t)(dev->xfer_buf_num + 1) *
+			  dev->xfer_buf_len / 2;
+
+		if (expected > received + backlog) {
+			dev->gap_pending = 1;
+			ATOMIC_ADD64(&dev->stats.dropped_samples,
+				     expected - received - backlog);
+		} else if (received < expected)
+			reanchor = 0;
+	}
+
+	/* (re)start the time base whenever we are caught up, this keeps
+	 * it free from drift between the host and the device clock */
+	if (reanchor) {
+		ATOMIC_ADD(&dev->anchor_seq, 1);
+		ATOMIC_STORE64(&dev->anchor_ns, now);
+		ATOMIC_STORE64(&dev->anchor_samples, dev->sample_count);
+		ATOMIC_ADD(&dev->anchor_seq, 1);
+	}
+
+	if (dev->gap_pending) {
+		info->flags |= RTLSDR_BUF_GAP;
+		dev->gap_pending = 0;
+		ATOMIC_ADD64(&dev->stats.gaps, 1);
+	}
+}
+
+/* estimate how many samples the device has produced by now */
+static uint64_t _rtlsdr_stream_position(rtlsdr_dev_t *dev)
+{
+	uint64_t ns, samples, dt, pos, received;
+	uint32_t seq;
+
+	do {
+		seq = ATOMIC_LOAD(&dev->anchor_seq);
+		ns = ATOMIC_LOAD64(&dev->anchor_ns);
+		samples = ATOMIC_LOAD64(&dev->anchor_samples);
+	} while ((seq & 1) || seq != ATOMIC_LOAD(&dev->anchor_seq));
+
+	received = ATOMIC_LOAD64(&dev->sample_count);
+	if (!ns || !dev->rate)
+		return received;
+
+	dt = _rtlsdr_monotonic_ns() - ns;
+	pos = samples + (dt / 1000000000ULL) * dev->rate +
+	      (dt % 1000000000ULL) * dev->rate / 1000000000ULL;
+
+	/* delivered samples can not be tagged anymore */
+	return (pos > received) ? pos : received;
+}
+
+/* record a setting change committed to the device just now */
+static void _rtlsdr_add_tag(rtlsdr_dev_t *dev, uint32_t type, uint32_t value)
+{
+	rtlsdr_tag_t *tag;
+	uint64_t pos;
+
+	if (RTLSDR_RUNNING != dev->async_status)
+		return;
+
+	pthread_mutex_lock(&dev->tag_lock);
+
+	pos = _rtlsdr_stream_position(dev);
+	if (pos < dev->tag_last)
+		pos = dev->tag_last;
+
+	tag = &dev->tags[dev->tag_head % TAG_RING_LEN];
+	tag->sample_index = pos;
+	tag->type = type;
+	tag->value = value;
+	dev->tag_last = pos;
+	ATOMIC_ADD(&dev->tag_head, 1);
+
+	pthread_mutex_unlock(&dev->tag_lock);
+}
+
+static void _rtlsdr_stats_complete(rtlsdr_dev_t *dev, uint32_t len,
+				   uint64_t cb_ns)
+{
+	rtlsdr_stream_stats_t *st = &dev->stats;
+	uint64_t us = cb_ns / 1000;
+	unsigned int bin = 0;
+
+	ATOMIC_ADD64(&st->transfers, 1);
+	ATOMIC_ADD64(&st->bytes, len);
+
+	if (us > 0xffffffffULL)
+		us = 0xffffffffULL;
+
+	if (us > st->cb_max_us)
+		ATOMIC_STORE(&st->cb_max_us, (uint32_t)us);
+
+	while (us && bin < RTLSDR_STATS_HIST_BINS - 1) {
+		us >>= 1;
+		bin++;
+	}
+
+	ATOMIC_ADD64(&st->cb_hist[bin], 1);
+}
+
+static void _rtlsdr_stats_error(rtlsdr_dev_t *dev, int status)
+{
+	rtlsdr_stream_stats_t *st = &dev->stats;
+
+	ATOMIC_ADD64(&st->errors, 1);
+
+	switch (status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		ATOMIC_ADD64(&st->err_timeout, 1);
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		ATOMIC_ADD64(&st->err_stall, 1);
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		ATOMIC_ADD64(&st->err_no_device, 1);
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		ATOMIC_ADD64(&st->err_overflow, 1);
+		break;
+	default:
+		ATOMIC_ADD64(&st->err_io, 1);
+		break;
+	}
+}
+
+/* drop a reference to a subscribed buffer, lock held */
+static void _rtlsdr_sub_unref(rtlsdr_ring_t *ring, uint32_t id)
+{
+	if (ring->ref[id] && !--ring->ref[id])
+		_rtlsdr_spsc_push(&ring->free, id);
+}
+
+/* drop the oldest queued buffer of a subscriber, lock held */
+static int _rtlsdr_sub_drop(rtlsdr_ring_t *ring, rtlsdr_sub_t *sub)
+{
+	uint32_t id;
+
+	if (sub->head == sub->tail)
+		return -1;
+
+	id = sub->slot[sub->tail++ % sub->size];
+	sub->drops++;
+	_rtlsdr_sub_unref(ring, id);
+
+	return 0;
+}
+
+/* queue a completed buffer for every subscriber */
+static void _rtlsdr_ring_fanout(rtlsdr_ring_t *ring, uint32_t id)
+{
+	rtlsdr_sub_t *sub;
+	uint32_t i, limit;
+
+	pthread_mutex_lock(&ring->lock);
+
+	ring->ref[id] = 1; /* held while being queued */
+
+	for (i = 0; i < RING_MAX_SUBS; i++) {
+		sub = &ring->subs[i];
+		if (!sub->used || !sub->slot)
+			continue;
+
+		limit = sub->size;
+		if (RTLSDR_SUB_DROP_OLDEST == sub->policy && sub->queue_len &&
+		    sub->queue_len < limit)
+			limit = sub->queue_len;
+
+		if (sub->head - sub->tail >= limit)
+			_rtlsdr_sub_drop(ring, sub);
+
+		sub->slot[sub->head++ % sub->size] = id;
+		ring->ref[id]++;
+	}
+
+	_rtlsdr_sub_unref(ring, id);
+
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/* take back the oldest buffers of lagging subscribers that allow it */
+static void _rtlsdr_ring_reclaim(rtlsdr_ring_t *ring)
+{
+	rtlsdr_sub_t *sub;
+	uint32_t i;
+	int dropped;
+
+	pthread_mutex_lock(&ring->lock);
+
+	do {
+		dropped = 0;
+		for (i = 0; i < RING_MAX_SUBS; i++) {
+			sub = &ring->subs[i];
+			if (!sub->used || !sub->slot ||
+			    RTLSDR_SUB_DROP_OLDEST != sub->policy)
+				continue;
+
+			if (!_rtlsdr_sub_drop(ring, sub))
+				dropped = 1;
+		}
+	} while (dropped && (uint32_t)ATOMIC_LOAD(&ring->free.head) ==
+			    ring->free.tail);
+
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/* hand a completed buffer to the consumer and attach a spare one */
+static void _rtlsdr_ring_complete(rtlsdr_dev_t *dev, rtlsdr_xfer_ctx_t *xc,
+				  struct libusb_transfer *xfer,
+				  rtlsdr_buf_info_t *info)
+{
+	rtlsdr_ring_t *ring = &dev->ring;
+	int fanout = ATOMIC_LOAD(&ring->nsubs) > 0;
+	uint32_t spare;
+	int r;
+
+	r = _rtlsdr_spsc_pop(&ring->free, &spare);
+	if (r < 0 && fanout) {
+		_rtlsdr_ring_reclaim(ring);
+		r = _rtlsdr_spsc_pop(&ring->free, &spare);
+	}
+
+	if (r < 0) {
+		/* consumer is lagging behind, drop the data and
+		 * resubmit the transfer with the same buffer */
+		ATOMIC_ADD(&ring->overruns, 1);
+		ATOMIC_ADD64(&ring->overrun_bytes, xfer->actual_length);
+		dev->gap_pending = 1;
+		return;
+	}
+
+	ring->len[xc->buf] = xfer->actual_length;
+	ring->info[xc->buf] = *info;
+
+	if (fanout)
+		_rtlsdr_ring_fanout(ring, xc->buf);
+	else
+		_rtlsdr_spsc_push(&ring->fill, xc->buf);
+
+	xc->buf = spare;
+	xfer->buffer = dev->xfer_buf[spare];
+
+	if (!fanout && ATOMIC_LOAD(&ring->waiters)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_signal(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+static void _rtlsdr_adapt_evaluate(rtlsdr_dev_t *dev)
+{
+	uint64_t headroom;
+	uint32_t active = dev->xfer_active;
+	uint32_t len = dev->xfer_len;
+
+	/* time the other queued transfers can absorb while the
+	 * completion of one of them is being serviced */
+	headroom = (uint64_t)(active - 1) * (len / 2) * 1000000000ULL /
+		   dev->rate;
+
+	if (dev->adapt_stall_ns * 2 > headroom) {
+		/* deeper queues cost no latency, so try these first */
+		if (active < dev->adapt_max_num)
+			active += (active / 2) ? active / 2 : 1;
+		else if (len < dev->adapt_max_len)
+			len *= 2;
+
+		dev->adapt_calm = 0;
+	} else if (dev->adapt_stall_ns * 8 < headroom) {
+		if (++dev->adapt_calm >= ADAPT_CALM_WINDOWS) {
+			/* shorter transfers reduce latency */
+			if (len > dev->adapt_min_len)
+				len = (len / 2) & ~511;
+			else if (active > dev->adapt_min_num)
+				active--;
+
+			dev->adapt_calm = 0;
+		}
+	} else {
+		dev->adapt_calm = 0;
+	}
+
+	if (active > dev->adapt_max_num)
+		active = dev->adapt_max_num;
+	if (len > dev->adapt_max_len)
+		len = dev->adapt_max_len;
+	if (len < dev->adapt_min_len)
+		len = dev->adapt_min_len;
+
+	ATOMIC_STORE(&dev->xfer_active, active);
+	ATOMIC_STORE(&dev->xfer_len, len);
+}
+
+/*
+ * Resubmit or park a completed transfer when adaptive buffering is
+ * enabled. The worst of callback service time and completion lateness
+ * over a window is compared against the time the queued transfers can
+ * cover, the queue is then deepened quickly and shortened slowly.
+ */
+static void _rtlsdr_adapt_complete(rtlsdr_dev_t *dev, rtlsdr_xfer_ctx_t *xc,
+				   struct libusb_transfer *xfer,
+				   uint64_t t_complete, uint64_t now)
+{
+	uint64_t stall = now - t_complete;
+	uint64_t period, late;
+	uint32_t i;
+
+	if (dev->adapt_last_ns && dev->rate) {
+		period = (uint64_t)(xfer->actual_length / 2) * 1000000000ULL /
+			 dev->rate;
+		late = t_complete - dev->adapt_last_ns;
+		late = late > period ? late - period : 0;
+		if (late > stall)
+			stall = late;
+	}
+	dev->adapt_last_ns = t_complete;
+
+	if (stall > dev->adapt_stall_ns)
+		dev->adapt_stall_ns = stall;
+
+	if (!dev->adapt_window_ns) {
+		dev->adapt_window_ns = now;
+	} else if (now - dev->adapt_window_ns >= ADAPT_WINDOW_NS) {
+		if (dev->rate)
+			_rtlsdr_adapt_evaluate(dev);
+		dev->adapt_window_ns = now;
+		dev->adapt_stall_ns = 0;
+	}
+
+	dev->xfer_inflight--;
+
+	if (RTLSDR_RUNNING != dev->async_status)
+		return;
+
+	if (dev->xfer_inflight >= dev->xfer_active) {
+		xc->parked = 1;
+		return;
+	}
+
+	xfer->length = dev->xfer_len;
+	if (!_rtlsdr_xfer_submit(dev, xfer))
+		dev->xfer_inflight++;
+
+	/* bring parked transfers back when the queue was deepened */
+	for (i = 0; i < dev->xfer_buf_num &&
+		    dev->xfer_inflight < dev->xfer_active; i++) {
+		if (!dev->xfer_ctx[i].parked)
+			continue;
+
+		dev->xfer[i]->length = dev->xfer_len;
+		if (_rtlsdr_xfer_submit(dev, dev->xfer[i]) < 0)
+			break;
+
+		dev->xfer_ctx[i].parked = 0;
+		dev->xfer_inflight++;
+	}
+}
+
+/* take over a failing stream, returns 1 if it is being recovered */
+static int _rtlsdr_recover_begin(rtlsdr_dev_t *dev, int status)
+{
+	int lost = (LIBUSB_TRANSFER_NO_DEVICE == status);
+
+	if (RTLSDR_RUNNING != dev->async_status)
+		return 0;
+
+	if (dev->recover_state)
+		return 1;
+
+	if (dev->recover_tries >= RECOVER_RETRIES)
+		return 0;
+
+	if (!(dev->recover_flags & (lost ? RTLSDR_RECOVER_REATTACH :
+					   RTLSDR_RECOVER_RESET)))
+		return 0;
+
+	fprintf(stderr, "cb transfer status: %d, recovering...\n", status);
+
+	dev->recover_lost = lost;
+	dev->recover_tries++;
+	dev->recover_state = RTLSDR_RECOVER_CANCEL;
+
+	return 1;
+}
+
+static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+{
+	rtlsdr_xfer_ctx_t *xc = (rtlsdr_xfer_ctx_t *)xfer->user_data;
+	rtlsdr_dev_t *dev = xc->dev;
+	rtlsdr_buf_info_t info;
+	unsigned char *buf = xfer->buffer;
+	uint32_t len = xfer->actual_length;
+	uint64_t t_done;
+
+	xc->busy = 0;
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
+		_rtlsdr_buf_info(dev, xc, xfer, &info);
+
+		if (RTLSDR_ASYNC_RING == dev->async_mode) {
+			/* raw samples only */
+		} else if (dev->ddc) {
+			len = _rtlsdr_ddc_run(dev, buf, len, dev->conv_buf);
+			buf = dev->conv_buf;
+		} else if (RTLSDR_OUTPUT_CU8 != dev->conv.format) {
+			rtlsdr_convert(&dev->conv, buf, dev->conv_buf, len);
+			buf = dev->conv_buf;
+			len *= rtlsdr_convert_size(&dev->conv);
+		} else if (dev->conv.dc_correct || dev->conv.iq_correct) {
+			/* corrected cu8 goes back into the transfer buffer */
+			rtlsdr_convert(&dev->conv, buf, buf, len);
+		}
+
+		if (RTLSDR_ASYNC_RING == dev->async_mode) {
+			_rtlsdr_ring_complete(dev, xc, xfer, &info);
+		} else if (!len && dev->ddc) {
+			/* with a high decimation a buffer may not
+			 * complete any output sample */
+		} else if (dev->cb_ex) {
+			dev->cb_ex(buf, len, &info, dev->cb_ctx);
+		} else if (dev->cb) {
+			dev->cb(buf, len, dev->cb_ctx);
+		}
+
+		t_done = _rtlsdr_monotonic_ns();
+		_rtlsdr_stats_complete(dev, xfer->actual_length,
+				       t_done - info.timestamp_ns);
+
+		if (dev->recover_state) {
+			/* resubmitted once the endpoint has been reset */
+		} else if (dev->adapt) {
+			_rtlsdr_adapt_complete(dev, xc, xfer,
+					       info.timestamp_ns, t_done);
+		} else {
+			_rtlsdr_xfer_submit(dev, xfer); /* resubmit transfer */
+		}
+		dev->xfer_errors = 0;
+		dev->recover_tries = 0;
+	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
+		/* the data of this transfer is lost */
+		dev->gap_pending = 1;
+		_rtlsdr_stats_error(dev, xfer->status);
+		if (dev->adapt)
+			dev->xfer_inflight--;
+#ifndef _WIN32
+		if (LIBUSB_TRANSFER_ERROR == xfer->status)
+			dev->xfer_errors++;
+
+		if (dev->xfer_errors >= dev->xfer_buf_num ||
+		    LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
+#endif
+			if (_rtlsdr_recover_begin(dev, xfer->status))
+				return;
+
+			dev->dev_lost = 1;
+			rtlsdr_cancel_async(dev);
+			fprintf(stderr, "cb transfer status: %d, "
+				"canceling...\n", xfer->status);
+#ifndef _WIN32
+		}
+#endif
+	}
+}
+
+int rtlsdr_wait_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx)
+{
+	return rtlsdr_read_async(dev, cb, ctx, 0, 0);
+}
+
+static void _rtlsdr_free_ring(rtlsdr_dev_t *dev)
+{
+	rtlsdr_ring_t *ring = &dev->ring;
+	uint32_t i;
+
+	free(ring->fill.slot);
+	free(ring->free.slot);
+	free(ring->len);
+	free(ring->info);
+	ring->fill.slot = NULL;
+	ring->free.slot = NULL;
+	ring->len = NULL;
+	ring->info = NULL;
+
+	pthread_mutex_lock(&ring->lock);
+	for (i = 0; i < RING_MAX_SUBS; i++) {
+		free(ring->subs[i].slot);
+		ring->subs[i].slot = NULL;
+		ring->subs[i].size = 0;
+	}
+	free(ring->ref);
+	ring->ref = NULL;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/* size the queue of a subscriber for the current stream, lock held */
+static int _rtlsdr_sub_alloc(rtlsdr_ring_t *ring, rtlsdr_sub_t *sub,
+			     uint32_t buf_cnt)
+{
+	sub->slot = malloc(buf_cnt * sizeof(uint32_t));
+	if (!sub->slot)
+		return -ENOMEM;
+
+	sub->size = buf_cnt;
+	sub->head = sub->tail = 0;
+
+	return 0;
+}
+
+static int _rtlsdr_alloc_ring(rtlsdr_dev_t *dev)
+{
+	rtlsdr_ring_t *ring = &dev->ring;
+	uint32_t size = 1;
+	uint32_t i;
+
+	/* both queues must be able to hold every buffer at once */
+	while (size < dev->xfer_buf_cnt)
+		size <<= 1;
+
+	ring->fill.slot = malloc(size * sizeof(uint32_t));
+	ring->free.slot = malloc(size * sizeof(uint32_t));
+	ring->len = malloc(dev->xfer_buf_cnt * sizeof(uint32_t));
+	ring->info = malloc(dev->xfer_buf_cnt * sizeof(rtlsdr_buf_info_t));
+	ring->ref = calloc(dev->xfer_buf_cnt, sizeof(uint32_t));
+	if (!ring->fill.slot || !ring->free.slot || !ring->len || !ring->info ||
+	    !ring->ref) {
+		_rtlsdr_free_ring(dev);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	for (i = 0; i < RING_MAX_SUBS; i++) {
+		if (ring->subs[i].used &&
+		    _rtlsdr_sub_alloc(ring, &ring->subs[i],
+				      dev->xfer_buf_cnt) < 0)
+			break;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	if (i < RING_MAX_SUBS) {
+		_rtlsdr_free_ring(dev);
+		return -ENOMEM;
+	}
+
+	ring->fill.mask = ring->free.mask = size - 1;
+	ring->fill.head = ring->fill.tail = 0;
+	ring->free.head = ring->free.tail = 0;
+	ring->overruns = 0;
+	ring->overrun_bytes = 0;
+	ring->waiters = 0;
+	ring->active = 1;
+
+	/* buffers not attached to a transfer start out as spares */
+	for (i = dev->xfer_buf_num; i < dev->xfer_buf_cnt; i++)
+		_rtlsdr_spsc_push(&ring->free, i);
+
+	return 0;
+}
+
+static void _rtlsdr_pool_free(rtlsdr_dev_t *dev)
+{
+	if (!dev->pool_mem)
+		return;
+
+#ifdef _WIN32
+	if (dev->pool_flags & RTLSDR_POOL_MLOCK)
+		VirtualUnlock(dev->pool_mem, dev->pool_size);
+	VirtualFree(dev->pool_mem, 0, MEM_RELEASE);
+#else
+	munmap(dev->pool_mem, dev->pool_size);
+#endif
+	dev->pool_mem = NULL;
+	dev->pool_size = 0;
+}
+
+/*
+ * Carve all transfer buffers out of one page aligned arena. On Linux the
+ * arena can be backed by huge pages (explicit ones if reserved, transparent
+ * ones otherwise) and bound to a NUMA node. It is locked and prefaulted so
+ * no page faults hit the buffers while streaming.
+ */
+static int _rtlsdr_pool_alloc(rtlsdr_dev_t *dev)
+{
+	size_t stride = (dev->xfer_buf_len + POOL_ALIGN - 1) &
+			~((size_t)POOL_ALIGN - 1);
+	size_t size = stride * dev->xfer_buf_cnt;
+	unsigned char *mem = NULL;
+	unsigned int i;
+#ifdef __linux__
+	unsigned long nodemask[4];
+#endif
+
+	if (dev->pool_flags & RTLSDR_POOL_HUGEPAGES)
+		size = (size + POOL_HUGEPAGE_SIZE - 1) &
+		       ~((size_t)POOL_HUGEPAGE_SIZE - 1);
+
+#ifdef _WIN32
+	mem = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+			   PAGE_READWRITE);
+	if (!mem)
+		return -ENOMEM;
+
+	if ((dev->pool_flags & RTLSDR_POOL_MLOCK) &&
+	    !VirtualLock(mem, size))
+		fprintf(stderr, "Failed to lock transfer buffers in memory\n");
+#else
+#ifdef MAP_HUGETLB
+	if (dev->pool_flags & RTLSDR_POOL_HUGEPAGES) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (MAP_FAILED == mem)
+			mem = NULL;
+	}
+#endif
+
+	if (!mem) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == mem)
+			return -ENOMEM;
+
+#ifdef MADV_HUGEPAGE
+		if (dev->pool_flags & RTLSDR_POOL_HUGEPAGES)
+			madvise(mem, size, MADV_HUGEPAGE);
+#endif
+	}
+
+#ifdef __linux__
+	/* bind before the pages are touched, MPOL_BIND is 2 */
+	if (dev->pool_node >= 0 &&
+	    dev->pool_node < (int)(sizeof(nodemask) * 8)) {
+		memset(nodemask, 0, sizeof(nodemask));
+		nodemask[dev->pool_node / (sizeof(unsigned long) * 8)] |=
+			1UL << (dev->pool_node % (sizeof(unsigned long) * 8));
+		if (syscall(SYS_mbind, mem, size, 2, nodemask,
+			    sizeof(nodemask) * 8, 0))
+			fprintf(stderr, "Failed to bind transfer buffers to "
+					"NUMA node %d\n", dev->pool_node);
+	}
+#endif
+
+	if ((dev->pool_flags & RTLSDR_POOL_MLOCK) && mlock(mem, size))
+		fprintf(stderr, "Failed to lock transfer buffers in memory\n");
+#endif
+
+	/* prefault */
+	memset(mem, 0, size);
+
+	dev->pool_mem = mem;
+	dev->pool_size = size;
+
+	for (i = 0; i < dev->xfer_buf_cnt; ++i)
+		dev->xfer_buf[i] = mem + i * stride;
+
+	return 0;
+}
+
+/* return the transfers to their initial state, also between streams */
+static void _rtlsdr_xfer_reset(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+
+	dev->sim_head = 0;
+	dev->sim_tail = 0;
+
+	for(i = 0; i < dev->xfer_buf_num; ++i) {
+		/* a reused transfer still has the status it was reaped with */
+		if (dev->xfer[i])
+			dev->xfer[i]->status = LIBUSB_TRANSFER_COMPLETED;
+		dev->xfer_ctx[i].dev = dev;
+		dev->xfer_ctx[i].idx = i;
+		dev->xfer_ctx[i].buf = i;
+		dev->xfer_ctx[i].parked = 0;
+		dev->xfer_ctx[i].busy = 0;
+		dev->xfer_ctx[i].sim_queued = 0;
+		dev->xfer_ctx[i].sim_cancel = 0;
+	}
+}
+
+static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return -1;
+
+	if (!dev->xfer) {
+		dev->xfer = malloc(dev->xfer_buf_num *
+				   sizeof(struct libusb_transfer *));
+		dev->xfer_ctx = malloc(dev->xfer_buf_num *
+				       sizeof(rtlsdr_xfer_ctx_t));
+		if (dev->sim)
+			dev->sim_q = malloc(dev->xfer_buf_num *
+					    sizeof(uint32_t));
+		if (!dev->xfer || !dev->xfer_ctx ||
+		    (dev->sim && !dev->sim_q)) {
+			free(dev->xfer);
+			free(dev->xfer_ctx);
+			free(dev->sim_q);
+			dev->xfer = NULL;
+			dev->xfer_ctx = NULL;
+			dev->sim_q = NULL;
+			return -ENOMEM;
+		}
+
+		for(i = 0; i < dev->xfer_buf_num; ++i)
+			dev->xfer[i] = libusb_alloc_transfer(0);
+
+		_rtlsdr_xfer_reset(dev);
+	}
+
+	if (dev->xfer_buf)
+		return -2;
+
+	dev->xfer_buf = malloc(dev->xfer_buf_cnt * sizeof(unsigned char *));
+	if (!dev->xfer_buf)
+		return -ENOMEM;
+	memset(dev->xfer_buf, 0, dev->xfer_buf_cnt * sizeof(unsigned char *));
+
+	dev->use_zerocopy = 0;
+
+#if defined(ENABLE_ZEROCOPY) && defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+	/* buffers of a simulated device aren't mapped from usbfs */
+	if (!dev->sim) {
+		fprintf(stderr, "Allocating %d zero-copy buffers\n",
+			dev->xfer_buf_cnt);
+		dev->use_zerocopy = 1;
+	}
+
+	for (i = 0; dev->use_zerocopy && i < dev->xfer_buf_cnt; ++i) {
+		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+
+		if (dev->xfer_buf[i]) {
+			/* Check if Kernel usbfs mmap() bug is present: if the
+			 * mapping is correct, the buffers point to memory that
+			 * was memset to 0 by the Kernel, otherwise, they point
+			 * to random memory. We check if the buffers are zeroed
+			 * and otherwise fall back to buffers in userspace.
+			 */
+			if (dev->xfer_buf[i][0] || memcmp(dev->xfer_buf[i],
+							  dev->xfer_buf[i] + 1,
+							  dev->xfer_buf_len - 1)) {
+				fprintf(stderr, "Detected Kernel usbfs mmap() "
+						"bug, falling back to buffers "
+						"in userspace\n");
+				dev->use_zerocopy = 0;
+				break;
+			}
+		} else {
+			fprintf(stderr, "Failed to allocate zero-copy "
+					"buffer for transfer %d\nFalling "
+					"back to buffers in userspace\n", i);
+			dev->use_zerocopy = 0;
+			break;
+		}
+	}
+
+	/* zero-copy buffer allocation failed (partially or completely)
+	 * we need to free the buffers again if already allocated */
+	if (!dev->use_zerocopy) {
+		for (i = 0; i < dev->xfer_buf_cnt; ++i) {
+			if (dev->xfer_buf[i])
+				libusb_dev_mem_free(dev->devh,
+						    dev->xfer_buf[i],
+						    dev->xfer_buf_len);
+			dev->xfer_buf[i] = NULL;
+		}
+	}
+#endif
+
+	if (!dev->use_zerocopy && dev->pool_enabled) {
+		if (!_rtlsdr_pool_alloc(dev))
+			return 0;
+
+		fprintf(stderr, "Failed to allocate buffer pool, falling "
+				"back to separate buffers\n");
+	}
+
+	/* no zero-copy available, allocate buffers in userspace */
+	if (!dev->use_zerocopy) {
+		for (i = 0; i < dev->xfer_buf_cnt; ++i) {
+			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+
+			if (!dev->xfer_buf[i])
+				return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return -1;
+
+	if (dev->xfer) {
+		for(i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer[i]) {
+				libusb_free_transfer(dev->xfer[i]);
+			}
+		}
+
+		free(dev->xfer);
+		dev->xfer = NULL;
+	}
+
+	if (dev->xfer_ctx) {
+		free(dev->xfer_ctx);
+		dev->xfer_ctx = NULL;
+	}
+
+	free(dev->sim_q);
+	dev->sim_q = NULL;
+
+	if (dev->xfer_buf) {
+		for (i = 0; i < dev->xfer_buf_cnt; ++i) {
+			if (dev->xfer_buf[i]) {
+				if (dev->use_zerocopy) {
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+					libusb_dev_mem_free(dev->devh,
+							    dev->xfer_buf[i],
+							    dev->xfer_buf_len);
+#endif
+				} else if (!dev->pool_mem) {
+					free(dev->xfer_buf[i]);
+				}
+			}
+		}
+
+		free(dev->xfer_buf);
+		dev->xfer_buf = NULL;
+	}
+
+	_rtlsdr_pool_free(dev);
+
+	_rtlsdr_free_ring(dev);
+
+	return 0;
+}
+
+/* number and length of the transfers requested for a stream */
+static void _rtlsdr_async_size(uint32_t buf_num, uint32_t buf_len,
+			       uint32_t *num, uint32_t *len)
+{
+	if (buf_num > 0)
+		*num = buf_num;
+	else
+		*num = DEFAULT_BUF_NUMBER;
+
+	if (buf_len > 0 && buf_len % 512 == 0) /* len must be multiple of 512 */
+		*len = buf_len;
+	else
+		*len = DEFAULT_BUF_LENGTH;
+}
+
+/* spare buffers of a ring stream, defaults to the number of transfers */
+static uint32_t _rtlsdr_ring_spare(uint32_t buf_num, uint32_t ring_len)
+{
+	if (ring_len > 0)
+		return ring_len;
+
+	return buf_num > 0 ? buf_num : DEFAULT_BUF_NUMBER;
+}
+
+/* get the buffers of a stream, reusing kept ones of the same setup */
+static int _rtlsdr_async_alloc(rtlsdr_dev_t *dev, uint32_t num, uint32_t len,
+			       uint32_t cnt)
+{
+	int r;
+
+	if (dev->xfer_keep && dev->xfer && dev->xfer_buf &&
+	    num == dev->xfer_buf_num && len == dev->xfer_buf_len &&
+	    cnt == dev->xfer_buf_cnt) {
+		_rtlsdr_free_ring(dev);
+		_rtlsdr_xfer_reset(dev);
+		return 0;
+	}
+
+	/* also releases buffers still kept from a previous ring stream */
+	_rtlsdr_free_async_buffers(dev);
+
+	dev->xfer_buf_num = num;
+	dev->xfer_buf_len = len;
+	dev->xfer_buf_cnt = cnt;
+
+	r = _rtlsdr_alloc_async_buffers(dev);
+	if (r < 0)
+		_rtlsdr_free_async_buffers(dev);
+
+	return r;
+}
+
+/* allocate and submit all transfers, leaves async_status RUNNING or CANCELING */
+static int _rtlsdr_async_start(rtlsdr_dev_t *dev, uint32_t buf_num,
+			       uint32_t buf_len, uint32_t spare)
+{
+	unsigned int i;
+	uint32_t num, len;
+	int r = 0;
+
+	dev->async_status = RTLSDR_RUNNING;
+	dev->async_cancel = 0;
+
+	dev->sample_count = 0;
+	dev->recover_state = RTLSDR_RECOVER_IDLE;
+	dev->recover_tries = 0;
+	dev->anchor_ns = 0;
+	dev->anchor_samples = 0;
+	dev->gap_pending = 0;
+	dev->sim_t0 = 0;
+
+	pthread_mutex_lock(&dev->tag_lock);
+	dev->tag_head = 0;
+	dev->tag_seen = 0;
+	dev->tag_last = 0;
+	pthread_mutex_unlock(&dev->tag_lock);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+
+	_rtlsdr_async_size(buf_num, buf_len, &num, &len);
+
+	dev->xfer_active = num;
+	dev->xfer_len = len;
+	dev->xfer_inflight = 0;
+
+	if (dev->adapt) {
+		/* start from the requested setup, but allocate for the
+		 * largest one the depth control may switch to */
+		if (dev->xfer_active < dev->adapt_min_num)
+			dev->xfer_active = dev->adapt_min_num;
+		if (dev->xfer_active > dev->adapt_max_num)
+			dev->xfer_active = dev->adapt_max_num;
+		if (dev->xfer_len < dev->adapt_min_len)
+			dev->xfer_len = dev->adapt_min_len;
+		if (dev->xfer_len > dev->adapt_max_len)
+			dev->xfer_len = dev->adapt_max_len;
+
+		num = dev->adapt_max_num;
+		len = dev->adapt_max_len;
+		dev->adapt_last_ns = 0;
+		dev->adapt_window_ns = 0;
+		dev->adapt_stall_ns = 0;
+		dev->adapt_calm = 0;
+	}
+
+	if (RTLSDR_ASYNC_RING != dev->async_mode &&
+	    (RTLSDR_OUTPUT_CU8 != dev->conv.format || dev->ddc)) {
+		r = _rtlsdr_conv_buf_reserve(dev, (size_t)len *
+					     rtlsdr_convert_size(&dev->conv));
+		if (!r && dev->ddc) {
+			r = _rtlsdr_ddc_reserve(dev, len);
+			rtlsdr_ddc_reset(dev->ddc);
+		}
+		if (r < 0) {
+			dev->async_status = RTLSDR_INACTIVE;
+			return r;
+		}
+	}
+
+	r = _rtlsdr_async_alloc(dev, num, len, num + spare);
+	if (!r && RTLSDR_ASYNC_RING == dev->async_mode)
+		r = _rtlsdr_alloc_ring(dev);
+
+	if (r < 0) {
+		_rtlsdr_free_async_buffers(dev);
+		dev->async_status = RTLSDR_INACTIVE;
+		return r;
+	}
+
+	for(i = 0; i < dev->xfer_buf_num; ++i) {
+		libusb_fill_bulk_transfer(dev->xfer[i],
+					  dev->devh,
+					  0x81,
+					  dev->xfer_buf[i],
+					  dev->xfer_len,
+					  _libusb_callback,
+					  (void *)&dev->xfer_ctx[i],
+					  BULK_TIMEOUT);
+
+		if (i >= dev->xfer_active) {
+			dev->xfer_ctx[i].parked = 1;
+			continue;
+		}
+
+		r = _rtlsdr_xfer_submit(dev, dev->xfer[i]);
+		if (r < 0) {
+			fprintf(stderr, "Failed to submit transfer %i\n"
+					"Please increase your allowed " 
+					"usbfs buffer size with the "
+					"following command:\n"
+					"echo 0 > /sys/module/usbcore"
+					"/parameters/usbfs_memory_mb\n", i);
+			dev->async_status = RTLSDR_CANCELING;
+			break;
+		}
+
+		dev->xfer_inflight++;
+	}
+
+	return r;
+}
+
+static int _rtlsdr_ctrl_exec(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_cmd cmd,
+			     uint32_t param)
+{
+	switch (cmd) {
+	case RTLSDR_CTRL_CENTER_FREQ:
+		return rtlsdr_set_center_freq(dev, param);
+	case RTLSDR_CTRL_SAMPLE_RATE:
+		return rtlsdr_set_sample_rate(dev, param);
+	case RTLSDR_CTRL_TUNER_GAIN_MODE:
+		return rtlsdr_set_tuner_gain_mode(dev, (int)param);
+	case RTLSDR_CTRL_TUNER_GAIN:
+		return rtlsdr_set_tuner_gain(dev, (int)param);
+	case RTLSDR_CTRL_FREQ_CORRECTION:
+		return rtlsdr_set_freq_correction(dev, (int)param);
+	case RTLSDR_CTRL_TUNER_IF_GAIN:
+		return rtlsdr_set_tuner_if_gain(dev, param >> 16,
+						(int16_t)(param & 0xffff));
+	case RTLSDR_CTRL_TESTMODE:
+		return rtlsdr_set_testmode(dev, (int)param);
+	case RTLSDR_CTRL_AGC_MODE:
+		return rtlsdr_set_agc_mode(dev, (int)param);
+	case RTLSDR_CTRL_DIRECT_SAMPLING:
+		return rtlsdr_set_direct_sampling(dev, (int)param);
+	case RTLSDR_CTRL_OFFSET_TUNING:
+		return rtlsdr_set_offset_tuning(dev, (int)param);
+	case RTLSDR_CTRL_RTL_XTAL:
+		return rtlsdr_set_xtal_freq(dev, param, 0);
+	case RTLSDR_CTRL_TUNER_XTAL:
+		return rtlsdr_set_xtal_freq(dev, 0, param);
+	case RTLSDR_CTRL_TUNER_GAIN_INDEX:
+		return rtlsdr_set_tuner_gain_index(dev, param);
+	case RTLSDR_CTRL_BIAS_TEE:
+		return rtlsdr_set_bias_tee(dev, (int)param);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* run the queued commands, called by the event loop between completions */
+static void _rtlsdr_ctrl_drain(rtlsdr_dev_t *dev)
+{
+	rtlsdr_ctrl_req_t req;
+	int r;
+
+	while (ATOMIC_LOAD(&dev->ctrl_head) != ATOMIC_LOAD(&dev->ctrl_tail)) {
+		pthread_mutex_lock(&dev->ctrl_lock);
+		req = dev->ctrl_q[dev->ctrl_tail % CTRL_QUEUE_LEN];
+		dev->ctrl_tail++;
+		pthread_mutex_unlock(&dev->ctrl_lock);
+
+		/* not within libusb event handling here, so the
+		 * command may wait for its control transfers */
+		dev->async_loop_active = 0;
+		r = _rtlsdr_ctrl_exec(dev, req.cmd, req.param);
+		dev->async_loop_active = 1;
+
+		if (req.cb)
+			req.cb(req.cmd, req.param, r, req.ctx);
+	}
+}
+
+/* reapply the settings of the device after it has been reattached */
+static void _rtlsdr_restore(rtlsdr_dev_t *dev)
+{
+	uint32_t rate = dev->rate;
+	uint32_t freq = dev->freq;
+	uint32_t tun_xtal = dev->tun_xtal;
+	int direct_sampling = dev->direct_sampling;
+	int offset_tuning = dev->offs_freq != 0;
+	int gain = dev->gain;
+	int i;
+
+	/* the tuner registers are back at their defaults */
+	memset(dev->i2c_valid, 0, sizeof(dev->i2c_valid));
+
+	_rtlsdr_init_device(dev);
+
+	rtlsdr_set_i2c_repeater(dev, 1);
+	_rtlsdr_init_tuner(dev);
+	rtlsdr_set_i2c_repeater(dev, 0);
+
+	dev->tun_xtal = tun_xtal;
+	rtlsdr_get_xtal_freq(dev, NULL, &dev->e4k_s.vco.fosc);
+	rtlsdr_get_xtal_freq(dev, NULL, &dev->r82xx_c.xtal);
+
+	dev->direct_sampling = 0;
+	dev->offs_freq = 0;
+	dev->freq = 0;
+
+	if (rate)
+		rtlsdr_set_sample_rate(dev, rate);
+	else
+		rtlsdr_set_sample_freq_correction(dev, dev->corr);
+
+	if (direct_sampling)
+		rtlsdr_set_direct_sampling(dev, direct_sampling);
+
+	if (offset_tuning)
+		rtlsdr_set_offset_tuning(dev, 1);
+
+	rtlsdr_set_tuner_gain_mode(dev, dev->gain_manual);
+	if (dev->gain_manual)
+		rtlsdr_set_tuner_gain(dev, gain);
+
+	if (dev->agc_on)
+		rtlsdr_set_agc_mode(dev, 1);
+
+	for (i = 0; i < 8; i++) {
+		if (dev->bias_gpio & (1 << i))
+			rtlsdr_set_bias_tee_gpio(dev, i, 1);
+	}
+
+	if (freq)
+		rtlsdr_set_center_freq(dev, freq);
+}
+
+int rtlsdr_set_trace(rtlsdr_dev_t *dev, const char *path)
+{
+	FILE *f = NULL;
+
+	if (!dev)
+		return -1;
+
+	if (path) {
+		f = fopen(path, "wb");
+		if (!f) {
+			fprintf(stderr, "Failed to open trace %s\n", path);
+			return -1;
+		}
+
+		if (fwrite(RTLSDR_TRACE_MAGIC, RTLSDR_TRACE_MAGIC_LEN, 1,
+			   f) != 1) {
+			fclose(f);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&dev->trace_lock);
+	if (dev->trace)
+		fclose(dev->trace);
+	dev->trace = f;
+	dev->trace_t0 = _rtlsdr_monotonic_ns();
+	dev->trace_depth = 0;
+	pthread_mutex_unlock(&dev->trace_lock);
+
+	if (f)
+		_rtlsdr_trace_info(dev);
+
+	return 0;
+}
+
+/* device answering its control transfers from a trace */
+static int _rtlsdr_open_mock(rtlsdr_dev_t **out_dev, const char *path)
+{
+	rtlsdr_trace_info_t *info;
+	rtlsdr_dev_t *dev;
+
+	dev = calloc(1, sizeof(rtlsdr_dev_t));
+	if (!dev)
+		return -ENOMEM;
+
+	dev->mock = malloc(sizeof(rtlsdr_mock_t));
+	if (!dev->mock) {
+		free(dev);
+		return -ENOMEM;
+	}
+
+	if (rtlsdr_mock_init(dev->mock, path) < 0) {
+		fprintf(stderr, "Failed to read trace %s\n", path);
+		free(dev->mock);
+		free(dev);
+		return -1;
+	}
+
+	info = &dev->mock->info;
+	if (info->tuner_type > RTLSDR_TUNER_R828D) {
+		fprintf(stderr, "Unknown tuner in trace %s\n", path);
+		rtlsdr_mock_free(dev->mock);
+		free(dev->mock);
+		free(dev);
+		return -1;
+	}
+
+	memcpy(dev->fir, fir_default, sizeof(fir_default));
+	rtlsdr_convert_init(&dev->conv, RTLSDR_OUTPUT_CU8, 0.0f, 0, 0);
+	rtlsdr_convert_init(&dev->ddc_conv, RTLSDR_OUTPUT_CF32, 1.0f, 0, 0);
+	pthread_mutex_init(&dev->ring.lock, NULL);
+	pthread_cond_init(&dev->ring.cond, NULL);
+	pthread_mutex_init(&dev->ctrl_lock, NULL);
+	pthread_mutex_init(&dev->tag_lock, NULL);
+	pthread_mutex_init(&dev->trace_lock, NULL);
+	dev->async_cpu = -1;
+	dev->pool_node = -1;
+
+	memcpy(dev->manufact, info->manufact, sizeof(dev->manufact));
+	memcpy(dev->product, info->product, sizeof(dev->product));
+	dev->rtl_xtal = info->rtl_xtal ? info->rtl_xtal : DEF_RTL_XTAL_FREQ;
+	dev->tun_xtal = info->tun_xtal ? info->tun_xtal : dev->rtl_xtal;
+	dev->tuner_type = (enum rtlsdr_tuner)info->tuner_type;
+	dev->tuner = &tuners[dev->tuner_type];
+
+	/* the state the trace was started from */
+	dev->corr = info->corr;
+	dev->rate = info->rate;
+	dev->freq = info->freq;
+	dev->direct_sampling = info->direct_sampling;
+	dev->offs_freq = info->offset_tuning;
+	dev->gain_manual = info->gain_manual;
+	dev->gain = info->gain;
+	dev->agc_on = info->agc_on;
+	dev->bias_gpio = info->bias_gpio;
+
+	_rtlsdr_restore(dev);
+
+	*out_dev = dev;
+
+	return 0;
+}
+
+int rtlsdr_replay_trace(const char *path, const char *out_path)
+{
+	rtlsdr_mock_call_t *call;
+	rtlsdr_dev_t *dev;
+	uint32_t i;
+	int r;
+
+	if (!path)
+		return -1;
+
+	r = _rtlsdr_open_mock(&dev, path);
+	if (r < 0)
+		return r;
+
+	if (out_path && rtlsdr_set_trace(dev, out_path) < 0) {
+		rtlsdr_close(dev);
+		return -1;
+	}
+
+	for (i = 0; i < dev->mock->calls_num; i++) {
+		call = &dev->mock->calls[i];
+
+		/* reads are answered from what the call got back then */
+		rtlsdr_mock_seek(dev->mock, i);
+		_rtlsdr_ctrl_exec(dev, (enum rtlsdr_ctrl_cmd)call->cmd,
+				  call->param);
+	}
+
+	r = (int)dev->mock->calls_num;
+	rtlsdr_close(dev);
+
+	return r;
+}
+
+/* open the device with our serial number again, returns 0 on success */
+static int _rtlsdr_reattach(rtlsdr_dev_t *dev)
+{
+	libusb_device **list;
+	libusb_device_handle *devh = NULL;
+	struct libusb_device_descriptor dd;
+	char serial[256];
+	ssize_t cnt;
+	int i, r;
+
+	cnt = libusb_get_device_list(dev->ctx, &list);
+	if (cnt < 0)
+		return (int)cnt;
+
+	for (i = 0; i < cnt; i++) {
+		libusb_get_device_descriptor(list[i], &dd);
+
+		if (!find_known_device(dd.idVendor, dd.idProduct))
+			continue;
+
+		if (libusb_open(list[i], &devh) < 0)
+			continue;
+
+		memset(serial, 0, sizeof(serial));
+		r = libusb_get_string_descriptor_ascii(devh, dd.iSerialNumber,
+						       (unsigned char *)serial,
+						       sizeof(serial) - 1);
+		if (r > 0 && !strcmp(serial, dev->serial))
+			break;
+
+		libusb_close(devh);
+		devh = NULL;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (!devh)
+		return -1;
+
+	libusb_close(dev->devh);
+	dev->devh = devh;
+
+	r = _rtlsdr_claim(dev);
+	if (r < 0)
+		return r;
+
+	_rtlsdr_restore(dev);
+
+	return 0;
+}
+
+/* reset the endpoint and resubmit the transfers of a recovered stream */
+static int _rtlsdr_recover_resume(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+	int r;
+
+	r = libusb_clear_halt(dev->devh, 0x81);
+	if (r < 0)
+		return r;
+
+	r = rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x1002, 2);
+	if (r >= 0)
+		r = rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x0000, 2);
+	if (r < 0)
+		return r;
+
+	dev->xfer_errors = 0;
+	dev->xfer_inflight = 0;
+
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		/* parked transfers are resubmitted later, the old handle
+		 * may be gone by then */
+		dev->xfer[i]->dev_handle = dev->devh;
+		if (dev->xfer_ctx[i].parked)
+			continue;
+
+		if (dev->adapt)
+			dev->xfer[i]->length = dev->xfer_len;
+
+		r = _rtlsdr_xfer_submit(dev, dev->xfer[i]);
+		if (r < 0)
+			return r;
+
+		dev->xfer_inflight++;
+	}
+
+	return 0;
+}
+
+/* advance a recovery, called by the event loop between completions */
+static void _rtlsdr_recover_poll(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+	uint64_t now;
+	int r;
+
+	if (!dev->recover_state)
+		return;
+
+	/* the stream is being stopped anyway */
+	if (RTLSDR_RUNNING != dev->async_status) {
+		dev->recover_state = RTLSDR_RECOVER_IDLE;
+		return;
+	}
+
+	if (RTLSDR_RECOVER_CANCEL == dev->recover_state) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer_ctx[i].busy)
+				_rtlsdr_xfer_cancel(dev, dev->xfer[i]);
+		}
+		dev->recover_state = RTLSDR_RECOVER_REAP;
+	}
+
+	if (RTLSDR_RECOVER_REAP == dev->recover_state) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer_ctx[i].busy)
+				return;
+		}
+
+		if (!dev->recover_lost) {
+			/* synchronous control transfers from here on */
+			dev->async_loop_active = 0;
+			r = _rtlsdr_recover_resume(dev);
+			dev->async_loop_active = 1;
+			if (!r)
+				goto done;
+
+			if (!(dev->recover_flags & RTLSDR_RECOVER_REATTACH))
+				goto fail;
+		}
+
+		fprintf(stderr, "Waiting for device %s to reappear...\n",
+			dev->serial);
+		now = _rtlsdr_monotonic_ns();
+		dev->recover_deadline_ns = dev->recover_timeout_ms ?
+			now + dev->recover_timeout_ms * 1000000ULL : 0;
+		dev->recover_next_ns = now;
+		dev->recover_arrived = 1; /* it may be back already */
+		dev->recover_state = RTLSDR_RECOVER_ATTACH;
+	}
+
+	now = _rtlsdr_monotonic_ns();
+
+	/* without hotplug events the bus is scanned periodically */
+	if ((!dev->hotplug_registered || dev->recover_arrived) &&
+	    now >= dev->recover_next_ns) {
+		dev->recover_arrived = 0;
+		dev->recover_next_ns = now + RECOVER_POLL_NS;
+
+		dev->async_loop_active = 0;
+		r = _rtlsdr_reattach(dev);
+		if (!r)
+			r = _rtlsdr_recover_resume(dev);
+		dev->async_loop_active = 1;
+		if (!r) {
+			ATOMIC_ADD64(&dev->stats.reattaches, 1);
+			goto done;
+		}
+	}
+
+	if (dev->recover_deadline_ns && now >= dev->recover_deadline_ns)
+		goto fail;
+
+	return;
+done:
+	fprintf(stderr, "Stream recovered\n");
+	ATOMIC_ADD64(&dev->stats.recoveries, 1);
+	dev->recover_state = RTLSDR_RECOVER_IDLE;
+	return;
+fail:
+	fprintf(stderr, "Stream recovery failed, canceling...\n");
+	dev->recover_state = RTLSDR_RECOVER_IDLE;
+	dev->dev_lost = 1;
+	rtlsdr_cancel_async(dev);
+}
+
+#if LIBUSB_API_VERSION >= 0x01000102
+static int LIBUSB_CALL _rtlsdr_hotplug_cb(libusb_context *ctx,
+					  libusb_device *device,
+					  libusb_hotplug_event event,
+					  void *user_data)
+{
+	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)user_data;
+	struct libusb_device_descriptor dd;
+
+	/* the serial number can't be read from here */
+	if (!libusb_get_device_descriptor(device, &dd) &&
+	    find_known_device(dd.idVendor, dd.idProduct))
+		dev->recover_arrived = 1;
+
+	return 0;
+}
+#endif
+
+static void _rtlsdr_hotplug_register(rtlsdr_dev_t *dev)
+{
+#if LIBUSB_API_VERSION >= 0x01000102
+	if (dev->hotplug_registered ||
+	    !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return;
+
+	if (!libusb_hotplug_register_callback(dev->ctx,
+					      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+					      LIBUSB_HOTPLUG_NO_FLAGS,
+					      LIBUSB_HOTPLUG_MATCH_ANY,
+					      LIBUSB_HOTPLUG_MATCH_ANY,
+					      LIBUSB_HOTPLUG_MATCH_ANY,
+					      _rtlsdr_hotplug_cb, dev,
+					      &dev->hotplug))
+		dev->hotplug_registered = 1;
+#endif
+}
+
+static void _rtlsdr_hotplug_deregister(rtlsdr_dev_t *dev)
+{
+#if LIBUSB_API_VERSION >= 0x01000102
+	if (dev->hotplug_registered)
+		libusb_hotplug_deregister_callback(dev->ctx, dev->hotplug);
+	dev->hotplug_registered = 0;
+#endif
+}
+
+int rtlsdr_set_recovery(rtlsdr_dev_t *dev, int flags, uint32_t timeout_ms)
+{
+	if (!dev)
+		return -1;
+
+	/* a simulated device doesn't fail */
+	if (dev->sim)
+		return 0;
+
+	if (RTLSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	if ((flags & RTLSDR_RECOVER_REATTACH) &&
+	    (rtlsdr_get_usb_strings(dev, NULL, NULL, dev->serial) < 0 ||
+	     !dev->serial[0]))
+		return -3;
+
+	dev->recover_flags = flags;
+	dev->recover_timeout_ms = timeout_ms;
+
+	if (flags & RTLSDR_RECOVER_REATTACH)
+		_rtlsdr_hotplug_register(dev);
+	else
+		_rtlsdr_hotplug_deregister(dev);
+
+	return 0;
+}
+
+/* prepare a stream for being serviced by the given event thread */
+static void _rtlsdr_async_enter(rtlsdr_dev_t *dev, pthread_t thread)
+{
+	dev->async_loop_thread = thread;
+	dev->async_loop_active = 1;
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+	dev->ctrl_accept = 1;
+	pthread_mutex_unlock(&dev->ctrl_lock);
+}
+
+/* cancel the outstanding transfers, returns 1 once the stream can end */
+static int _rtlsdr_async_reap(rtlsdr_dev_t *dev,
+			      enum rtlsdr_async_status *next_status)
+{
+	unsigned int i;
+	int r;
+	struct timeval zerotv = { 0, 0 };
+
+	*next_status = RTLSDR_INACTIVE;
+
+	if (!dev->xfer)
+		return 1;
+
+	for(i = 0; i < dev->xfer_buf_num; ++i) {
+		if (!dev->xfer[i])
+			continue;
+
+		if (LIBUSB_TRANSFER_CANCELLED !=
+				dev->xfer[i]->status) {
+			r = _rtlsdr_xfer_cancel(dev, dev->xfer[i]);
+			/* handle events after canceling
+			 * to allow transfer status to
+			 * propagate */
+#ifdef _WIN32
+			Sleep(1);
+#endif
+			_rtlsdr_handle_events(dev, &zerotv, NULL);
+			if (r < 0)
+				continue;
+
+			*next_status = RTLSDR_CANCELING;
+		}
+	}
+
+	if (dev->dev_lost || RTLSDR_INACTIVE == *next_status) {
+		/* handle any events that still need to
+		 * be handled before exiting after we
+		 * just cancelled all transfers */
+		_rtlsdr_handle_events(dev, &zerotv, NULL);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* wind down a stream after its transfers have been reaped */
+static void _rtlsdr_async_leave(rtlsdr_dev_t *dev,
+				enum rtlsdr_async_status next_status)
+{
+	if (RTLSDR_ASYNC_RING == dev->async_mode) {
+		/* keep the buffers, the consumer may still hold some of
+		 * them, but wake it up to notice the end of the stream */
+		pthread_mutex_lock(&dev->ring.lock);
+		dev->ring.active = 0;
+		pthread_cond_broadcast(&dev->ring.cond);
+		pthread_mutex_unlock(&dev->ring.lock);
+	} else if (!dev->xfer_keep) {
+		_rtlsdr_free_async_buffers(dev);
+	}
+
+	/* later commands are run by the submitting thread */
+	pthread_mutex_lock(&dev->ctrl_lock);
+	dev->ctrl_accept = 0;
+	pthread_mutex_unlock(&dev->ctrl_lock);
+	_rtlsdr_ctrl_drain(dev);
+
+	dev->async_status = next_status;
+	dev->async_loop_active = 0;
+}
+
+/* pump libusb events until all transfers have been cancelled */
+static int _rtlsdr_async_loop(rtlsdr_dev_t *dev)
+{
+	int r = 0;
+	struct timeval tv = { 1, 0 };
+	enum rtlsdr_async_status next_status = RTLSDR_INACTIVE;
+
+	_rtlsdr_async_enter(dev, pthread_self());
+
+	while (RTLSDR_INACTIVE != dev->async_status) {
+		r = _rtlsdr_handle_events(dev, &tv, &dev->async_cancel);
+		_rtlsdr_ctrl_drain(dev);
+		_rtlsdr_recover_poll(dev);
+		if (r < 0) {
+			/*fprintf(stderr, "handle_events returned: %d\n", r);*/
+			if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
+				continue;
+			break;
+		}
+
+		if (RTLSDR_CANCELING == dev->async_status &&
+		    _rtlsdr_async_reap(dev, &next_status))
+			break;
+	}
+
+	_rtlsdr_async_leave(dev, next_status);
+
+	return r;
+}
+
+/*
+ * Event thread of a shared context. Streams are handed over through the
+ * pending list and kept on a list private to this thread until they end.
+ */
+static void *_rtlsdr_loop_fn(void *arg)
+{
+	rtlsdr_loop_t *loop = (rtlsdr_loop_t *)arg;
+	rtlsdr_dev_t *active = NULL;
+	rtlsdr_dev_t *dev, **pp;
+	enum rtlsdr_async_status next_status;
+	struct timeval tv = { 1, 0 };
+	int r;
+
+	for (;;) {
+		pthread_mutex_lock(&loop->lock);
+		while ((dev = loop->pending)) {
+			loop->pending = dev->loop_next;
+			dev->loop_next = active;
+			active = dev;
+		}
+		if (loop->quit && !active) {
+			pthread_mutex_unlock(&loop->lock);
+			break;
+		}
+		pthread_mutex_unlock(&loop->lock);
+
+		r = libusb_handle_events_timeout_completed(loop->ctx, &tv, NULL);
+		if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
+			r = 0;
+
+		for (pp = &active; (dev = *pp); ) {
+			_rtlsdr_ctrl_drain(dev);
+			_rtlsdr_recover_poll(dev);
+
+			next_status = RTLSDR_INACTIVE;
+			if (r >= 0 && (RTLSDR_CANCELING != dev->async_status ||
+				       !_rtlsdr_async_reap(dev, &next_status))) {
+				pp = &dev->loop_next;
+				continue;
+			}
+
+			*pp = dev->loop_next;
+			_rtlsdr_async_leave(dev, next_status);
+
+			pthread_mutex_lock(&loop->lock);
+			dev->loop_attached = 0;
+			pthread_cond_broadcast(&loop->cond);
+			pthread_mutex_unlock(&loop->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* hand a started stream over to the event thread of its shared context */
+static void _rtlsdr_loop_attach(rtlsdr_dev_t *dev)
+{
+	rtlsdr_loop_t *loop = dev->loop;
+
+	_rtlsdr_async_enter(dev, loop->thread);
+
+	pthread_mutex_lock(&loop->lock);
+	dev->loop_attached = 1;
+	dev->loop_next = loop->pending;
+	loop->pending = dev;
+	pthread_mutex_unlock(&loop->lock);
+
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(loop->ctx);
+#endif
+}
+
+/* wait for the shared event thread to finish a stream */
+static void _rtlsdr_loop_wait(rtlsdr_dev_t *dev)
+{
+	rtlsdr_loop_t *loop = dev->loop;
+
+	pthread_mutex_lock(&loop->lock);
+	while (dev->loop_attached)
+		pthread_cond_wait(&loop->cond, &loop->lock);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+/* apply the requested CPU affinity and priority to the calling thread */
+static void _rtlsdr_async_thread_sched(rtlsdr_dev_t *dev)
+{
+#ifdef _WIN32
+	if (dev->async_cpu >= 0 &&
+	    !SetThreadAffinityMask(GetCurrentThread(),
+				   (DWORD_PTR)1 << dev->async_cpu))
+		fprintf(stderr, "Failed to bind event thread to CPU %d\n",
+			dev->async_cpu);
+
+	if (dev->async_rt_prio > 0 &&
+	    !SetThreadPriority(GetCurrentThread(),
+			       THREAD_PRIORITY_TIME_CRITICAL))
+		fprintf(stderr, "Failed to raise event thread priority\n");
+#else
+	struct sched_param param;
+
+#ifdef __linux__
+	cpu_set_t cpus;
+
+	if (dev->async_cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(dev->async_cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+			fprintf(stderr, "Failed to bind event thread to "
+					"CPU %d\n", dev->async_cpu);
+	}
+#endif
+
+	if (dev->async_rt_prio > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = dev->async_rt_prio;
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+			fprintf(stderr, "Failed to set real-time priority %d "
+					"for event thread\n",
+				dev->async_rt_prio);
+	}
+#endif
+}
+
+static void *_rtlsdr_async_thread_fn(void *arg)
+{
+	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)arg;
+
+	_rtlsdr_async_thread_sched(dev);
+	_rtlsdr_async_loop(dev);
+
+	return NULL;
+}
+
+/* hand the transfers submitted by _rtlsdr_async_start() to a new thread */
+static int _rtlsdr_async_spawn(rtlsdr_dev_t *dev, int start_result)
+{
+	int r;
+
+	if (dev->loop) {
+		_rtlsdr_loop_attach(dev);
+		if (start_result < 0) {
+			_rtlsdr_loop_wait(dev);
+			return start_result;
+		}
+		dev->async_thread_active = 1;
+		return 0;
+	}
+
+	if (start_result < 0) {
+		/* reap the transfers submitted so far */
+		_rtlsdr_async_loop(dev);
+		return start_result;
+	}
+
+	r = pthread_create(&dev->async_thread, NULL,
+			   _rtlsdr_async_thread_fn, (void *)dev);
+	if (r) {
+		rtlsdr_cancel_async(dev);
+		_rtlsdr_async_loop(dev);
+		return -r;
+	}
+
+	dev->async_thread_active = 1;
+
+	return 0;
+}
+
+int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
+			  uint32_t buf_num, uint32_t buf_len)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status || dev->async_thread_active)
+		return -2;
+
+	dev->async_mode = RTLSDR_ASYNC_CALLBACK;
+	dev->cb = cb;
+	dev->cb_ex = NULL;
+	dev->cb_ctx = ctx;
+
+	r = _rtlsdr_async_start(dev, buf_num, buf_len, 0);
+	if (RTLSDR_INACTIVE == dev->async_status)
+		return r;
+
+	if (dev->loop) {
+		_rtlsdr_loop_attach(dev);
+		_rtlsdr_loop_wait(dev);
+		return r;
+	}
+
+	return _rtlsdr_async_loop(dev);
+}
+
+int rtlsdr_read_async_ex(rtlsdr_dev_t *dev, rtlsdr_read_async_ex_cb_t cb,
+			 void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status || dev->async_thread_active)
+		return -2;
+
+	dev->async_mode = RTLSDR_ASYNC_CALLBACK;
+	dev->cb = NULL;
+	dev->cb_ex = cb;
+	dev->cb_ctx = ctx;
+
+	r = _rtlsdr_async_start(dev, buf_num, buf_len, 0);
+	if (RTLSDR_INACTIVE == dev->async_status)
+		return r;
+
+	if (dev->loop) {
+		_rtlsdr_loop_attach(dev);
+		_rtlsdr_loop_wait(dev);
+		return r;
+	}
+
+	return _rtlsdr_async_loop(dev);
+}
+
+int rtlsdr_start_stream(rtlsdr_dev_t *dev, uint32_t buf_num, uint32_t buf_len,
+			uint32_t ring_len)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status || dev->async_thread_active)
+		return -2;
+
+	dev->async_mode = RTLSDR_ASYNC_RING;
+	dev->cb = NULL;
+	dev->cb_ex = NULL;
+	dev->cb_ctx = NULL;
+
+	r = _rtlsdr_async_start(dev, buf_num, buf_len,
+				_rtlsdr_ring_spare(buf_num, ring_len));
+
+	return _rtlsdr_async_spawn(dev, r);
+}
+
+int rtlsdr_stop_stream(rtlsdr_dev_t *dev)
+{
+	return rtlsdr_stop_async(dev);
+}
+
+int rtlsdr_start_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
+		       uint32_t buf_num, uint32_t buf_len)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status || dev->async_thread_active)
+		return -2;
+
+	dev->async_mode = RTLSDR_ASYNC_CALLBACK;
+	dev->cb = cb;
+	dev->cb_ex = NULL;
+	dev->cb_ctx = ctx;
+
+	r = _rtlsdr_async_start(dev, buf_num, buf_len, 0);
+
+	return _rtlsdr_async_spawn(dev, r);
+}
+
+static int _rtlsdr_prepare(rtlsdr_dev_t *dev, uint32_t buf_num,
+			   uint32_t buf_len, uint32_t spare)
+{
+	uint32_t num, len;
+
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status || dev->async_thread_active)
+		return -2;
+
+	_rtlsdr_async_size(buf_num, buf_len, &num, &len);
+	if (dev->adapt) {
+		num = dev->adapt_max_num;
+		len = dev->adapt_max_len;
+	}
+
+	dev->xfer_keep = 1;
+
+	return _rtlsdr_async_alloc(dev, num, len, num + spare);
+}
+
+int rtlsdr_prepare_async(rtlsdr_dev_t *dev, uint32_t buf_num, uint32_t buf_len)
+{
+	return _rtlsdr_prepare(dev, buf_num, buf_len, 0);
+}
+
+int rtlsdr_prepare_stream(rtlsdr_dev_t *dev, uint32_t buf_num, uint32_t buf_len,
+			  uint32_t ring_len)
+{
+	return _rtlsdr_prepare(dev, buf_num, buf_len,
+			       _rtlsdr_ring_spare(buf_num, ring_len));
+}
+
+int rtlsdr_release_async(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status || dev->async_thread_active)
+		return -2;
+
+	dev->xfer_keep = 0;
+	_rtlsdr_free_async_buffers(dev);
+
+	return 0;
+}
+
+int rtlsdr_stop_async(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	if (!dev->async_thread_active)
+		return -2;
+
+	rtlsdr_cancel_async(dev);
+	if (dev->loop)
+		_rtlsdr_loop_wait(dev);
+	else
+		pthread_join(dev->async_thread, NULL);
+	dev->async_thread_active = 0;
+
+	return 0;
+}
+
+int rtlsdr_set_adaptive_buffers(rtlsdr_dev_t *dev,
+				uint32_t min_buf_num, uint32_t max_buf_num,
+				uint32_t min_buf_len, uint32_t max_buf_len)
+{
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	if (!max_buf_num) {
+		dev->adapt = 0;
+		return 0;
+	}
+
+	if (!min_buf_num || min_buf_num > max_buf_num ||
+	    !min_buf_len || min_buf_len > max_buf_len ||
+	    min_buf_len % 512 || max_buf_len % 512)
+		return -1;
+
+	dev->adapt_min_num = min_buf_num;
+	dev->adapt_max_num = max_buf_num;
+	dev->adapt_min_len = min_buf_len;
+	dev->adapt_max_len = max_buf_len;
+	dev->adapt = 1;
+
+	return 0;
+}
+
+int rtlsdr_set_buffer_pool(rtlsdr_dev_t *dev, int enable, uint32_t flags,
+			   int numa_node)
+{
+	if (!dev)
+		return -1;
+
+	if (RTLSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	dev->pool_enabled = enable;
+	dev->pool_flags = flags;
+	dev->pool_node = numa_node;
+
+	return 0;
+}
+
+int rtlsdr_get_buffer_config(rtlsdr_dev_t *dev, uint32_t *buf_num,
+			     uint32_t *buf_len)
+{
+	if (!dev)
+		return -1;
+
+	if (buf_num)
+		*buf_num = ATOMIC_LOAD(&dev->xfer_active);
+
+	if (buf_len)
+		*buf_len = ATOMIC_LOAD(&dev->xfer_len);
+
+	return 0;
+}
+
+int rtlsdr_set_async_thread_opts(rtlsdr_dev_t *dev, int cpu, int rt_priority)
+{
+	if (!dev)
+		return -1;
+
+	if (dev->async_thread_active)
+		return -2;
+
+	dev->async_cpu = cpu;
+	dev->async_rt_prio = rt_priority;
+
+	return 0;
+}
+
+int rtlsdr_stream_acquire(rtlsdr_dev_t *dev, unsigned char **buf,
+			  uint32_t *len, int timeout_ms)
+{
+	rtlsdr_ring_t *ring;
+	struct timespec ts;
+	uint32_t id;
+	int timedout = 0;
+	int r = 0;
+
+	if (!dev || !buf || RTLSDR_ASYNC_RING != dev->async_mode ||
+	    !dev->ring.fill.slot)
+		return -1;
+
+	ring = &dev->ring;
+
+	if (_rtlsdr_spsc_pop(&ring->fill, &id) < 0) {
+		if (timeout_ms > 0)
+			_rtlsdr_abstime(&ts, timeout_ms);
+
+		pthread_mutex_lock(&ring->lock);
+		ATOMIC_ADD(&ring->waiters, 1);
+
+		while (_rtlsdr_spsc_pop(&ring->fill, &id) < 0) {
+			if (!ring->active) {
+				r = -2;
+				break;
+			}
+
+			if (timedout || !timeout_ms) {
+				r = -ETIMEDOUT;
+				break;
+			}
+
+			if (timeout_ms < 0)
+				pthread_cond_wait(&ring->cond, &ring->lock);
+			else if (pthread_cond_timedwait(&ring->cond, &ring->lock,
+							&ts) == ETIMEDOUT)
+				timedout = 1;
+		}
+
+		ATOMIC_ADD(&ring->waiters, -1);
+		pthread_mutex_unlock(&ring->lock);
+
+		if (r < 0)
+			return r;
+	}
+
+	*buf = dev->xfer_buf[id];
+	if (len)
+		*len = ring->len[id];
+
+	return (int)id;
+}
+
+int rtlsdr_stream_get_info(rtlsdr_dev_t *dev, int id, rtlsdr_buf_info_t *info)
+{
+	if (!dev || !info || RTLSDR_ASYNC_RING != dev->async_mode ||
+	    !dev->ring.info)
+		return -1;
+
+	if (id < 0 || (uint32_t)id >= dev->xfer_buf_cnt)
+		return -1;
+
+	*info = dev->ring.info[id];
+
+	return 0;
+}
+
+int rtlsdr_stream_release(rtlsdr_dev_t *dev, int id)
+{
+	int r;
+
+	if (!dev || RTLSDR_ASYNC_RING != dev->async_mode ||
+	    !dev->ring.free.slot)
+		return -1;
 
-	libusb_exit(dev->ctx);
+	if (id < 0 || (uint32_t)id >= dev->xfer_buf_cnt)
+		return -1;
 
-	free(dev);
+	/* subscribers push to the free queue too, the lock keeps it
+	 * single producer */
+	pthread_mutex_lock(&dev->ring.lock);
+	r = _rtlsdr_spsc_push(&dev->ring.free, (uint32_t)id);
+	pthread_mutex_unlock(&dev->ring.lock);
 
-	return 0;
+	return r < 0 ? -2 : 0;
 }
 
-int rtlsdr_reset_buffer(rtlsdr_dev_t *dev)
+int rtlsdr_get_stream_overruns(rtlsdr_dev_t *dev, uint32_t *buffers,
+			       uint64_t *bytes)
 {
 	if (!dev)
 		return -1;
 
-	rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x1002, 2);
-	rtlsdr_write_reg(dev, USBB, USB_EPA_CTL, 0x0000, 2);
+	if (buffers)
+		*buffers = (uint32_t)ATOMIC_LOAD(&dev->ring.overruns);
+
+	if (bytes)
+		*bytes = (uint64_t)ATOMIC_LOAD64(&dev->ring.overrun_bytes);
 
 	return 0;
 }
 
-int rtlsdr_read_sync(rtlsdr_dev_t *dev, void *buf, int len, int *n_read)
+int rtlsdr_subscribe(rtlsdr_dev_t *dev, int policy, uint32_t queue_len)
 {
+	rtlsdr_ring_t *ring;
+	rtlsdr_sub_t *sub = NULL;
+	int i, r = -2;
+
 	if (!dev)
 		return -1;
 
-	return libusb_bulk_transfer(dev->devh, 0x81, buf, len, n_read, BULK_TIMEOUT);
-}
+	if (RTLSDR_SUB_BLOCK != policy && RTLSDR_SUB_DROP_OLDEST != policy)
+		return -1;
 
-static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
-{
-	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)xfer->user_data;
+	ring = &dev->ring;
+	pthread_mutex_lock(&ring->lock);
 
-	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
-		if (dev->cb)
-			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
+	for (i = 0; i < RING_MAX_SUBS; i++) {
+		if (!ring->subs[i].used) {
+			sub = &ring->subs[i];
+			break;
+		}
+	}
 
-		libusb_submit_transfer(xfer); /* resubmit transfer */
-		dev->xfer_errors = 0;
-	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
-#ifndef _WIN32
-		if (LIBUSB_TRANSFER_ERROR == xfer->status)
-			dev->xfer_errors++;
+	if (sub) {
+		memset(sub, 0, sizeof(*sub));
+		sub->policy = policy;
+		sub->queue_len = queue_len;
 
-		if (dev->xfer_errors >= dev->xfer_buf_num ||
-		    LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
-#endif
-			dev->dev_lost = 1;
-			rtlsdr_cancel_async(dev);
-			fprintf(stderr, "cb transfer status: %d, "
-				"canceling...\n", xfer->status);
-#ifndef _WIN32
+		/* join a running stream with its next buffer */
+		r = 0;
+		if (ring->ref)
+			r = _rtlsdr_sub_alloc(ring, sub, dev->xfer_buf_cnt);
+
+		if (!r) {
+			sub->used = 1;
+			ATOMIC_ADD(&ring->nsubs, 1);
+			r = i;
 		}
-#endif
 	}
-}
 
-int rtlsdr_wait_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx)
-{
-	return rtlsdr_read_async(dev, cb, ctx, 0, 0);
+	pthread_mutex_unlock(&ring->lock);
+
+	return r;
 }
 
-static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
+int rtlsdr_unsubscribe(rtlsdr_dev_t *dev, int id)
 {
-	unsigned int i;
+	rtlsdr_ring_t *ring;
+	rtlsdr_sub_t *sub;
 
-	if (!dev)
+	if (!dev || id < 0 || id >= RING_MAX_SUBS)
 		return -1;
 
-	if (!dev->xfer) {
-		dev->xfer = malloc(dev->xfer_buf_num *
-				   sizeof(struct libusb_transfer *));
+	ring = &dev->ring;
+	sub = &ring->subs[id];
 
-		for(i = 0; i < dev->xfer_buf_num; ++i)
-			dev->xfer[i] = libusb_alloc_transfer(0);
+	pthread_mutex_lock(&ring->lock);
+
+	if (!sub->used) {
+		pthread_mutex_unlock(&ring->lock);
+		return -1;
 	}
 
-	if (dev->xfer_buf)
-		return -2;
+	/* hand back what the subscriber didn't fetch yet */
+	if (sub->slot) {
+		while (!_rtlsdr_sub_drop(ring, sub))
+			;
+	}
 
-	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
-	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+	free(sub->slot);
+	sub->slot = NULL;
+	sub->used = 0;
+	ATOMIC_ADD(&ring->nsubs, -1);
+	pthread_cond_broadcast(&ring->cond);
 
-#if defined(ENABLE_ZEROCOPY) && defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
+	pthread_mutex_unlock(&ring->lock);
 
-	dev->use_zerocopy = 1;
-	for (i = 0; i < dev->xfer_buf_num; ++i) {
-		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+	return 0;
+}
 
-		if (dev->xfer_buf[i]) {
-			/* Check if Kernel usbfs mmap() bug is present: if the
-			 * mapping is correct, the buffers point to memory that
-			 * was memset to 0 by the Kernel, otherwise, they point
-			 * to random memory. We check if the buffers are zeroed
-			 * and otherwise fall back to buffers in userspace.
-			 */
-			if (dev->xfer_buf[i][0] || memcmp(dev->xfer_buf[i],
-							  dev->xfer_buf[i] + 1,
-							  dev->xfer_buf_len - 1)) {
-				fprintf(stderr, "Detected Kernel usbfs mmap() "
-						"bug, falling back to buffers "
-						"in userspace\n");
-				dev->use_zerocopy = 0;
-				break;
-			}
-		} else {
-			fprintf(stderr, "Failed to allocate zero-copy "
-					"buffer for transfer %d\nFalling "
-					"back to buffers in userspace\n", i);
-			dev->use_zerocopy = 0;
+int rtlsdr_sub_acquire(rtlsdr_dev_t *dev, int id, unsigned char **buf,
+		       uint32_t *len, int timeout_ms)
+{
+	rtlsdr_ring_t *ring;
+	rtlsdr_sub_t *sub;
+	struct timespec ts;
+	uint32_t n;
+	int timedout = 0;
+	int r = 0;
+
+	if (!dev || !buf || id < 0 || id >= RING_MAX_SUBS)
+		return -1;
+
+	ring = &dev->ring;
+	sub = &ring->subs[id];
+
+	if (timeout_ms > 0)
+		_rtlsdr_abstime(&ts, timeout_ms);
+
+	pthread_mutex_lock(&ring->lock);
+
+	while (sub->used && (!sub->slot || sub->head == sub->tail)) {
+		if (!ring->active || !ring->ref) {
+			r = -2;
 			break;
 		}
-	}
 
-	/* zero-copy buffer allocation failed (partially or completely)
-	 * we need to free the buffers again if already allocated */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i])
-				libusb_dev_mem_free(dev->devh,
-						    dev->xfer_buf[i],
-						    dev->xfer_buf_len);
+		if (timedout || !timeout_ms) {
+			r = -ETIMEDOUT;
+			break;
 		}
+
+		if (timeout_ms < 0)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		else if (pthread_cond_timedwait(&ring->cond, &ring->lock,
+						&ts) == ETIMEDOUT)
+			timedout = 1;
 	}
-#endif
 
-	/* no zero-copy available, allocate buffers in userspace */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+	if (!sub->used)
+		r = -1;
 
-			if (!dev->xfer_buf[i])
-				return -ENOMEM;
-		}
+	if (!r) {
+		n = sub->slot[sub->tail++ % sub->size];
+		*buf = dev->xfer_buf[n];
+		if (len)
+			*len = ring->len[n];
+		r = (int)n;
 	}
 
-	return 0;
+	pthread_mutex_unlock(&ring->lock);
+
+	return r;
 }
 
-static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev)
+int rtlsdr_sub_release(rtlsdr_dev_t *dev, int id, int buf_id)
 {
-	unsigned int i;
+	rtlsdr_ring_t *ring;
 
-	if (!dev)
+	if (!dev || id < 0 || id >= RING_MAX_SUBS)
 		return -1;
 
-	if (dev->xfer) {
-		for(i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer[i]) {
-				libusb_free_transfer(dev->xfer[i]);
-			}
-		}
+	ring = &dev->ring;
 
-		free(dev->xfer);
-		dev->xfer = NULL;
+	pthread_mutex_lock(&ring->lock);
+
+	if (!ring->ref || buf_id < 0 || (uint32_t)buf_id >= dev->xfer_buf_cnt ||
+	    !ring->ref[buf_id]) {
+		pthread_mutex_unlock(&ring->lock);
+		return -1;
 	}
 
-	if (dev->xfer_buf) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i]) {
-				if (dev->use_zerocopy) {
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-					libusb_dev_mem_free(dev->devh,
-							    dev->xfer_buf[i],
-							    dev->xfer_buf_len);
-#endif
-				} else {
-					free(dev->xfer_buf[i]);
-				}
-			}
-		}
+	_rtlsdr_sub_unref(ring, (uint32_t)buf_id);
 
-		free(dev->xfer_buf);
-		dev->xfer_buf = NULL;
-	}
+	pthread_mutex_unlock(&ring->lock);
 
 	return 0;
 }
 
-int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
-			  uint32_t buf_num, uint32_t buf_len)
+int rtlsdr_sub_get_drops(rtlsdr_dev_t *dev, int id, uint64_t *buffers)
 {
-	unsigned int i;
-	int r = 0;
-	struct timeval tv = { 1, 0 };
-	struct timeval zerotv = { 0, 0 };
-	enum rtlsdr_async_status next_status = RTLSDR_INACTIVE;
+	rtlsdr_ring_t *ring;
 
-	if (!dev)
+	if (!dev || !buffers || id < 0 || id >= RING_MAX_SUBS)
 		return -1;
 
-	if (RTLSDR_INACTIVE != dev->async_status)
-		return -2;
+	ring = &dev->ring;
 
-	dev->async_status = RTLSDR_RUNNING;
-	dev->async_cancel = 0;
+	pthread_mutex_lock(&ring->lock);
+	*buffers = ring->subs[id].drops;
+	pthread_mutex_unlock(&ring->lock);
 
-	dev->cb = cb;
-	dev->cb_ctx = ctx;
+	return 0;
+}
 
-	if (buf_num > 0)
-		dev->xfer_buf_num = buf_num;
-	else
-		dev->xfer_buf_num = DEFAULT_BUF_NUMBER;
+/* upper bound in us of the histogram bin holding the given permille */
+static uint32_t _rtlsdr_hist_percentile(const uint64_t *hist, uint64_t total,
+					unsigned int permille)
+{
+	uint64_t rank = (total * permille + 999) / 1000;
+	uint64_t cum = 0;
+	unsigned int bin;
 
-	if (buf_len > 0 && buf_len % 512 == 0) /* len must be multiple of 512 */
-		dev->xfer_buf_len = buf_len;
-	else
-		dev->xfer_buf_len = DEFAULT_BUF_LENGTH;
+	if (!total)
+		return 0;
 
-	_rtlsdr_alloc_async_buffers(dev);
+	for (bin = 0; bin < RTLSDR_STATS_HIST_BINS - 1; bin++) {
+		cum += hist[bin];
+		if (cum >= rank)
+			break;
+	}
 
-	for(i = 0; i < dev->xfer_buf_num; ++i) {
-		libusb_fill_bulk_transfer(dev->xfer[i],
-					  dev->devh,
-					  0x81,
-					  dev->xfer_buf[i],
-					  dev->xfer_buf_len,
-					  _libusb_callback,
-					  (void *)dev,
-					  BULK_TIMEOUT);
+	return bin ? (1U << (bin - 1)) * 2 - 1 : 0;
+}
 
-		r = libusb_submit_transfer(dev->xfer[i]);
-		if (r < 0) {
-			fprintf(stderr, "Failed to submit transfer %i\n"
-					"Please increase your allowed " 
-					"usbfs buffer size with the "
-					"following command:\n"
-					"echo 0 > /sys/module/usbcore"
-					"/parameters/usbfs_memory_mb\n", i);
-			dev->async_status = RTLSDR_CANCELING;
-			break;
-		}
+int rtlsdr_get_tags(rtlsdr_dev_t *dev, uint64_t start, uint64_t end,
+		    rtlsdr_tag_t *tags, int max)
+{
+	uint32_t i;
+	int n = 0;
+
+	if (!dev || !tags || max <= 0)
+		return -1;
+
+	pthread_mutex_lock(&dev->tag_lock);
+
+	i = (dev->tag_head > TAG_RING_LEN) ? dev->tag_head - TAG_RING_LEN : 0;
+	for (; i != dev->tag_head && n < max; i++) {
+		if (dev->tags[i % TAG_RING_LEN].sample_index >= start &&
+		    dev->tags[i % TAG_RING_LEN].sample_index < end)
+			tags[n++] = dev->tags[i % TAG_RING_LEN];
 	}
 
-	while (RTLSDR_INACTIVE != dev->async_status) {
-		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
-							   &dev->async_cancel);
-		if (r < 0) {
-			/*fprintf(stderr, "handle_events returned: %d\n", r);*/
-			if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
-				continue;
-			break;
-		}
+	pthread_mutex_unlock(&dev->tag_lock);
 
-		if (RTLSDR_CANCELING == dev->async_status) {
-			next_status = RTLSDR_INACTIVE;
+	return n;
+}
 
-			if (!dev->xfer)
-				break;
+int rtlsdr_get_stream_stats(rtlsdr_dev_t *dev, rtlsdr_stream_stats_t *stats)
+{
+	rtlsdr_stream_stats_t *st;
+	uint64_t total = 0;
+	unsigned int i;
 
-			for(i = 0; i < dev->xfer_buf_num; ++i) {
-				if (!dev->xfer[i])
-					continue;
+	if (!dev || !stats)
+		return -1;
 
-				if (LIBUSB_TRANSFER_CANCELLED !=
-						dev->xfer[i]->status) {
-					r = libusb_cancel_transfer(dev->xfer[i]);
-					/* handle events after canceling
-					 * to allow transfer status to
-					 * propagate */
-#ifdef _WIN32
-					Sleep(1);
-#endif
-					libusb_handle_events_timeout_completed(dev->ctx,
-									       &zerotv, NULL);
-					if (r < 0)
-						continue;
+	st = &dev->stats;
+	stats->transfers = ATOMIC_LOAD64(&st->transfers);
+	stats->bytes = ATOMIC_LOAD64(&st->bytes);
+	stats->errors = ATOMIC_LOAD64(&st->errors);
+	stats->err_io = ATOMIC_LOAD64(&st->err_io);
+	stats->err_timeout = ATOMIC_LOAD64(&st->err_timeout);
+	stats->err_stall = ATOMIC_LOAD64(&st->err_stall);
+	stats->err_no_device = ATOMIC_LOAD64(&st->err_no_device);
+	stats->err_overflow = ATOMIC_LOAD64(&st->err_overflow);
+	stats->gaps = ATOMIC_LOAD64(&st->gaps);
+	stats->dropped_samples = ATOMIC_LOAD64(&st->dropped_samples);
+	stats->recoveries = ATOMIC_LOAD64(&st->recoveries);
+	stats->reattaches = ATOMIC_LOAD64(&st->reattaches);
+	stats->cb_max_us = ATOMIC_LOAD(&st->cb_max_us);
+
+	for (i = 0; i < RTLSDR_STATS_HIST_BINS; i++) {
+		stats->cb_hist[i] = ATOMIC_LOAD64(&st->cb_hist[i]);
+		total += stats->cb_hist[i];
+	}
 
-					next_status = RTLSDR_CANCELING;
-				}
-			}
+	stats->cb_p50_us = _rtlsdr_hist_percentile(stats->cb_hist, total, 500);
+	stats->cb_p90_us = _rtlsdr_hist_percentile(stats->cb_hist, total, 900);
+	stats->cb_p99_us = _rtlsdr_hist_percentile(stats->cb_hist, total, 990);
+	stats->cb_p999_us = _rtlsdr_hist_percentile(stats->cb_hist, total,
+						    999);
 
-			if (dev->dev_lost || RTLSDR_INACTIVE == next_status) {
-				/* handle any events that still need to
-				 * be handled before exiting after we
-				 * just cancelled all transfers */
-				libusb_handle_events_timeout_completed(dev->ctx,
-								       &zerotv, NULL);
-				break;
-			}
+	return 0;
+}
+
+int rtlsdr_submit_ctrl(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_cmd cmd,
+		       uint32_t param, rtlsdr_ctrl_cb_t cb, void *ctx)
+{
+	rtlsdr_ctrl_req_t *req;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+
+	if (dev->ctrl_accept) {
+		if (dev->ctrl_head - dev->ctrl_tail >= CTRL_QUEUE_LEN) {
+			pthread_mutex_unlock(&dev->ctrl_lock);
+			return -EBUSY;
 		}
+
+		req = &dev->ctrl_q[dev->ctrl_head % CTRL_QUEUE_LEN];
+		req->cmd = cmd;
+		req->param = param;
+		req->cb = cb;
+		req->ctx = ctx;
+		ATOMIC_ADD(&dev->ctrl_head, 1);
+		pthread_mutex_unlock(&dev->ctrl_lock);
+
+#if LIBUSB_API_VERSION >= 0x01000105
+		/* wake up the event loop */
+		if (!dev->sim)
+			libusb_interrupt_event_handler(dev->ctx);
+#endif
+		return 0;
 	}
 
-	_rtlsdr_free_async_buffers(dev);
+	pthread_mutex_unlock(&dev->ctrl_lock);
 
-	dev->async_status = next_status;
+	r = _rtlsdr_ctrl_exec(dev, cmd, param);
+	if (cb)
+		cb(cmd, param, r, ctx);
 
-	return r;
+	return 0;
 }
 
 int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
@@ -1985,6 +6479,11 @@ int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
 	if (RTLSDR_RUNNING == dev->async_status) {
 		dev->async_status = RTLSDR_CANCELING;
 		dev->async_cancel = 1;
+#if LIBUSB_API_VERSION >= 0x01000105
+		/* a shared event thread doesn't watch async_cancel */
+		if (dev->loop)
+			libusb_interrupt_event_handler(dev->ctx);
+#endif
 		return 0;
 	}
 
@@ -2014,18 +6513,70 @@ uint32_t rtlsdr_get_tuner_clock(void *dev)
 
 int rtlsdr_i2c_write_fn(void *dev, uint8_t addr, uint8_t *buf, int len)
 {
-	if (dev)
-		return rtlsdr_i2c_write(((rtlsdr_dev_t *)dev), addr, buf, len);
+	rtlsdr_dev_t *devt = (rtlsdr_dev_t *)dev;
+	rtlsdr_hop_t *h;
+	uint8_t reg;
+	int i, r;
+
+	if (!dev)
+		return -1;
+
+	/* register writes of a hop table capture only go to the entry,
+	 * pointer writes for reads still reach the tuner */
+	h = devt->hop_cap;
+	if (h && len >= 2) {
+		if (h->seq_n + len - 1 > HOP_SEQ_MAX)
+			return -1;
+		for (i = 1; i < len; i++) {
+			reg = buf[0] + i - 1;
+			h->val[reg] = buf[i];
+			h->mask[reg >> 3] |= 1 << (reg & 7);
+			h->seq[h->seq_n][0] = reg;
+			h->seq[h->seq_n][1] = buf[i];
+			h->seq_n++;
+		}
+		return len;
+	}
+	if (len == 1)
+		devt->hop_ptr = buf[0];
+
+	r = rtlsdr_i2c_write(devt, addr, buf, len);
+
+	for (i = 1; i < len; i++) {
+		reg = buf[0] + i - 1;
+		devt->i2c_img[reg] = buf[i];
+		if (r == len)
+			devt->i2c_valid[reg >> 3] |= 1 << (reg & 7);
+		else
+			devt->i2c_valid[reg >> 3] &= ~(1 << (reg & 7));
+	}
 
-	return -1;
+	return r;
 }
 
 int rtlsdr_i2c_read_fn(void *dev, uint8_t addr, uint8_t *buf, int len)
 {
-	if (dev)
-		return rtlsdr_i2c_read(((rtlsdr_dev_t *)dev), addr, buf, len);
+	rtlsdr_dev_t *devt = (rtlsdr_dev_t *)dev;
+	rtlsdr_hop_t *h;
+	uint8_t reg;
+	int i, r;
 
-	return -1;
+	if (!dev)
+		return -1;
+
+	r = rtlsdr_i2c_read(devt, addr, buf, len);
+
+	/* let the tuner driver see what it wrote during a capture */
+	h = devt->hop_cap;
+	if (h && r == len) {
+		for (i = 0; i < len; i++) {
+			reg = devt->hop_ptr + i;
+			if (h->mask[reg >> 3] & (1 << (reg & 7)))
+				buf[i] = h->val[reg];
+		}
+	}
+
+	return r;
 }
 
 int rtlsdr_set_bias_tee_gpio(rtlsdr_dev_t *dev, int gpio, int on)
@@ -2036,10 +6587,23 @@ int rtlsdr_set_bias_tee_gpio(rtlsdr_dev_t *dev, int gpio, int on)
 	rtlsdr_set_gpio_output(dev, gpio);
 	rtlsdr_set_gpio_bit(dev, gpio, on);
 
+	if (on)
+		dev->bias_gpio |= 1 << gpio;
+	else
+		dev->bias_gpio &= ~(1 << gpio);
+
 	return 0;
 }
 
 int rtlsdr_set_bias_tee(rtlsdr_dev_t *dev, int on)
 {
-	return rtlsdr_set_bias_tee_gpio(dev, 0, on);
+	int r;
+
+	if (!dev)
+		return -1;
+
+	_rtlsdr_trace_enter(dev, RTLSDR_CTRL_BIAS_TEE, (uint32_t)on);
+	r = rtlsdr_set_bias_tee_gpio(dev, 0, on);
+
+	return _rtlsdr_trace_leave(dev, r);
 }
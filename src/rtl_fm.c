@@ -95,7 +95,6 @@ static int atan_lut_coef = 8;
 struct dongle_state
 {
 	int      exit_flag;
-	pthread_t thread;
 	rtlsdr_dev_t *dev;
 	int      dev_index;
 	uint32_t freq;
@@ -806,13 +805,6 @@ static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 	safe_cond_signal(&d->ready, &d->ready_m);
 }
 
-static void *dongle_thread_fn(void *arg)
-{
-	struct dongle_state *s = arg;
-	rtlsdr_read_async(s->dev, rtlsdr_callback, s, 0, s->buf_len);
-	return 0;
-}
-
 static void *demod_thread_fn(void *arg)
 {
 	struct demod_state *d = arg;
@@ -1255,7 +1247,11 @@ int main(int argc, char **argv)
 	usleep(100000);
 	pthread_create(&output.thread, NULL, output_thread_fn, (void *)(&output));
 	pthread_create(&demod.thread, NULL, demod_thread_fn, (void *)(&demod));
-	pthread_create(&dongle.thread, NULL, dongle_thread_fn, (void *)(&dongle));
+	r = rtlsdr_start_async(dongle.dev, rtlsdr_callback, (void *)(&dongle), 0, dongle.buf_len);
+	if (r < 0) {
+		fprintf(stderr, "Failed to start streaming.\n");
+		do_exit = 1;
+	}
 
 	while (!do_exit) {
 		usleep(100000);
@@ -1266,8 +1262,7 @@ int main(int argc, char **argv)
 	else {
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);}
 
-	rtlsdr_cancel_async(dongle.dev);
-	pthread_join(dongle.thread, NULL);
+	rtlsdr_stop_async(dongle.dev);
 	safe_cond_signal(&demod.ready, &demod.ready_m);
 	pthread_join(demod.thread, NULL);
 	safe_cond_signal(&output.ready, &output.ready_m);
@@ -48,6 +48,7 @@
 #pragma comment(lib, "ws2_32.lib")
 
 typedef int socklen_t;
+#define usleep(x) Sleep(x/1000)
 
 #else
 #define closesocket close
@@ -59,6 +60,7 @@ typedef int socklen_t;
 #define DEFAULT_PORT_STR "1234"
 #define DEFAULT_SAMPLE_RATE_HZ 2048000
 #define DEFAULT_MAX_NUM_BUFFERS 500
+#define CTRL_SUBMIT_TIMEOUT_MS 1000
 
 static SOCKET s;
 
@@ -256,24 +258,6 @@ static void *tcp_worker(void *arg)
 	}
 }
 
-static int set_gain_by_index(rtlsdr_dev_t *_dev, unsigned int index)
-{
-	int res = 0;
-	int* gains;
-	int count = rtlsdr_get_tuner_gains(_dev, NULL);
-
-	if (count > 0 && (unsigned int)count > index) {
-		gains = malloc(sizeof(int) * count);
-		count = rtlsdr_get_tuner_gains(_dev, gains);
-
-		res = rtlsdr_set_tuner_gain(_dev, gains[index]);
-
-		free(gains);
-	}
-
-	return res;
-}
-
 #ifdef _WIN32
 #define __attribute__(x)
 #pragma pack(push, 1)
@@ -285,6 +269,34 @@ struct command{
 #ifdef _WIN32
 #pragma pack(pop)
 #endif
+static void command_done(enum rtlsdr_ctrl_cmd cmd, uint32_t param,
+			 int result, void *ctx)
+{
+	if (result < 0)
+		fprintf(stderr, "command 0x%02x (%u) failed: %d\n",
+			cmd, param, result);
+}
+
+/* the queue is drained between transfers, so a full queue only has to be
+ * waited for instead of dropping the command of the client */
+static int submit_command(uint8_t cmd, uint32_t param)
+{
+	int i, r = -EBUSY;
+
+	for (i = 0; i < CTRL_SUBMIT_TIMEOUT_MS && !do_exit; i++) {
+		r = rtlsdr_submit_ctrl(dev, cmd, param, command_done, NULL);
+		if (r != -EBUSY)
+			break;
+		usleep(1000);
+	}
+
+	if (r < 0)
+		fprintf(stderr, "command 0x%02x (%u) dropped: %d\n",
+			cmd, param, r);
+
+	return r;
+}
+
 static void *command_worker(void *arg)
 {
 	int left, received = 0;
@@ -315,64 +327,54 @@ static void *command_worker(void *arg)
 		switch(cmd.cmd) {
 		case 0x01:
 			printf("set freq %d\n", ntohl(cmd.param));
-			rtlsdr_set_center_freq(dev,ntohl(cmd.param));
 			break;
 		case 0x02:
 			printf("set sample rate %d\n", ntohl(cmd.param));
-			rtlsdr_set_sample_rate(dev, ntohl(cmd.param));
 			break;
 		case 0x03:
 			printf("set gain mode %d\n", ntohl(cmd.param));
-			rtlsdr_set_tuner_gain_mode(dev, ntohl(cmd.param));
 			break;
 		case 0x04:
 			printf("set gain %d\n", ntohl(cmd.param));
-			rtlsdr_set_tuner_gain(dev, ntohl(cmd.param));
 			break;
 		case 0x05:
 			printf("set freq correction %d\n", ntohl(cmd.param));
-			rtlsdr_set_freq_correction(dev, ntohl(cmd.param));
 			break;
 		case 0x06:
 			tmp = ntohl(cmd.param);
 			printf("set if stage %d gain %d\n", tmp >> 16, (short)(tmp & 0xffff));
-			rtlsdr_set_tuner_if_gain(dev, tmp >> 16, (short)(tmp & 0xffff));
 			break;
 		case 0x07:
 			printf("set test mode %d\n", ntohl(cmd.param));
-			rtlsdr_set_testmode(dev, ntohl(cmd.param));
 			break;
 		case 0x08:
 			printf("set agc mode %d\n", ntohl(cmd.param));
-			rtlsdr_set_agc_mode(dev, ntohl(cmd.param));
 			break;
 		case 0x09:
 			printf("set direct sampling %d\n", ntohl(cmd.param));
-			rtlsdr_set_direct_sampling(dev, ntohl(cmd.param));
 			break;
 		case 0x0a:
 			printf("set offset tuning %d\n", ntohl(cmd.param));
-			rtlsdr_set_offset_tuning(dev, ntohl(cmd.param));
 			break;
 		case 0x0b:
 			printf("set rtl xtal %d\n", ntohl(cmd.param));
-			rtlsdr_set_xtal_freq(dev, ntohl(cmd.param), 0);
 			break;
 		case 0x0c:
 			printf("set tuner xtal %d\n", ntohl(cmd.param));
-			rtlsdr_set_xtal_freq(dev, 0, ntohl(cmd.param));
 			break;
 		case 0x0d:
 			printf("set tuner gain by index %d\n", ntohl(cmd.param));
-			set_gain_by_index(dev, ntohl(cmd.param));
 			break;
 		case 0x0e:
 			printf("set bias tee %d\n", ntohl(cmd.param));
-			rtlsdr_set_bias_tee(dev, (int)ntohl(cmd.param));
 			break;
 		default:
 			break;
 		}
+		/* the command numbers match the library ones, let the
+		 * streaming thread apply them between transfers */
+		if (cmd.cmd >= RTLSDR_CTRL_CENTER_FREQ && cmd.cmd <= RTLSDR_CTRL_BIAS_TEE)
+			submit_command(cmd.cmd, ntohl(cmd.param));
 		cmd.cmd = 0xff;
 	}
 }
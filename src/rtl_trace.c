@@ -0,0 +1,246 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * rtl_trace, tool to analyse and replay control transfer traces
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <windows.h>
+#include "getopt/getopt.h"
+#endif
+
+#include "rtl-sdr.h"
+#include "rtlsdr_trace.h"
+
+#define CMD_NUM		(RTLSDR_CTRL_BIAS_TEE + 1)
+#define BLOCK_IICB	6
+
+/* index 0 collects the transfers outside of the marked calls */
+static const char *cmd_names[CMD_NUM] = {
+	"(other)", "center_freq", "sample_rate", "tuner_gain_mode",
+	"tuner_gain", "freq_correction", "tuner_if_gain", "testmode",
+	"agc_mode", "direct_sampling", "offset_tuning", "rtl_xtal",
+	"tuner_xtal", "tuner_gain_index", "bias_tee"
+};
+
+struct cmd_stats {
+	uint32_t calls;
+	uint32_t xfers;
+	uint32_t i2c;		/* transfers to the I2C bridge */
+	uint32_t bytes;
+	uint64_t time_us;	/* spent in the calls */
+};
+
+void usage(void)
+{
+	fprintf(stderr,
+		"rtl_trace, a tool for analysing traces of the control transfers\n"
+		"to the device, as written when RTLSDR_TRACE=<file> is set.\n\n"
+		"Usage:\trtl_trace [-options] trace_file\n"
+		"\t[-r replay_file (replay the calls and compare, default: off)]\n"
+		"\t[-v print every record]\n");
+	exit(1);
+}
+
+static void print_rec(const rtlsdr_trace_rec_t *rec, const uint8_t *payload)
+{
+	int i;
+
+	switch (rec->type) {
+	case RTLSDR_TRACE_CALL:
+		printf("%10u call %s(%d)\n", rec->time_us,
+		       rec->value < CMD_NUM ? cmd_names[rec->value] : "?",
+		       rec->status);
+		return;
+	case RTLSDR_TRACE_RET:
+		printf("%10u ret %d after %u us\n", rec->time_us + rec->dur_us,
+		       rec->status, rec->dur_us);
+		return;
+	case RTLSDR_TRACE_INFO:
+		printf("%10u info\n", rec->time_us);
+		return;
+	default:
+		break;
+	}
+
+	printf("%10u %s%s %04x %04x %3d %5u us ", rec->time_us,
+	       (rec->flags & RTLSDR_TRACE_IN) ? "in " : "out",
+	       (rec->flags & RTLSDR_TRACE_BATCHED) ? "*" : " ",
+	       rec->value, rec->index, rec->status, rec->dur_us);
+	for (i = 0; i < rec->len; i++)
+		printf(" %02x", payload[i]);
+	printf("\n");
+}
+
+static int read_trace(const char *path, struct cmd_stats *stats, int verbose)
+{
+	rtlsdr_trace_rec_t rec;
+	uint8_t *payload;
+	int depth = 0;
+	int cmd = 0;
+	FILE *f;
+	int r;
+
+	memset(stats, 0, CMD_NUM * sizeof(*stats));
+
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+
+	payload = malloc(0x10000);
+	if (!payload || rtlsdr_trace_check(f) < 0) {
+		fprintf(stderr, "%s is not a trace\n", path);
+		free(payload);
+		fclose(f);
+		return -1;
+	}
+
+	while (!(r = rtlsdr_trace_read(f, &rec, payload))) {
+		if (verbose)
+			print_rec(&rec, payload);
+
+		switch (rec.type) {
+		case RTLSDR_TRACE_CALL:
+			if (depth++)
+				break;
+			cmd = rec.value < CMD_NUM ? rec.value : 0;
+			stats[cmd].calls++;
+			break;
+		case RTLSDR_TRACE_RET:
+			if (!depth || --depth)
+				break;
+			stats[cmd].time_us += rec.dur_us;
+			cmd = 0;
+			break;
+		case RTLSDR_TRACE_CTRL:
+			stats[cmd].xfers++;
+			if ((rec.index >> 8) == BLOCK_IICB)
+				stats[cmd].i2c++;
+			if (rec.status > 0)
+				stats[cmd].bytes += rec.status;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (r < 0)
+		fprintf(stderr, "%s is truncated\n", path);
+
+	free(payload);
+	fclose(f);
+
+	return 0;
+}
+
+static double per_call(uint32_t n, uint32_t calls)
+{
+	return calls ? (double)n / calls : (double)n;
+}
+
+static void print_stats(const struct cmd_stats *stats)
+{
+	const struct cmd_stats *s;
+	int i;
+
+	printf("%-18s %6s %10s %10s %10s %10s\n", "call", "count",
+	       "xfers", "i2c", "bytes", "us");
+	for (i = 1; i < CMD_NUM; i++) {
+		s = &stats[i];
+		if (!s->calls)
+			continue;
+		printf("%-18s %6u %10.1f %10.1f %10.1f %10.1f\n", cmd_names[i],
+		       s->calls, per_call(s->xfers, s->calls),
+		       per_call(s->i2c, s->calls), per_call(s->bytes, s->calls),
+		       (double)s->time_us / s->calls);
+	}
+	printf("%-18s %6s %10u %10u %10u\n", cmd_names[0], "-",
+	       stats[0].xfers, stats[0].i2c, stats[0].bytes);
+}
+
+static void print_compare(const struct cmd_stats *rec,
+			  const struct cmd_stats *rep)
+{
+	int i;
+
+	printf("\n%-18s %6s %10s %10s %10s %10s\n", "transfers per call",
+	       "count", "recorded", "replayed", "i2c rec", "i2c rep");
+	for (i = 1; i < CMD_NUM; i++) {
+		if (!rec[i].calls)
+			continue;
+		printf("%-18s %6u %10.1f %10.1f %10.1f %10.1f\n", cmd_names[i],
+		       rec[i].calls, per_call(rec[i].xfers, rec[i].calls),
+		       per_call(rep[i].xfers, rep[i].calls),
+		       per_call(rec[i].i2c, rec[i].calls),
+		       per_call(rep[i].i2c, rep[i].calls));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct cmd_stats stats[CMD_NUM];
+	struct cmd_stats replay[CMD_NUM];
+	char *replay_path = NULL;
+	int verbose = 0;
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "r:vh?")) != -1) {
+		switch (opt) {
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (argc <= optind)
+		usage();
+
+	if (read_trace(argv[optind], stats, verbose) < 0)
+		return 1;
+
+	print_stats(stats);
+
+	if (!replay_path)
+		return 0;
+
+	r = rtlsdr_replay_trace(argv[optind], replay_path);
+	if (r < 0) {
+		fprintf(stderr, "Replay failed\n");
+		return 1;
+	}
+	fprintf(stderr, "Replayed %d calls\n", r);
+
+	if (read_trace(replay_path, replay, 0) < 0)
+		return 1;
+
+	print_compare(stats, replay);
+
+	return 0;
+}
@@ -0,0 +1,720 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * Sample format conversion from offset binary 8 bit I/Q
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "rtl-sdr.h"
+#include "rtlsdr_convert.h"
+
+/*
+ * The SIMD kernels are compiled for their instruction set regardless of
+ * the compiler flags and picked at runtime. All of them compute exactly
+ * the same as the scalar code: integer math for cs16, a subtraction
+ * followed by a multiplication (never fused) for cf32.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CONVERT_SSE2
+#define CONVERT_AVX2
+#define TARGET_SSE2	__attribute__((target("sse2")))
+#define TARGET_AVX2	__attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#include <emmintrin.h>
+#define CONVERT_SSE2
+#define TARGET_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CONVERT_NEON
+#endif
+
+/* weight of a new buffer in the running DC and IQ estimates */
+#define DC_ALPHA	(1.0f / 16.0f)
+#define IQ_ALPHA	(1.0f / 16.0f)
+
+/* floats converted at a time when correcting IQ imbalance */
+#define IQ_CHUNK	1024
+
+/* limits of the Q gain correction */
+#define IQ_GAIN_MIN	0.5f
+#define IQ_GAIN_MAX	2.0f
+
+static void conv_cs16_c(const uint8_t *in, int16_t *out, uint32_t len,
+			const int16_t *off, int16_t gain)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		out[i] = (int16_t)(((int16_t)in[i] - off[i & 1]) * gain);
+}
+
+static void conv_cf32_c(const uint8_t *in, float *out, uint32_t len,
+			const float *off, float scale)
+{
+	uint32_t i;
+	float v;
+
+	for (i = 0; i < len; i++) {
+		v = (float)in[i] - off[i & 1];
+		out[i] = v * scale;
+	}
+}
+
+static void sum_iq_c(const uint8_t *in, uint32_t len, uint64_t *sum)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		sum[i & 1] += in[i];
+}
+
+/* sums of I, Q, I^2, Q^2 and I*Q, centered on 128 */
+static void moments_c(const uint8_t *in, uint32_t len, int64_t *m)
+{
+	uint32_t i;
+	int x, y;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		x = in[i] - 128;
+		y = in[i + 1] - 128;
+		m[0] += x;
+		m[1] += y;
+		m[2] += x * x;
+		m[3] += y * y;
+		m[4] += x * y;
+	}
+}
+
+static void iq_apply_c(float *buf, uint32_t len, float c, float d)
+{
+	uint32_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		buf[i + 1] = buf[i + 1] * d + buf[i] * c;
+}
+
+static void float_cs16_c(const float *in, int16_t *out, uint32_t len,
+			 float gain)
+{
+	uint32_t i;
+	float v;
+
+	for (i = 0; i < len; i++) {
+		v = in[i] * gain;
+		if (v > 32767.0f)
+			v = 32767.0f;
+		if (v < -32768.0f)
+			v = -32768.0f;
+		out[i] = (int16_t)lrintf(v);
+	}
+}
+
+static void float_cu8_c(const float *in, uint8_t *out, uint32_t len)
+{
+	uint32_t i;
+	float v;
+
+	for (i = 0; i < len; i++) {
+		v = in[i] + 127.5f;
+		if (v < 0.0f)
+			v = 0.0f;
+		if (v > 255.0f)
+			v = 255.0f;
+		out[i] = (uint8_t)lrintf(v);
+	}
+}
+
+static void float_scale_c(const float *in, float *out, uint32_t len,
+			  float scale)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		out[i] = in[i] * scale;
+}
+
+#ifdef CONVERT_SSE2
+TARGET_SSE2
+static void conv_cs16_sse2(const uint8_t *in, int16_t *out, uint32_t len,
+			   const int16_t *off, int16_t gain)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i offv = _mm_set1_epi32((uint16_t)off[0] |
+					    ((uint32_t)(uint16_t)off[1] << 16));
+	const __m128i gainv = _mm_set1_epi16(gain);
+	__m128i v, lo, hi;
+	uint32_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(in + i));
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		lo = _mm_mullo_epi16(_mm_sub_epi16(lo, offv), gainv);
+		hi = _mm_mullo_epi16(_mm_sub_epi16(hi, offv), gainv);
+		_mm_storeu_si128((__m128i *)(out + i), lo);
+		_mm_storeu_si128((__m128i *)(out + i + 8), hi);
+	}
+
+	conv_cs16_c(in + i, out + i, len - i, off, gain);
+}
+
+TARGET_SSE2
+static void conv_cf32_sse2(const uint8_t *in, float *out, uint32_t len,
+			   const float *off, float scale)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 offv = _mm_setr_ps(off[0], off[1], off[0], off[1]);
+	const __m128 scalev = _mm_set1_ps(scale);
+	__m128i v, w;
+	__m128 f;
+	uint32_t i;
+	int j;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(in + i));
+		for (j = 0; j < 2; j++) {
+			w = j ? _mm_unpackhi_epi8(v, zero) :
+				_mm_unpacklo_epi8(v, zero);
+			f = _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero));
+			f = _mm_mul_ps(_mm_sub_ps(f, offv), scalev);
+			_mm_storeu_ps(out + i + j * 8, f);
+			f = _mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero));
+			f = _mm_mul_ps(_mm_sub_ps(f, offv), scalev);
+			_mm_storeu_ps(out + i + j * 8 + 4, f);
+		}
+	}
+
+	conv_cf32_c(in + i, out + i, len - i, off, scale);
+}
+
+TARGET_SSE2
+static void sum_iq_sse2(const uint8_t *in, uint32_t len, uint64_t *sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i even = _mm_set1_epi16(0x00ff);
+	__m128i all_acc = zero, even_acc = zero, v;
+	uint64_t all[2], ev[2];
+	uint32_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(in + i));
+		all_acc = _mm_add_epi64(all_acc, _mm_sad_epu8(v, zero));
+		even_acc = _mm_add_epi64(even_acc,
+					 _mm_sad_epu8(_mm_and_si128(v, even),
+						      zero));
+	}
+
+	_mm_storeu_si128((__m128i *)all, all_acc);
+	_mm_storeu_si128((__m128i *)ev, even_acc);
+	sum[0] += ev[0] + ev[1];
+	sum[1] += all[0] + all[1] - ev[0] - ev[1];
+
+	sum_iq_c(in + i, len - i, sum);
+}
+
+/* 32 bit lanes are flushed before they can overflow */
+#define MOMENTS_BLOCK	4096
+
+TARGET_SSE2
+static void moments_sse2(const uint8_t *in, uint32_t len, int64_t *m)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i center = _mm_set1_epi16(128);
+	const __m128i sel_i = _mm_setr_epi16(1, 0, 1, 0, 1, 0, 1, 0);
+	const __m128i sel_q = _mm_setr_epi16(0, 1, 0, 1, 0, 1, 0, 1);
+	const __m128i sign = _mm_setr_epi16(1, -1, 1, -1, 1, -1, 1, -1);
+	__m128i acc[5], v, w, t;
+	int32_t lane[4];
+	int64_t hs[5];
+	uint32_t i = 0, end;
+	int j, k;
+
+	while (i + 16 <= len) {
+		for (k = 0; k < 5; k++)
+			acc[k] = zero;
+
+		end = i + MOMENTS_BLOCK * 16;
+		if (end > len)
+			end = len;
+
+		for (; i + 16 <= end; i += 16) {
+			v = _mm_loadu_si128((const __m128i *)(in + i));
+			for (j = 0; j < 2; j++) {
+				w = j ? _mm_unpackhi_epi8(v, zero) :
+					_mm_unpacklo_epi8(v, zero);
+				w = _mm_sub_epi16(w, center);
+				acc[0] = _mm_add_epi32(acc[0],
+						       _mm_madd_epi16(w, sel_i));
+				acc[1] = _mm_add_epi32(acc[1],
+						       _mm_madd_epi16(w, sel_q));
+				/* I^2 + Q^2, I^2 - Q^2 and 2 I Q */
+				acc[2] = _mm_add_epi32(acc[2],
+						       _mm_madd_epi16(w, w));
+				t = _mm_mullo_epi16(w, sign);
+				acc[3] = _mm_add_epi32(acc[3],
+						       _mm_madd_epi16(w, t));
+				t = _mm_shufflelo_epi16(w, _MM_SHUFFLE(2, 3, 0, 1));
+				t = _mm_shufflehi_epi16(t, _MM_SHUFFLE(2, 3, 0, 1));
+				acc[4] = _mm_add_epi32(acc[4],
+						       _mm_madd_epi16(w, t));
+			}
+		}
+
+		for (k = 0; k < 5; k++) {
+			_mm_storeu_si128((__m128i *)lane, acc[k]);
+			hs[k] = (int64_t)lane[0] + lane[1] + lane[2] + lane[3];
+		}
+
+		m[0] += hs[0];
+		m[1] += hs[1];
+		m[2] += (hs[2] + hs[3]) / 2;
+		m[3] += (hs[2] - hs[3]) / 2;
+		m[4] += hs[4] / 2;
+	}
+
+	moments_c(in + i, len - i, m);
+}
+
+TARGET_SSE2
+static void iq_apply_sse2(float *buf, uint32_t len, float c, float d)
+{
+	const __m128 dv = _mm_setr_ps(1.0f, d, 1.0f, d);
+	const __m128 cv = _mm_setr_ps(0.0f, c, 0.0f, c);
+	__m128 x, ii;
+	uint32_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		x = _mm_loadu_ps(buf + i);
+		ii = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 2, 0, 0));
+		x = _mm_add_ps(_mm_mul_ps(x, dv), _mm_mul_ps(ii, cv));
+		_mm_storeu_ps(buf + i, x);
+	}
+
+	iq_apply_c(buf + i, len - i, c, d);
+}
+
+TARGET_SSE2
+static void float_cs16_sse2(const float *in, int16_t *out, uint32_t len,
+			    float gain)
+{
+	const __m128 gainv = _mm_set1_ps(gain);
+	__m128i a, b;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), gainv));
+		b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4),
+					       gainv));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+	}
+
+	float_cs16_c(in + i, out + i, len - i, gain);
+}
+
+TARGET_SSE2
+static void float_cu8_sse2(const float *in, uint8_t *out, uint32_t len)
+{
+	const __m128 center = _mm_set1_ps(127.5f);
+	__m128i a, b;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		a = _mm_cvtps_epi32(_mm_add_ps(_mm_loadu_ps(in + i), center));
+		b = _mm_cvtps_epi32(_mm_add_ps(_mm_loadu_ps(in + i + 4),
+					       center));
+		a = _mm_packs_epi32(a, b);
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(a, a));
+	}
+
+	float_cu8_c(in + i, out + i, len - i);
+}
+
+TARGET_SSE2
+static void float_scale_sse2(const float *in, float *out, uint32_t len,
+			     float scale)
+{
+	const __m128 scalev = _mm_set1_ps(scale);
+	uint32_t i;
+
+	for (i = 0; i + 4 <= len; i += 4)
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i),
+						   scalev));
+
+	float_scale_c(in + i, out + i, len - i, scale);
+}
+#endif
+
+#ifdef CONVERT_AVX2
+TARGET_AVX2
+static void conv_cs16_avx2(const uint8_t *in, int16_t *out, uint32_t len,
+			   const int16_t *off, int16_t gain)
+{
+	const __m256i offv = _mm256_set1_epi32((uint16_t)off[0] |
+					((uint32_t)(uint16_t)off[1] << 16));
+	const __m256i gainv = _mm256_set1_epi16(gain);
+	__m256i lo, hi;
+	uint32_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)
+							  (in + i)));
+		hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)
+							  (in + i + 16)));
+		lo = _mm256_mullo_epi16(_mm256_sub_epi16(lo, offv), gainv);
+		hi = _mm256_mullo_epi16(_mm256_sub_epi16(hi, offv), gainv);
+		_mm256_storeu_si256((__m256i *)(out + i), lo);
+		_mm256_storeu_si256((__m256i *)(out + i + 16), hi);
+	}
+
+	conv_cs16_c(in + i, out + i, len - i, off, gain);
+}
+
+TARGET_AVX2
+static void conv_cf32_avx2(const uint8_t *in, float *out, uint32_t len,
+			   const float *off, float scale)
+{
+	const __m256 offv = _mm256_setr_ps(off[0], off[1], off[0], off[1],
+					   off[0], off[1], off[0], off[1]);
+	const __m256 scalev = _mm256_set1_ps(scale);
+	__m256 f;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i *)(in + i))));
+		f = _mm256_mul_ps(_mm256_sub_ps(f, offv), scalev);
+		_mm256_storeu_ps(out + i, f);
+	}
+
+	conv_cf32_c(in + i, out + i, len - i, off, scale);
+}
+#endif
+
+#ifdef CONVERT_NEON
+static void conv_cs16_neon(const uint8_t *in, int16_t *out, uint32_t len,
+			   const int16_t *off, int16_t gain)
+{
+	const int16_t offs[8] = { off[0], off[1], off[0], off[1],
+				  off[0], off[1], off[0], off[1] };
+	const int16x8_t offv = vld1q_s16(offs);
+	const int16x8_t gainv = vdupq_n_s16(gain);
+	uint8x16_t v;
+	int16x8_t lo, hi;
+	uint32_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8(in + i);
+		lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+		hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+		vst1q_s16(out + i, vmulq_s16(vsubq_s16(lo, offv), gainv));
+		vst1q_s16(out + i + 8, vmulq_s16(vsubq_s16(hi, offv), gainv));
+	}
+
+	conv_cs16_c(in + i, out + i, len - i, off, gain);
+}
+
+static void conv_cf32_neon(const uint8_t *in, float *out, uint32_t len,
+			   const float *off, float scale)
+{
+	const float offs[4] = { off[0], off[1], off[0], off[1] };
+	const float32x4_t offv = vld1q_f32(offs);
+	const float32x4_t scalev = vdupq_n_f32(scale);
+	uint16x8_t w[2];
+	float32x4_t f;
+	uint32_t i;
+	int j;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		w[0] = vmovl_u8(vld1_u8(in + i));
+		w[1] = vmovl_u8(vld1_u8(in + i + 8));
+		for (j = 0; j < 2; j++) {
+			f = vcvtq_f32_u32(vmovl_u16(vget_low_u16(w[j])));
+			f = vmulq_f32(vsubq_f32(f, offv), scalev);
+			vst1q_f32(out + i + j * 8, f);
+			f = vcvtq_f32_u32(vmovl_u16(vget_high_u16(w[j])));
+			f = vmulq_f32(vsubq_f32(f, offv), scalev);
+			vst1q_f32(out + i + j * 8 + 4, f);
+		}
+	}
+
+	conv_cf32_c(in + i, out + i, len - i, off, scale);
+}
+#endif
+
+static void convert_select(rtlsdr_convert_t *c)
+{
+	c->cs16 = conv_cs16_c;
+	c->cf32 = conv_cf32_c;
+	c->sum = sum_iq_c;
+	c->moments = moments_c;
+	c->iq = iq_apply_c;
+	c->f_cs16 = float_cs16_c;
+	c->f_cu8 = float_cu8_c;
+	c->f_scale = float_scale_c;
+
+#if defined(CONVERT_SSE2) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		c->cs16 = conv_cs16_sse2;
+		c->cf32 = conv_cf32_sse2;
+		c->sum = sum_iq_sse2;
+		c->moments = moments_sse2;
+		c->iq = iq_apply_sse2;
+		c->f_cs16 = float_cs16_sse2;
+		c->f_cu8 = float_cu8_sse2;
+		c->f_scale = float_scale_sse2;
+	}
+#elif defined(CONVERT_SSE2)
+	c->cs16 = conv_cs16_sse2;
+	c->cf32 = conv_cf32_sse2;
+	c->sum = sum_iq_sse2;
+	c->moments = moments_sse2;
+	c->iq = iq_apply_sse2;
+	c->f_cs16 = float_cs16_sse2;
+	c->f_cu8 = float_cu8_sse2;
+	c->f_scale = float_scale_sse2;
+#endif
+
+#ifdef CONVERT_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		c->cs16 = conv_cs16_avx2;
+		c->cf32 = conv_cf32_avx2;
+	}
+#endif
+
+#ifdef CONVERT_NEON
+	c->cs16 = conv_cs16_neon;
+	c->cf32 = conv_cf32_neon;
+#endif
+}
+
+void rtlsdr_convert_init(rtlsdr_convert_t *c, int format, float scale,
+			 int dc_correct, int iq_correct)
+{
+	float center = (RTLSDR_OUTPUT_CS16 == format) ? 127.0f : 127.5f;
+
+	memset(c, 0, sizeof(*c));
+	c->format = format;
+	c->dc_correct = dc_correct;
+	c->dc[0] = c->dc[1] = center;
+	c->iq_correct = iq_correct;
+	c->iq_d = 1.0f;
+
+	/* keep full scale cs16 products within 16 bits */
+	c->gain = 1;
+	if (scale >= 1.0f)
+		c->gain = (scale > 128.0f) ? 128 : (int16_t)(scale + 0.5f);
+
+	c->scale = (scale > 0.0f) ? scale : 1.0f / 127.5f;
+
+	convert_select(c);
+}
+
+/* bytes of output per byte of input */
+unsigned int rtlsdr_convert_size(const rtlsdr_convert_t *c)
+{
+	switch (c->format) {
+	case RTLSDR_OUTPUT_CS16:
+		return sizeof(int16_t);
+	case RTLSDR_OUTPUT_CF32:
+		return sizeof(float);
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Blind IQ imbalance estimate: Q is decorrelated from I and scaled to
+ * the I power, which undoes a gain and phase error of the Q path.
+ */
+static void convert_iq_update(rtlsdr_convert_t *c, const int64_t *m,
+			      uint32_t n)
+{
+	double mi = (double)m[0] / n, mq = (double)m[1] / n;
+	float v[3];
+	float a, q, g;
+	int k;
+
+	v[0] = (float)((double)m[2] / n - mi * mi);
+	v[1] = (float)((double)m[3] / n - mq * mq);
+	v[2] = (float)((double)m[4] / n - mi * mq);
+
+	for (k = 0; k < 3; k++)
+		c->var[k] = c->iq_n ? c->var[k] + (v[k] - c->var[k]) * IQ_ALPHA :
+				      v[k];
+	c->iq_n++;
+
+	if (c->var[0] <= 0.0f)
+		return;
+
+	a = c->var[2] / c->var[0];
+	q = c->var[1] - c->var[2] * a;
+	if (q <= 0.0f)
+		return;
+
+	g = sqrtf(c->var[0] / q);
+	if (g < IQ_GAIN_MIN)
+		g = IQ_GAIN_MIN;
+	if (g > IQ_GAIN_MAX)
+		g = IQ_GAIN_MAX;
+
+	c->iq_c = -g * a;
+	c->iq_d = g;
+}
+
+/* change the corrections, keeps the estimates of enabled ones */
+void rtlsdr_convert_correct(rtlsdr_convert_t *c, int dc_correct,
+			    int iq_correct)
+{
+	float center = (RTLSDR_OUTPUT_CS16 == c->format) ? 127.0f : 127.5f;
+
+	if (!dc_correct)
+		c->dc[0] = c->dc[1] = center;
+
+	if (!iq_correct) {
+		c->iq_n = 0;
+		c->iq_c = 0.0f;
+		c->iq_d = 1.0f;
+	}
+
+	c->dc_correct = dc_correct;
+	c->iq_correct = iq_correct;
+}
+
+void rtlsdr_convert_stats(const rtlsdr_convert_t *c,
+			  struct rtlsdr_iq_stats *stats)
+{
+	double g, p, den;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->dc_i = c->dc[0];
+	stats->dc_q = c->dc[1];
+	stats->gain = 1.0f;
+	stats->buffers = c->iq_n;
+
+	if (!c->iq_n || c->var[0] <= 0.0f || c->var[1] <= 0.0f)
+		return;
+
+	g = sqrt(c->var[1] / c->var[0]);
+	p = asin(c->var[2] / sqrt(c->var[0] * c->var[1]));
+	stats->gain = (float)g;
+	stats->phase = (float)(p * 180.0 / 3.14159265358979323846);
+
+	/* power of the signal over that of its image */
+	den = 1.0 - 2.0 * g * cos(p) + g * g;
+	if (den < 1e-10)
+		den = 1e-10;
+	stats->irr = (float)(10.0 * log10((1.0 + 2.0 * g * cos(p) + g * g) /
+					  den));
+}
+
+/* write len floats in raw units in the output format */
+void rtlsdr_convert_float(const rtlsdr_convert_t *c, const float *in,
+			  void *out, uint32_t len)
+{
+	switch (c->format) {
+	case RTLSDR_OUTPUT_CS16:
+		c->f_cs16(in, (int16_t *)out, len, (float)c->gain);
+		break;
+	case RTLSDR_OUTPUT_CF32:
+		c->f_scale(in, (float *)out, len, c->scale);
+		break;
+	default:
+		c->f_cu8(in, (uint8_t *)out, len);
+		break;
+	}
+}
+
+/* corrected samples go through floats, in and out may be the same */
+static void convert_corrected(rtlsdr_convert_t *c, const uint8_t *in,
+			      void *out, uint32_t len)
+{
+	float tmp[IQ_CHUNK];
+	unsigned int size = rtlsdr_convert_size(c);
+	uint32_t i, n;
+
+	if (RTLSDR_OUTPUT_CF32 == c->format) {
+		c->cf32(in, (float *)out, len, c->dc, c->scale);
+		if (c->iq_correct)
+			c->iq((float *)out, len, c->iq_c, c->iq_d);
+		return;
+	}
+
+	for (i = 0; i < len; i += n) {
+		n = (len - i < IQ_CHUNK) ? len - i : IQ_CHUNK;
+		c->cf32(in + i, tmp, n, c->dc, 1.0f);
+		if (c->iq_correct)
+			c->iq(tmp, n, c->iq_c, c->iq_d);
+		rtlsdr_convert_float(c, tmp, (uint8_t *)out + i * size, n);
+	}
+}
+
+void rtlsdr_convert(rtlsdr_convert_t *c, const uint8_t *in, void *out,
+		    uint32_t len)
+{
+	int16_t off16[2];
+	uint64_t sum[2] = { 0, 0 };
+	int64_t m[5] = { 0, 0, 0, 0, 0 };
+
+	/* the estimates are taken before the samples may be overwritten,
+	 * but applied from the next buffer on */
+	if (c->iq_correct && len >= 2)
+		c->moments(in, len, m);
+	else if (c->dc_correct && len >= 2)
+		c->sum(in, len, sum);
+
+	/* a tracked DC offset is fractional, only cf32 keeps it exact
+	 * without going through floats */
+	if (c->iq_correct || (RTLSDR_OUTPUT_CF32 != c->format &&
+			      c->dc_correct)) {
+		convert_corrected(c, in, out, len);
+	} else {
+		switch (c->format) {
+		case RTLSDR_OUTPUT_CS16:
+			off16[0] = (int16_t)(c->dc[0] + 0.5f);
+			off16[1] = (int16_t)(c->dc[1] + 0.5f);
+			c->cs16(in, (int16_t *)out, len, off16, c->gain);
+			break;
+		case RTLSDR_OUTPUT_CF32:
+			c->cf32(in, (float *)out, len, c->dc, c->scale);
+			break;
+		default:
+			if (in != out)
+				memcpy(out, in, len);
+			break;
+		}
+	}
+
+	if (len < 2)
+		return;
+
+	if (c->iq_correct) {
+		/* moments are centered on 128 */
+		sum[0] = (uint64_t)(m[0] + 128 * (int64_t)(len / 2));
+		sum[1] = (uint64_t)(m[1] + 128 * (int64_t)(len / 2));
+		convert_iq_update(c, m, len / 2);
+	}
+
+	if (c->dc_correct) {
+		c->dc[0] += ((float)sum[0] / (float)((len + 1) / 2) - c->dc[0]) *
+			    DC_ALPHA;
+		c->dc[1] += ((float)sum[1] / (float)(len / 2) - c->dc[1]) *
+			    DC_ALPHA;
+	}
+}
@@ -0,0 +1,465 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * Digital down-converter: NCO mixer, CIC decimator, halfband and CIC
+ * compensating FIR stages
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rtl-sdr.h"
+#include "rtlsdr_ddc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DDC_SSE2
+#define TARGET_SSE2	__attribute__((target("sse2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#include <emmintrin.h>
+#define DDC_SSE2
+#define TARGET_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define DDC_NEON
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* the mixer output is quantized to 1/128 of an input LSB for the CIC */
+#define DDC_MIX_SCALE	128.0f
+
+/* passband and stopband edge of the last stage, in output sample rates */
+#define DDC_PASS	0.4
+#define DDC_STOP	0.55
+
+/* frequency grid for the FIR design */
+#define DDC_GRID	512
+
+/*
+ * The mixers multiply by a phasor that is advanced by multiplication
+ * within a buffer and set up again from the double precision phase for
+ * each buffer, so rounding errors don't accumulate. The SIMD kernels
+ * advance their phasors in bigger steps and differ from the plain C code
+ * within float rounding.
+ */
+static void mix_c(const float *in, int32_t *out, uint32_t n,
+		  double phase, double step)
+{
+	float pr = (float)cos(phase), pi = (float)sin(phase);
+	const float wr = (float)cos(step), wi = (float)sin(step);
+	float re, im, t;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		re = in[2 * i] * pr - in[2 * i + 1] * pi;
+		im = in[2 * i] * pi + in[2 * i + 1] * pr;
+		out[2 * i] = (int32_t)lrintf(re * DDC_MIX_SCALE);
+		out[2 * i + 1] = (int32_t)lrintf(im * DDC_MIX_SCALE);
+
+		t = pr * wr - pi * wi;
+		pi = pr * wi + pi * wr;
+		pr = t;
+	}
+}
+
+#ifdef DDC_SSE2
+TARGET_SSE2
+static void mix_sse2(const float *in, int32_t *out, uint32_t n,
+		     double phase, double step)
+{
+	const __m128 sign = _mm_castsi128_ps(_mm_setr_epi32(0x80000000, 0,
+							    0x80000000, 0));
+	const __m128 scale = _mm_set1_ps(DDC_MIX_SCALE);
+	const __m128 wr = _mm_set1_ps((float)cos(2.0 * step));
+	const __m128 wi = _mm_set1_ps((float)sin(2.0 * step));
+	__m128 p, x, t;
+	uint32_t i;
+
+	/* two samples per register, each with its own phasor */
+	p = _mm_setr_ps((float)cos(phase), (float)sin(phase),
+			(float)cos(phase + step), (float)sin(phase + step));
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		x = _mm_loadu_ps(in + 2 * i);
+		t = _mm_mul_ps(_mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)),
+			       _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 1, 1)));
+		x = _mm_mul_ps(x, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 0, 0)));
+		x = _mm_add_ps(x, _mm_xor_ps(t, sign));
+		_mm_storeu_si128((__m128i *)(out + 2 * i),
+				 _mm_cvtps_epi32(_mm_mul_ps(x, scale)));
+
+		t = _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 3, 0, 1)),
+			       wi);
+		p = _mm_add_ps(_mm_mul_ps(p, wr), _mm_xor_ps(t, sign));
+	}
+
+	mix_c(in + 2 * i, out + 2 * i, n - i, phase + i * step, step);
+}
+#endif
+
+#ifdef DDC_NEON
+static int32x4_t round_neon(float32x4_t v)
+{
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	const float32x4_t mhalf = vdupq_n_f32(-0.5f);
+
+	return vcvtq_s32_f32(vaddq_f32(v, vbslq_f32(vcltq_f32(v,
+						vdupq_n_f32(0.0f)), mhalf, half)));
+}
+
+static void mix_neon(const float *in, int32_t *out, uint32_t n,
+		     double phase, double step)
+{
+	const float32x4_t scale = vdupq_n_f32(DDC_MIX_SCALE);
+	const float32x4_t wr = vdupq_n_f32((float)cos(4.0 * step));
+	const float32x4_t wi = vdupq_n_f32((float)sin(4.0 * step));
+	float ph[2][4];
+	float32x4x2_t x;
+	int32x4x2_t o;
+	float32x4_t pr, pi, t;
+	uint32_t i;
+	int k;
+
+	/* four samples per register, I and Q in separate registers */
+	for (k = 0; k < 4; k++) {
+		ph[0][k] = (float)cos(phase + k * step);
+		ph[1][k] = (float)sin(phase + k * step);
+	}
+	pr = vld1q_f32(ph[0]);
+	pi = vld1q_f32(ph[1]);
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = vld2q_f32(in + 2 * i);
+		t = vsubq_f32(vmulq_f32(x.val[0], pr), vmulq_f32(x.val[1], pi));
+		o.val[0] = round_neon(vmulq_f32(t, scale));
+		t = vaddq_f32(vmulq_f32(x.val[0], pi), vmulq_f32(x.val[1], pr));
+		o.val[1] = round_neon(vmulq_f32(t, scale));
+		vst2q_s32(out + 2 * i, o);
+
+		t = vsubq_f32(vmulq_f32(pr, wr), vmulq_f32(pi, wi));
+		pi = vaddq_f32(vmulq_f32(pr, wi), vmulq_f32(pi, wr));
+		pr = t;
+	}
+
+	mix_c(in + 2 * i, out + 2 * i, n - i, phase + i * step, step);
+}
+#endif
+
+static void ddc_select(rtlsdr_ddc_t *d)
+{
+	d->mix = mix_c;
+
+#if defined(DDC_SSE2) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		d->mix = mix_sse2;
+#elif defined(DDC_SSE2)
+	d->mix = mix_sse2;
+#endif
+
+#ifdef DDC_NEON
+	d->mix = mix_neon;
+#endif
+}
+
+static double ddc_window(int n, int m)
+{
+	double a = M_PI * n / (m + 1);
+
+	return 0.42 + 0.5 * cos(a) + 0.08 * cos(2.0 * a);
+}
+
+/* magnitude response of the CIC, f in CIC output sample rates */
+static double ddc_cic_resp(double f, uint32_t r)
+{
+	if (r == 1 || f < 1e-9)
+		return 1.0;
+
+	return pow(fabs(sin(M_PI * f) / (r * sin(M_PI * f / r))),
+		   DDC_CIC_ORDER);
+}
+
+static void ddc_normalize(float *h, const double *v, int taps)
+{
+	double sum = 0.0;
+	int i;
+
+	for (i = 0; i < taps; i++)
+		sum += v[i];
+
+	for (i = 0; i < taps; i++)
+		h[i] = (float)(v[i] / sum);
+}
+
+/* windowed sinc halfband, every other tap but the center one is zero */
+static void ddc_design_hb(float *h, int taps)
+{
+	double v[DDC_HB_TAPS];
+	int m = taps / 2;
+	int n;
+
+	for (n = -m; n <= m; n++) {
+		if (!n)
+			v[n + m] = 0.5;
+		else if (n % 2)
+			v[n + m] = sin(M_PI * n / 2.0) / (M_PI * n) *
+				   ddc_window(n, m);
+		else
+			v[n + m] = 0.0;
+	}
+
+	ddc_normalize(h, v, taps);
+}
+
+/*
+ * Frequency sampled lowpass with the inverse CIC response in its passband.
+ * Frequencies are in input sample rates of this stage, rel converts them
+ * to CIC output sample rates.
+ */
+static void ddc_design_fir(float *h, int taps, int decim, uint32_t cic_r,
+			   double rel)
+{
+	double v[DDC_FIR_TAPS];
+	double pass = DDC_PASS / decim;
+	double stop = DDC_STOP / decim;
+	double f, a, acc;
+	int m = taps / 2;
+	int n, j;
+
+	if (stop > 0.5)
+		stop = 0.5;
+
+	for (n = -m; n <= m; n++) {
+		acc = 0.0;
+		for (j = 0; j < DDC_GRID; j++) {
+			f = (j + 0.5) * 0.5 / DDC_GRID;
+			if (f >= stop)
+				break;
+
+			a = 1.0 / ddc_cic_resp(f * rel, cic_r);
+			if (f > pass)
+				a *= 0.5 + 0.5 * cos(M_PI * (f - pass) /
+						     (stop - pass));
+			acc += a * cos(2.0 * M_PI * f * n);
+		}
+		v[n + m] = acc * ddc_window(n, m);
+	}
+
+	ddc_normalize(h, v, taps);
+}
+
+static void ddc_fir_init(rtlsdr_ddc_fir_t *f, const float *h, int taps,
+			 int decim)
+{
+	memset(f, 0, sizeof(*f));
+	f->h = h;
+	f->taps = taps;
+	f->decim = decim;
+	f->phase = decim;
+}
+
+/*
+ * The stage decimation is split into a CIC, up to DDC_MAX_HB halfbands
+ * and a final FIR that compensates the CIC droop and decimates by two.
+ * Powers of two beyond that go to the CIC, whose ratio is limited so its
+ * 64 bit registers can't overflow. Odd ratios other than one are not
+ * supported, the CIC alone can't suppress its aliases near the band edge
+ * well enough.
+ */
+int rtlsdr_ddc_init(rtlsdr_ddc_t *d, uint32_t decim)
+{
+	uint32_t twos = 0;
+	int i;
+
+	if (!decim || decim > DDC_MAX_DECIM || (decim > 1 && (decim & 1)))
+		return -1;
+
+	memset(d, 0, sizeof(*d));
+	d->decim = decim;
+
+	while (decim > 1 && !(decim & 1) && twos < DDC_MAX_HB + 1) {
+		decim >>= 1;
+		twos++;
+	}
+	if (decim > DDC_MAX_CIC)
+		return -1;
+	d->cic_r = decim;
+	d->cic_gain = (float)(1.0 / (pow(d->cic_r, DDC_CIC_ORDER) *
+				     DDC_MIX_SCALE));
+
+	if (twos) {
+		d->hb_num = twos - 1;
+		ddc_design_hb(d->hb_h, DDC_HB_TAPS);
+		for (i = 0; i < d->hb_num; i++)
+			ddc_fir_init(&d->hb[i], d->hb_h, DDC_HB_TAPS, 2);
+
+		ddc_design_fir(d->fir_h, DDC_FIR_TAPS, 2, d->cic_r,
+			       1.0 / (1 << d->hb_num));
+		ddc_fir_init(&d->fir, d->fir_h, DDC_FIR_TAPS, 2);
+	}
+
+	ddc_select(d);
+
+	return 0;
+}
+
+void rtlsdr_ddc_free(rtlsdr_ddc_t *d)
+{
+	free(d->mix_buf);
+	d->mix_buf = NULL;
+	d->mix_len = 0;
+}
+
+/* forget the history of the previous stream */
+void rtlsdr_ddc_reset(rtlsdr_ddc_t *d)
+{
+	int i;
+
+	d->phase = 0.0;
+	d->cic_cnt = 0;
+	memset(d->integ, 0, sizeof(d->integ));
+	memset(d->comb, 0, sizeof(d->comb));
+
+	for (i = 0; i < d->hb_num; i++)
+		ddc_fir_init(&d->hb[i], d->hb_h, DDC_HB_TAPS, 2);
+	if (d->fir.taps)
+		ddc_fir_init(&d->fir, d->fir_h, DDC_FIR_TAPS, 2);
+}
+
+/* make room for buffers of n complex samples */
+int rtlsdr_ddc_reserve(rtlsdr_ddc_t *d, uint32_t n)
+{
+	int32_t *buf;
+
+	if (d->mix_len >= n)
+		return 0;
+
+	buf = realloc(d->mix_buf, (size_t)n * 2 * sizeof(int32_t));
+	if (!buf)
+		return -1;
+
+	d->mix_buf = buf;
+	d->mix_len = n;
+
+	return 0;
+}
+
+static uint32_t ddc_cic(rtlsdr_ddc_t *d, const int32_t *in, float *out,
+			uint32_t n)
+{
+	uint64_t v, t;
+	uint32_t i, o = 0;
+	int c, s;
+
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < 2; c++) {
+			v = (uint64_t)(int64_t)in[2 * i + c];
+			for (s = 0; s < DDC_CIC_ORDER; s++) {
+				d->integ[c][s] += v;
+				v = d->integ[c][s];
+			}
+		}
+
+		if (++d->cic_cnt < d->cic_r)
+			continue;
+		d->cic_cnt = 0;
+
+		for (c = 0; c < 2; c++) {
+			v = d->integ[c][DDC_CIC_ORDER - 1];
+			for (s = 0; s < DDC_CIC_ORDER; s++) {
+				t = v;
+				v -= d->comb[c][s];
+				d->comb[c][s] = t;
+			}
+			out[2 * o + c] = (float)(int64_t)v * d->cic_gain;
+		}
+		o++;
+	}
+
+	return o;
+}
+
+/* filters buf in place, returns the number of output samples */
+static uint32_t ddc_fir(rtlsdr_ddc_fir_t *f, float *buf, uint32_t n)
+{
+	const float *h = f->h, *x, *y;
+	float re, im;
+	uint32_t i, o = 0;
+	int k;
+
+	for (i = 0; i < n; i++) {
+		f->dl[0][f->pos] = f->dl[0][f->pos + f->taps] = buf[2 * i];
+		f->dl[1][f->pos] = f->dl[1][f->pos + f->taps] = buf[2 * i + 1];
+		if (++f->pos == f->taps)
+			f->pos = 0;
+
+		if (--f->phase > 0)
+			continue;
+		f->phase = f->decim;
+
+		/* oldest to newest sample, the taps are symmetric */
+		x = &f->dl[0][f->pos];
+		y = &f->dl[1][f->pos];
+		re = im = 0.0f;
+		for (k = 0; k < f->taps; k++) {
+			re += h[k] * x[k];
+			im += h[k] * y[k];
+		}
+
+		buf[2 * o] = re;
+		buf[2 * o + 1] = im;
+		o++;
+	}
+
+	return o;
+}
+
+/*
+ * Down-convert n complex samples in raw units in place, returns the number
+ * of output samples or -1 if rtlsdr_ddc_reserve() wasn't called for n.
+ */
+int rtlsdr_ddc_process(rtlsdr_ddc_t *d, float *buf, uint32_t n,
+		       uint32_t rate)
+{
+	int32_t offset = d->offset;
+	int i;
+
+	if (n > d->mix_len)
+		return -1;
+
+	if (rate != d->rate || offset != d->step_offset) {
+		d->rate = rate;
+		d->step_offset = offset;
+		d->step = rate ? -2.0 * M_PI * offset / rate : 0.0;
+	}
+
+	d->mix(buf, d->mix_buf, n, d->phase, d->step);
+	d->phase = fmod(d->phase + n * d->step, 2.0 * M_PI);
+
+	n = ddc_cic(d, d->mix_buf, buf, n);
+
+	for (i = 0; i < d->hb_num; i++)
+		n = ddc_fir(&d->hb[i], buf, n);
+
+	if (d->fir.taps)
+		n = ddc_fir(&d->fir, buf, n);
+
+	return (int)n;
+}
@@ -0,0 +1,209 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * Sample source of the simulated device
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rtlsdr_sim.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define SIM_DEFAULT_TONE	100000.0
+#define SIM_DEFAULT_AMP		40.0
+#define SIM_DEFAULT_NOISE	4.0
+
+/*
+ * The spec is a comma separated list of key=value pairs:
+ *   file=<path>	play a recorded cu8 file instead of a tone
+ *   loop=<0|1>		rewind the file at its end (default 1)
+ *   tone=<Hz>		tone offset from the center frequency
+ *   amp=<LSB>		tone amplitude
+ *   noise=<LSB>	noise amplitude
+ *   realtime=<0|1>	pace the samples at the sample rate (default 1)
+ */
+int rtlsdr_sim_init(rtlsdr_sim_t *sim, const char *spec)
+{
+	char key[16];
+	char val[256];
+	const char *p, *eq, *end;
+	size_t n;
+
+	memset(sim, 0, sizeof(rtlsdr_sim_t));
+	sim->loop = 1;
+	sim->realtime = 1;
+	sim->tone = SIM_DEFAULT_TONE;
+	sim->amp = SIM_DEFAULT_AMP;
+	sim->noise = SIM_DEFAULT_NOISE;
+	sim->re = 1.0;
+	sim->seed = 0x2545f491;
+
+	for (p = spec; p && *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+
+		eq = memchr(p, '=', end - p);
+		if (!eq) {
+			fprintf(stderr, "sim: ignoring '%.*s'\n",
+				(int)(end - p), p);
+			continue;
+		}
+
+		n = eq - p;
+		if (n >= sizeof(key))
+			n = sizeof(key) - 1;
+		memcpy(key, p, n);
+		key[n] = '\0';
+
+		n = end - eq - 1;
+		if (n >= sizeof(val))
+			n = sizeof(val) - 1;
+		memcpy(val, eq + 1, n);
+		val[n] = '\0';
+
+		if (!strcmp(key, "file")) {
+			if (sim->file)
+				fclose(sim->file);
+			sim->file = fopen(val, "rb");
+			if (!sim->file) {
+				fprintf(stderr, "sim: can't open %s\n", val);
+				return -1;
+			}
+		} else if (!strcmp(key, "loop")) {
+			sim->loop = atoi(val);
+		} else if (!strcmp(key, "tone")) {
+			sim->tone = atof(val);
+		} else if (!strcmp(key, "amp")) {
+			sim->amp = atof(val);
+		} else if (!strcmp(key, "noise")) {
+			sim->noise = atof(val);
+		} else if (!strcmp(key, "realtime")) {
+			sim->realtime = atoi(val);
+		} else {
+			fprintf(stderr, "sim: unknown option '%s'\n", key);
+		}
+	}
+
+	return 0;
+}
+
+void rtlsdr_sim_free(rtlsdr_sim_t *sim)
+{
+	if (sim->file)
+		fclose(sim->file);
+	sim->file = NULL;
+}
+
+static int sim_read_file(rtlsdr_sim_t *sim, uint8_t *buf, uint32_t len)
+{
+	size_t got = 0;
+
+	while (got < len) {
+		got += fread(buf + got, 1, len - got, sim->file);
+		if (got == len)
+			break;
+
+		if (!sim->loop || !ftell(sim->file))
+			break;
+		rewind(sim->file);
+	}
+
+	/* a short file still has to give whole I/Q pairs */
+	got &= ~(size_t)1;
+	if (!got)
+		return -1;
+
+	return (int)got;
+}
+
+/* triangular noise in [-1, 1] */
+static double sim_noise(rtlsdr_sim_t *sim)
+{
+	uint32_t x = sim->seed;
+	int a, b;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	a = x & 0xffff;
+	b = x >> 16;
+	sim->seed = x;
+
+	return (a + b - 65535) / 65535.0;
+}
+
+static uint8_t sim_clip(double v)
+{
+	v += 127.5;
+	if (v < 0.0)
+		return 0;
+	if (v > 255.0)
+		return 255;
+	return (uint8_t)(v + 0.5);
+}
+
+/*
+ * Fill a buffer with samples, returns the number of bytes written. The
+ * synthetic signal scales with the tuner gain in tenth dB, a negative
+ * gain (automatic) leaves it at its nominal level.
+ */
+int rtlsdr_sim_read(rtlsdr_sim_t *sim, uint8_t *buf, uint32_t len,
+		    uint32_t rate, int gain)
+{
+	double scale = 1.0;
+	double step_re, step_im, re, im, mag;
+	uint32_t i;
+
+	if (sim->file)
+		return sim_read_file(sim, buf, len);
+
+	if (gain >= 0)
+		scale = pow(10.0, (gain - 300) / 200.0);
+
+	if (!rate)
+		rate = 2048000;
+
+	step_re = cos(2.0 * M_PI * sim->tone / rate);
+	step_im = sin(2.0 * M_PI * sim->tone / rate);
+
+	for (i = 0; i + 1 < len; i += 2) {
+		buf[i] = sim_clip(scale * (sim->amp * sim->re +
+					   sim->noise * sim_noise(sim)));
+		buf[i + 1] = sim_clip(scale * (sim->amp * sim->im +
+					       sim->noise * sim_noise(sim)));
+
+		re = sim->re * step_re - sim->im * step_im;
+		im = sim->re * step_im + sim->im * step_re;
+		sim->re = re;
+		sim->im = im;
+	}
+
+	/* keep the phasor on the unit circle */
+	mag = sqrt(sim->re * sim->re + sim->im * sim->im);
+	if (mag > 0.0) {
+		sim->re /= mag;
+		sim->im /= mag;
+	}
+
+	return (int)(len & ~1U);
+}
@@ -0,0 +1,367 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * Control transfer trace format and the transport replaying it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtlsdr_trace.h"
+
+/* block of the I2C bridge, the address is in wValue */
+#define TRACE_BLOCK_IICB	6
+#define TRACE_INFO_WORDS	12
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+int rtlsdr_trace_write(FILE *f, const rtlsdr_trace_rec_t *rec,
+		       const uint8_t *payload)
+{
+	uint8_t buf[RTLSDR_TRACE_REC_LEN];
+
+	buf[0] = rec->type;
+	buf[1] = rec->flags;
+	put16(buf + 2, rec->len);
+	put16(buf + 4, rec->value);
+	put16(buf + 6, rec->index);
+	put32(buf + 8, (uint32_t)rec->status);
+	put32(buf + 12, rec->time_us);
+	put32(buf + 16, rec->dur_us);
+
+	if (fwrite(buf, sizeof(buf), 1, f) != 1)
+		return -1;
+
+	if (rec->len && fwrite(payload, rec->len, 1, f) != 1)
+		return -1;
+
+	return 0;
+}
+
+/* payload must hold 64 KiB, returns 1 at the end of the trace */
+int rtlsdr_trace_read(FILE *f, rtlsdr_trace_rec_t *rec, uint8_t *payload)
+{
+	uint8_t buf[RTLSDR_TRACE_REC_LEN];
+
+	if (fread(buf, sizeof(buf), 1, f) != 1)
+		return feof(f) ? 1 : -1;
+
+	rec->type = buf[0];
+	rec->flags = buf[1];
+	rec->len = get16(buf + 2);
+	rec->value = get16(buf + 4);
+	rec->index = get16(buf + 6);
+	rec->status = (int32_t)get32(buf + 8);
+	rec->time_us = get32(buf + 12);
+	rec->dur_us = get32(buf + 16);
+
+	if (rec->len && fread(payload, rec->len, 1, f) != 1)
+		return -1;
+
+	return 0;
+}
+
+int rtlsdr_trace_check(FILE *f)
+{
+	char magic[RTLSDR_TRACE_MAGIC_LEN];
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, RTLSDR_TRACE_MAGIC, sizeof(magic)))
+		return -1;
+
+	return 0;
+}
+
+/* buf must hold 4 * TRACE_INFO_WORDS bytes and both strings */
+uint16_t rtlsdr_trace_pack_info(const rtlsdr_trace_info_t *info, uint8_t *buf)
+{
+	uint32_t w[TRACE_INFO_WORDS];
+	size_t len, n;
+	int i;
+
+	w[0] = info->tuner_type;
+	w[1] = info->rtl_xtal;
+	w[2] = info->tun_xtal;
+	w[3] = (uint32_t)info->corr;
+	w[4] = info->rate;
+	w[5] = info->freq;
+	w[6] = (uint32_t)info->direct_sampling;
+	w[7] = (uint32_t)info->offset_tuning;
+	w[8] = (uint32_t)info->gain_manual;
+	w[9] = (uint32_t)info->gain;
+	w[10] = (uint32_t)info->agc_on;
+	w[11] = info->bias_gpio;
+
+	for (i = 0; i < TRACE_INFO_WORDS; i++)
+		put32(buf + 4 * i, w[i]);
+	len = 4 * TRACE_INFO_WORDS;
+
+	n = strnlen(info->manufact, sizeof(info->manufact) - 1);
+	memcpy(buf + len, info->manufact, n);
+	len += n;
+	buf[len++] = '\0';
+
+	n = strnlen(info->product, sizeof(info->product) - 1);
+	memcpy(buf + len, info->product, n);
+	len += n;
+	buf[len++] = '\0';
+
+	return (uint16_t)len;
+}
+
+void rtlsdr_trace_unpack_info(rtlsdr_trace_info_t *info, const uint8_t *buf,
+			      uint16_t len)
+{
+	uint32_t w[TRACE_INFO_WORDS];
+	const char *s, *end;
+	size_t n;
+	int i;
+
+	memset(info, 0, sizeof(*info));
+	if (len < 4 * TRACE_INFO_WORDS)
+		return;
+
+	for (i = 0; i < TRACE_INFO_WORDS; i++)
+		w[i] = get32(buf + 4 * i);
+
+	info->tuner_type = w[0];
+	info->rtl_xtal = w[1];
+	info->tun_xtal = w[2];
+	info->corr = (int32_t)w[3];
+	info->rate = w[4];
+	info->freq = w[5];
+	info->direct_sampling = (int32_t)w[6];
+	info->offset_tuning = (int32_t)w[7];
+	info->gain_manual = (int32_t)w[8];
+	info->gain = (int32_t)w[9];
+	info->agc_on = (int32_t)w[10];
+	info->bias_gpio = w[11];
+
+	s = (const char *)buf + 4 * TRACE_INFO_WORDS;
+	end = (const char *)buf + len;
+
+	n = strnlen(s, end - s);
+	if (n >= sizeof(info->manufact))
+		n = sizeof(info->manufact) - 1;
+	memcpy(info->manufact, s, n);
+	s += strnlen(s, end - s);
+	if (s < end)
+		s++;
+
+	n = strnlen(s, end - s);
+	if (n >= sizeof(info->product))
+		n = sizeof(info->product) - 1;
+	memcpy(info->product, s, n);
+}
+
+static int mock_is_i2c(uint16_t index)
+{
+	return (index >> 8) == TRACE_BLOCK_IICB;
+}
+
+/*
+ * Collects the device side of a trace: the data of every control read
+ * and the API calls. The state the trace was started from is taken
+ * from its last INFO record before the first call.
+ */
+int rtlsdr_mock_init(rtlsdr_mock_t *m, const char *path)
+{
+	rtlsdr_trace_rec_t rec;
+	uint8_t *payload;
+	uint32_t reads_cap = 0, calls_cap = 0;
+	size_t data_len = 0, data_cap = 0;
+	int depth = 0;
+	void *p;
+	FILE *f;
+	int r;
+
+	memset(m, 0, sizeof(*m));
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	payload = malloc(0x10000);
+	if (!payload || rtlsdr_trace_check(f) < 0) {
+		r = -1;
+		goto err;
+	}
+
+	while (!(r = rtlsdr_trace_read(f, &rec, payload))) {
+		switch (rec.type) {
+		case RTLSDR_TRACE_INFO:
+			if (!m->calls_num)
+				rtlsdr_trace_unpack_info(&m->info, payload,
+							 rec.len);
+			break;
+		case RTLSDR_TRACE_CALL:
+			if (depth++)
+				break;
+			if (m->calls_num == calls_cap) {
+				calls_cap = calls_cap ? 2 * calls_cap : 64;
+				p = realloc(m->calls,
+					    calls_cap * sizeof(*m->calls));
+				if (!p)
+					goto nomem;
+				m->calls = p;
+			}
+			m->calls[m->calls_num].cmd = rec.value;
+			m->calls[m->calls_num].param = (uint32_t)rec.status;
+			m->calls[m->calls_num].read = m->reads_num;
+			m->calls_num++;
+			break;
+		case RTLSDR_TRACE_RET:
+			if (depth)
+				depth--;
+			break;
+		case RTLSDR_TRACE_CTRL:
+			if (!(rec.flags & RTLSDR_TRACE_IN)) {
+				if (mock_is_i2c(rec.index) && rec.len)
+					m->ptr[rec.value & 0xff] = payload[0];
+				break;
+			}
+			/* batched reads are dummies, their data is dropped */
+			if ((rec.flags & RTLSDR_TRACE_BATCHED) || !rec.len)
+				break;
+			if (m->reads_num == reads_cap) {
+				reads_cap = reads_cap ? 2 * reads_cap : 256;
+				p = realloc(m->reads,
+					    reads_cap * sizeof(*m->reads));
+				if (!p)
+					goto nomem;
+				m->reads = p;
+			}
+			if (data_len + rec.len > data_cap) {
+				data_cap = 2 * (data_len + rec.len);
+				p = realloc(m->data, data_cap);
+				if (!p)
+					goto nomem;
+				m->data = p;
+			}
+			m->reads[m->reads_num].value = rec.value;
+			m->reads[m->reads_num].index = rec.index;
+			m->reads[m->reads_num].len = rec.len;
+			m->reads[m->reads_num].ptr = mock_is_i2c(rec.index) ?
+				m->ptr[rec.value & 0xff] : 0;
+			m->reads[m->reads_num].off = data_len;
+			memcpy(m->data + data_len, payload, rec.len);
+			data_len += rec.len;
+			m->reads_num++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (r < 0)
+		fprintf(stderr, "Truncated trace %s\n", path);
+
+	memset(m->ptr, 0, sizeof(m->ptr));
+	free(payload);
+	fclose(f);
+	return 0;
+
+nomem:
+	r = -1;
+	rtlsdr_mock_free(m);
+err:
+	free(payload);
+	fclose(f);
+	return r;
+}
+
+void rtlsdr_mock_free(rtlsdr_mock_t *m)
+{
+	free(m->reads);
+	free(m->data);
+	free(m->calls);
+	m->reads = NULL;
+	m->data = NULL;
+	m->calls = NULL;
+	m->reads_num = 0;
+	m->calls_num = 0;
+}
+
+/* answer the following reads starting with those of the given call */
+void rtlsdr_mock_seek(rtlsdr_mock_t *m, uint32_t call)
+{
+	if (call < m->calls_num)
+		m->next = m->calls[call].read;
+}
+
+/*
+ * Writes only track the I2C register pointers. A read is answered with
+ * the next recorded read of the same request, starting at the cursor
+ * and wrapping around once. For I2C, reads done at the same register
+ * pointer are preferred. Reads never recorded return zeros.
+ */
+int rtlsdr_mock_ctrl(rtlsdr_mock_t *m, int in, uint16_t value,
+		     uint16_t index, uint8_t *data, uint16_t len)
+{
+	rtlsdr_mock_read_t *rd;
+	uint8_t ptr = 0;
+	uint32_t i, j;
+	int any;
+
+	if (!in) {
+		if (mock_is_i2c(index) && len && data)
+			m->ptr[value & 0xff] = data[0];
+		return len;
+	}
+
+	if (!data)
+		return len;
+
+	if (mock_is_i2c(index))
+		ptr = m->ptr[value & 0xff];
+
+	for (any = 0; any < 2; any++) {
+		for (i = 0; i < m->reads_num; i++) {
+			j = (m->next + i) % m->reads_num;
+			rd = &m->reads[j];
+			if (rd->value != value || rd->index != index ||
+			    rd->len != len || (!any && rd->ptr != ptr))
+				continue;
+			memcpy(data, m->data + rd->off, len);
+			m->next = j + 1;
+			return len;
+		}
+	}
+
+	memset(data, 0, len);
+	return len;
+}
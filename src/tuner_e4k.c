@@ -23,6 +23,7 @@
 
 #include <limits.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
@@ -56,6 +57,30 @@ static const uint8_t width2mask[] = {
 /***********************************************************************
  * Register Access */
 
+static void e4k_shadow_store(struct e4k_state *e4k, uint8_t reg, uint8_t val)
+{
+	if (reg >= E4K_NUM_SHADOW)
+		return;
+
+	e4k->regs[reg] = val;
+	e4k->regs_valid[reg >> 3] |= 1 << (reg & 7);
+}
+
+/*! \brief Get bits of a register as last written or read
+ *  \param[in] e4k reference to the tuner
+ *  \param[in] reg number of the register
+ *  \param[in] mask bit-mask of the value
+ *  \returns masked register contents, -1 if they are not known
+ */
+static int e4k_shadow_get(struct e4k_state *e4k, uint8_t reg, uint8_t mask)
+{
+	if (reg >= E4K_NUM_SHADOW ||
+	    !(e4k->regs_valid[reg >> 3] & (1 << (reg & 7))))
+		return -1;
+
+	return e4k->regs[reg] & mask;
+}
+
 /*! \brief Write a register of the tuner chip
  *  \param[in] e4k reference to the tuner
  *  \param[in] reg number of the register
@@ -70,7 +95,28 @@ static int e4k_reg_write(struct e4k_state *e4k, uint8_t reg, uint8_t val)
 	data[1] = val;
 
 	r = rtlsdr_i2c_write_fn(e4k->rtl_dev, e4k->i2c_addr, data, 2);
-	return r == 2 ? 0 : -1;
+	if (r != 2) {
+		if (reg < E4K_NUM_SHADOW)
+			e4k->regs_valid[reg >> 3] &= ~(1 << (reg & 7));
+		return -1;
+	}
+
+	e4k_shadow_store(e4k, reg, val);
+	return 0;
+}
+
+/*! \brief Write a register unless it is known to hold the value already
+ *  \param[in] e4k reference to the tuner
+ *  \param[in] reg number of the register
+ *  \param[in] val value to be written
+ *  \returns 0 on success, negative in case of error
+ */
+static int e4k_reg_write_cached(struct e4k_state *e4k, uint8_t reg, uint8_t val)
+{
+	if (e4k_shadow_get(e4k, reg, 0xff) == val)
+		return 0;
+
+	return e4k_reg_write(e4k, reg, val);
 }
 
 /*! \brief Read a register of the tuner chip
@@ -88,6 +134,7 @@ static int e4k_reg_read(struct e4k_state *e4k, uint8_t reg)
 	if (rtlsdr_i2c_read_fn(e4k->rtl_dev, e4k->i2c_addr, &data, 1) < 1)
 		return -1;
 
+	e4k_shadow_store(e4k, reg, data);
 	return data;
 }
 
@@ -293,6 +340,7 @@ int e4k_if_filter_bw_set(struct e4k_state *e4k, enum e4k_if_filter filter,
 		         uint32_t bandwidth)
 {
 	int bw_idx;
+	uint8_t mask;
 	const struct reg_field *field;
 
 	if (filter >= ARRAY_SIZE(if_filter_bw))
@@ -302,6 +350,11 @@ int e4k_if_filter_bw_set(struct e4k_state *e4k, enum e4k_if_filter filter,
 
 	field = &if_filter_fields[filter];
 
+	/* the filters are set along with every sample rate change */
+	mask = width2mask[field->width] << field->shift;
+	if (e4k_shadow_get(e4k, field->reg, mask) == bw_idx << field->shift)
+		return 0;
+
 	return e4k_field_write(e4k, field, bw_idx);
 }
 
@@ -532,40 +585,153 @@ uint32_t e4k_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint
 	return flo;
 }
 
-int e4k_tune_params(struct e4k_state *e4k, struct e4k_pll_params *p)
+static enum e4k_band e4k_flo_band(uint32_t flo)
+{
+	if (flo < MHZ(140))
+		return E4K_BAND_VHF2;
+	else if (flo < MHZ(350))
+		return E4K_BAND_VHF3;
+	else if (flo < MHZ(1135))
+		return E4K_BAND_UHF;
+	else
+		return E4K_BAND_L;
+}
+
+static void e4k_chan_fill(struct e4k_chan *c, const struct e4k_pll_params *p)
 {
+	enum e4k_band band = e4k_flo_band(p->flo);
+
+	c->flo = p->flo;
+	c->x = p->x;
+	c->z = p->z;
+	c->r = p->r;
+	c->r_idx = p->r_idx;
+	c->band = band;
+	c->rf_filt = choose_rf_filter(band, p->flo);
+}
+
+/*! \brief Program the PLL and set band and RF filter for a channel
+ *
+ *  Only registers that don't hold the right value already are written.
+ */
+static int e4k_tune_chan(struct e4k_state *e4k, const struct e4k_chan *c,
+			 uint32_t intended_flo)
+{
+	int r_changed = e4k_shadow_get(e4k, E4K_REG_SYNTH7, 0xff) != c->r_idx;
+
 	/* program R + 3phase/2phase */
-	e4k_reg_write(e4k, E4K_REG_SYNTH7, p->r_idx);
+	e4k_reg_write_cached(e4k, E4K_REG_SYNTH7, c->r_idx);
 	/* program Z */
-	e4k_reg_write(e4k, E4K_REG_SYNTH3, p->z);
+	e4k_reg_write_cached(e4k, E4K_REG_SYNTH3, c->z);
 	/* program X */
-	e4k_reg_write(e4k, E4K_REG_SYNTH4, p->x & 0xff);
-	e4k_reg_write(e4k, E4K_REG_SYNTH5, p->x >> 8);
+	e4k_reg_write_cached(e4k, E4K_REG_SYNTH4, c->x & 0xff);
+	e4k_reg_write_cached(e4k, E4K_REG_SYNTH5, c->x >> 8);
 
 	/* we're in auto calibration mode, so there's no need to trigger it */
 
-	memcpy(&e4k->vco, p, sizeof(e4k->vco));
+	e4k->vco.intended_flo = intended_flo;
+	e4k->vco.flo = c->flo;
+	e4k->vco.x = c->x;
+	e4k->vco.z = c->z;
+	e4k->vco.r = c->r;
+	e4k->vco.r_idx = c->r_idx;
+	e4k->vco.threephase = (c->r_idx & E4K_SYNTH7_3PHASE_EN) ? 1 : 0;
 
-	/* set the band */
-	if (e4k->vco.flo < MHZ(140))
-		e4k_band_set(e4k, E4K_BAND_VHF2);
-	else if (e4k->vco.flo < MHZ(350))
-		e4k_band_set(e4k, E4K_BAND_VHF3);
-	else if (e4k->vco.flo < MHZ(1135))
-		e4k_band_set(e4k, E4K_BAND_UHF);
-	else
-		e4k_band_set(e4k, E4K_BAND_L);
+	/* set the band, again whenever the divider changes as the
+	 * workaround in e4k_band_set() is needed around 325 MHz */
+	if (r_changed ||
+	    e4k_shadow_get(e4k, E4K_REG_SYNTH1, 0x06) != c->band << 1)
+		e4k_band_set(e4k, c->band);
 
 	/* select and set proper RF filter */
-	e4k_rf_filter_set(e4k);
+	if (e4k_shadow_get(e4k, E4K_REG_FILT1, 0xf) != c->rf_filt)
+		e4k_reg_set_mask(e4k, E4K_REG_FILT1, 0xf, c->rf_filt);
 
 	return e4k->vco.flo;
 }
 
+int e4k_tune_params(struct e4k_state *e4k, struct e4k_pll_params *p)
+{
+	struct e4k_chan c;
+
+	e4k_chan_fill(&c, p);
+	e4k->vco.fosc = p->fosc;
+
+	return e4k_tune_chan(e4k, &c, p->intended_flo);
+}
+
+/*! \brief Precompute the PLL and filter settings of a channel raster
+ *  \param[in] e4k reference to tuner
+ *  \param[in] start frequency of the first channel in Hz
+ *  \param[in] step channel spacing in Hz
+ *  \param[in] num number of channels, 0 to drop the table
+ *  \returns 0 on success, negative in case of error
+ *
+ *  Tuning to a frequency on the raster then takes the settings from the
+ *  table. The table is computed again when the crystal frequency changes.
+ */
+int e4k_set_raster(struct e4k_state *e4k, uint32_t start, uint32_t step,
+		   uint32_t num)
+{
+	struct e4k_chan *chan = NULL;
+	struct e4k_pll_params p;
+	uint32_t i;
+
+	if (num) {
+		if (!step || (uint64_t)step * (num - 1) > UINT32_MAX - start)
+			return -EINVAL;
+
+		chan = malloc(num * sizeof(struct e4k_chan));
+		if (!chan)
+			return -ENOMEM;
+
+		for (i = 0; i < num; i++) {
+			if (!e4k_compute_pll_params(&p, e4k->vco.fosc,
+						    start + i * step)) {
+				free(chan);
+				return -EINVAL;
+			}
+			e4k_chan_fill(&chan[i], &p);
+		}
+	}
+
+	free(e4k->chan);
+	e4k->chan = chan;
+	e4k->chan_start = start;
+	e4k->chan_step = step;
+	e4k->chan_num = num;
+	e4k->chan_fosc = e4k->vco.fosc;
+
+	return 0;
+}
+
+static const struct e4k_chan *e4k_raster_find(struct e4k_state *e4k,
+					      uint32_t freq)
+{
+	uint32_t i;
+
+	if (!e4k->chan || freq < e4k->chan_start)
+		return NULL;
+
+	i = (freq - e4k->chan_start) / e4k->chan_step;
+	if (i >= e4k->chan_num ||
+	    e4k->chan_start + i * e4k->chan_step != freq)
+		return NULL;
+
+	/* the crystal frequency was changed, e.g. by a ppm correction */
+	if (e4k->chan_fosc != e4k->vco.fosc &&
+	    e4k_set_raster(e4k, e4k->chan_start, e4k->chan_step,
+			   e4k->chan_num) < 0)
+		return NULL;
+
+	return &e4k->chan[i];
+}
+
 /*! \brief High-level tuning API, just specify frquency
  *
  *  This function will compute matching PLL parameters, program them into the
- *  hardware and set the band as well as RF filter.
+ *  hardware and set the band as well as RF filter. Frequencies on the raster
+ *  set with e4k_set_raster() use the precomputed parameters.
  *
  *  \param[in] e4k reference to tuner
  *  \param[in] freq frequency in Hz
@@ -573,20 +739,27 @@ int e4k_tune_params(struct e4k_state *e4k, struct e4k_pll_params *p)
  */
 int e4k_tune_freq(struct e4k_state *e4k, uint32_t freq)
 {
-	uint32_t rc;
+	int rc;
+	const struct e4k_chan *c;
+	struct e4k_chan tmp;
 	struct e4k_pll_params p;
 
-	/* determine PLL parameters */
-	rc = e4k_compute_pll_params(&p, e4k->vco.fosc, freq);
-	if (!rc)
-		return -EINVAL;
+	c = e4k_raster_find(e4k, freq);
+	if (!c) {
+		/* determine PLL parameters */
+		if (!e4k_compute_pll_params(&p, e4k->vco.fosc, freq))
+			return -EINVAL;
+
+		e4k_chan_fill(&tmp, &p);
+		c = &tmp;
+	}
 
 	/* actually tune to those parameters */
-	rc = e4k_tune_params(e4k, &p);
+	e4k_tune_chan(e4k, c, freq);
 
 	/* check PLL lock */
-	rc = e4k_reg_read(e4k, E4K_REG_SYNTH1);
-	if (!(rc & 0x01)) {
+	rc = e4k_get_lock(e4k);
+	if (rc <= 0) {
 		fprintf(stderr, "[E4K] PLL not locked for %u Hz!\n", freq);
 		return -1;
 	}
@@ -594,6 +767,21 @@ int e4k_tune_freq(struct e4k_state *e4k, uint32_t freq)
 	return 0;
 }
 
+/*! \brief Check if the PLL is locked
+ *  \param[in] e4k reference to the tuner
+ *  \returns 1 if locked, 0 if not, negative in case of error
+ */
+int e4k_get_lock(struct e4k_state *e4k)
+{
+	int rc;
+
+	rc = e4k_reg_read(e4k, E4K_REG_SYNTH1);
+	if (rc < 0)
+		return rc;
+
+	return rc & 0x01;
+}
+
 /***********************************************************************
  * Gain Control */
 
@@ -932,6 +1120,7 @@ int e4k_init(struct e4k_state *e4k)
 		E4K_MASTER1_NORM_STBY |
 		E4K_MASTER1_POR_DET
 	);
+	memset(e4k->regs_valid, 0, sizeof(e4k->regs_valid));
 
 	/* Configure clock input */
 	e4k_reg_write(e4k, E4K_REG_CLK_INP, 0x00);
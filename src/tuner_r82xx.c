@@ -269,18 +269,11 @@ static bool shadow_equal(struct r82xx_priv *priv, uint8_t reg, const uint8_t *va
 	return false;
 }
 
-static int r82xx_write(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
+static int r82xx_burst(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
 		       unsigned int len)
 {
 	int rc, size, pos = 0;
 
-	/* Avoid setting registers unnecessarily since it's slow */
-	if (shadow_equal(priv, reg, val, len))
-		return 0;
-
-	/* Store the shadow registers */
-	shadow_store(priv, reg, val, len);
-
 	do {
 		if (len > priv->cfg->max_i2c_msg_len - 1)
 			size = priv->cfg->max_i2c_msg_len - 1;
@@ -310,6 +303,83 @@ static int r82xx_write(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
 	return 0;
 }
 
+static int r82xx_write(struct r82xx_priv *priv, uint8_t reg, const uint8_t *val,
+		       unsigned int len)
+{
+	int r = reg - REG_SHADOW_START;
+
+	/* While staging, writes only build the target image */
+	if (priv->staging && r >= 0 && r + len <= NUM_REGS) {
+		memcpy(&priv->img[r], val, len);
+		priv->touched |= ((1UL << len) - 1) << r;
+		return 0;
+	}
+
+	/* Avoid setting registers unnecessarily since it's slow */
+	if (!priv->recording && shadow_equal(priv, reg, val, len))
+		return 0;
+
+	/* Store the shadow registers */
+	shadow_store(priv, reg, val, len);
+
+	return r82xx_burst(priv, reg, val, len);
+}
+
+/*
+ * Start collecting register writes into a target image instead of sending
+ * them, r82xx_flush() then writes what differs from the shadow registers.
+ */
+static void r82xx_stage(struct r82xx_priv *priv)
+{
+	memcpy(priv->img, priv->regs, NUM_REGS);
+	priv->touched = 0;
+	priv->staging = 1;
+}
+
+/*
+ * Write the target image with as few I2C messages as possible. Every
+ * message costs a round trip through the I2C repeater while a byte more
+ * is cheap, so unchanged registers between two changed ones are rewritten
+ * whenever both fit into one message. A tune that is recorded writes all
+ * registers set while staging, they may hold other values on replay.
+ */
+static int r82xx_flush(struct r82xx_priv *priv)
+{
+	int rc, i, j, end, max = priv->cfg->max_i2c_msg_len - 1;
+
+	if (!priv->staging)
+		return 0;
+	priv->staging = 0;
+
+#define CHANGED(i) \
+	(priv->img[i] != priv->regs[i] || \
+	 (priv->recording && (priv->touched & (1UL << (i)))))
+
+	for (i = 0; i < NUM_REGS; i = end) {
+		if (!CHANGED(i)) {
+			end = i + 1;
+			continue;
+		}
+
+		/* last changed register that still fits the message */
+		end = i + 1;
+		for (j = i + 1; j < NUM_REGS && j < i + max; j++) {
+			if (CHANGED(j))
+				end = j + 1;
+		}
+
+		shadow_store(priv, i + REG_SHADOW_START, &priv->img[i], end - i);
+		rc = r82xx_burst(priv, i + REG_SHADOW_START, &priv->img[i],
+				 end - i);
+		if (rc < 0)
+			return rc;
+	}
+
+#undef CHANGED
+
+	return 0;
+}
+
 static int r82xx_write_reg(struct r82xx_priv *priv, uint8_t reg, uint8_t val)
 {
 	return r82xx_write(priv, reg, &val, 1);
@@ -320,7 +390,7 @@ static int r82xx_read_cache_reg(struct r82xx_priv *priv, int reg)
 	reg -= REG_SHADOW_START;
 
 	if (reg >= 0 && reg < NUM_REGS)
-		return priv->regs[reg];
+		return priv->staging ? priv->img[reg] : priv->regs[reg];
 	else
 		return -1;
 }
@@ -335,6 +405,10 @@ static int r82xx_write_reg_mask(struct r82xx_priv *priv, uint8_t reg, uint8_t va
 
 	val = (rc & ~bit_mask) | (val & bit_mask);
 
+	/* nothing to stage, a recorded tune must not set the other bits */
+	if (priv->staging && val == rc)
+		return 0;
+
 	return r82xx_write(priv, reg, &val, 1);
 }
 
@@ -465,6 +539,7 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 	uint8_t vco_power_ref = 2;
 	uint8_t refdiv2 = 0;
 	uint8_t ni, si, nint, vco_fine_tune, val;
+	int locked = 0;
 	uint8_t data[5];
 	uint8_t regs[7];
 
@@ -477,8 +552,18 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 	if (rc < 0)
 		return rc;
 
+	/* like the original driver, the mux and autotune settings reach
+	 * the tuner before the dividers, which start the PLL locking */
+	if (priv->staging) {
+		rc = r82xx_flush(priv);
+		if (rc < 0)
+			return rc;
+		r82xx_stage(priv);
+	}
+
 	/* regs 0x10 to 0x16 */
-	memcpy(regs, &priv->regs[0x10 - REG_SHADOW_START], 7);
+	for (i = 0; i < 7; i++)
+		regs[i] = r82xx_read_cache_reg(priv, 0x10 + i);
 
 	regs[0] = mask_reg8(regs[0], refdiv2, 0x10);
 
@@ -560,14 +645,27 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 	if (rc < 0)
 		return rc;
 
+	/* the PLL has to be programmed before checking for lock */
+	rc = r82xx_flush(priv);
+	if (rc < 0)
+		return rc;
+
 	for (i = 0; i < 2; i++) {
 //		usleep_range(sleep_time, sleep_time + 1000);
 
+		/* a recorded tune is checked when it is replayed, the
+		 * tuner is still on the old frequency */
+		if (priv->recording) {
+			locked = 1;
+			break;
+		}
+
 		/* Check if PLL has locked */
 		rc = r82xx_read(priv, 0x00, data, 3);
 		if (rc < 0)
 			return rc;
-		if (data[2] & 0x40)
+		locked = data[2] & 0x40;
+		if (locked)
 			break;
 
 		if (!i) {
@@ -578,7 +676,7 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 		}
 	}
 
-	if (!(data[2] & 0x40)) {
+	if (!locked) {
 		fprintf(stderr, "[R82XX] PLL not locked!\n");
 		priv->has_lock = 0;
 		return 0;
@@ -592,6 +690,20 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 	return rc;
 }
 
+int r82xx_get_lock(struct r82xx_priv *priv)
+{
+	uint8_t data[3];
+	int rc;
+
+	rc = r82xx_read(priv, 0x00, data, sizeof(data));
+	if (rc < 0)
+		return rc;
+
+	priv->has_lock = !!(data[2] & 0x40);
+
+	return priv->has_lock;
+}
+
 static int r82xx_sysfreq_sel(struct r82xx_priv *priv, uint32_t freq,
 			     enum r82xx_tuner_type type,
 			     uint32_t delsys)
@@ -968,81 +1080,105 @@ static const int r82xx_vga_gain_steps[]  = {
 	0, 26, 26, 30, 42, 35, 24, 13, 14, 32, 36, 34, 35, 37, 35, 36
 };
 
-static const int r82xx_lna_gain_steps[]  = {
-	0, 9, 13, 40, 38, 13, 31, 22, 26, 31, 26, 14, 19, 5, 35, 13
+/*
+ * LNA and mixer gain index for each of the gains advertised by
+ * rtlsdr_get_tuner_gains(), raising both alternately. The gain is the
+ * sum of the measured steps of both up to their index:
+ *   LNA	0, 9, 13, 40, 38, 13, 31, 22, 26, 31, 26, 14, 19, 5, 35, 13
+ *   Mixer	0, 5, 10, 10, 19, 9, 10, 25, 17, 10, 8, 16, 13, 6, 3, -8
+ */
+static const struct r82xx_gain_entry {
+	int gain;
+	uint8_t lna;
+	uint8_t mix;
+} r82xx_gain_table[] = {
+	{   0,  0,  0 }, {   9,  1,  0 }, {  14,  1,  1 }, {  27,  2,  1 },
+	{  37,  2,  2 }, {  77,  3,  2 }, {  87,  3,  3 }, { 125,  4,  3 },
+	{ 144,  4,  4 }, { 157,  5,  4 }, { 166,  5,  5 }, { 197,  6,  5 },
+	{ 207,  6,  6 }, { 229,  7,  6 }, { 254,  7,  7 }, { 280,  8,  7 },
+	{ 297,  8,  8 }, { 328,  9,  8 }, { 338,  9,  9 }, { 364, 10,  9 },
+	{ 372, 10, 10 }, { 386, 11, 10 }, { 402, 11, 11 }, { 421, 12, 11 },
+	{ 434, 12, 12 }, { 439, 13, 12 }, { 445, 13, 13 }, { 480, 14, 13 },
+	{ 496, 15, 14 }
 };
 
-static const int r82xx_mixer_gain_steps[]  = {
-	0, 5, 10, 10, 19, 9, 10, 25, 17, 10, 8, 16, 13, 6, 3, -8
-};
+#define R82XX_NUM_GAINS	ARRAY_SIZE(r82xx_gain_table)
 
-int r82xx_set_gain(struct r82xx_priv *priv, int set_manual_gain, int gain)
+static int r82xx_set_manual_gain(struct r82xx_priv *priv,
+				 const struct r82xx_gain_entry *g)
 {
 	int rc;
 
-	if (set_manual_gain) {
-		int i, total_gain = 0;
-		uint8_t mix_index = 0, lna_index = 0;
-		uint8_t data[4];
+	/* the gain registers go out together */
+	r82xx_stage(priv);
 
-		/* LNA auto off */
-		rc = r82xx_write_reg_mask(priv, 0x05, 0x10, 0x10);
-		if (rc < 0)
-			return rc;
+	/* LNA auto off, LNA gain */
+	rc = r82xx_write_reg_mask(priv, 0x05, 0x10 | g->lna, 0x1f);
+	if (rc < 0)
+		goto err;
 
-		 /* Mixer auto off */
-		rc = r82xx_write_reg_mask(priv, 0x07, 0, 0x10);
-		if (rc < 0)
-			return rc;
+	/* Mixer auto off, Mixer gain */
+	rc = r82xx_write_reg_mask(priv, 0x07, g->mix, 0x1f);
+	if (rc < 0)
+		goto err;
 
-		rc = r82xx_read(priv, 0x00, data, sizeof(data));
-		if (rc < 0)
-			return rc;
+	/* set fixed VGA gain for now (16.3 dB) */
+	rc = r82xx_write_reg_mask(priv, 0x0c, 0x08, 0x9f);
+	if (rc < 0)
+		goto err;
 
-		/* set fixed VGA gain for now (16.3 dB) */
-		rc = r82xx_write_reg_mask(priv, 0x0c, 0x08, 0x9f);
-		if (rc < 0)
-			return rc;
+	return r82xx_flush(priv);
 
-		for (i = 0; i < 15; i++) {
-			if (total_gain >= gain)
-				break;
+err:
+	priv->staging = 0;
+	return rc;
+}
 
-			total_gain += r82xx_lna_gain_steps[++lna_index];
+int r82xx_set_gain_index(struct r82xx_priv *priv, unsigned int index)
+{
+	if (index >= R82XX_NUM_GAINS)
+		return -1;
 
-			if (total_gain >= gain)
-				break;
+	return r82xx_set_manual_gain(priv, &r82xx_gain_table[index]);
+}
+
+int r82xx_set_gain(struct r82xx_priv *priv, int set_manual_gain, int gain)
+{
+	unsigned int i;
+	int rc;
 
-			total_gain += r82xx_mixer_gain_steps[++mix_index];
+	if (set_manual_gain) {
+		/* lowest gain not below the requested one */
+		for (i = 0; i < R82XX_NUM_GAINS - 1; i++) {
+			if (r82xx_gain_table[i].gain >= gain)
+				break;
 		}
 
-		/* set LNA gain */
-		rc = r82xx_write_reg_mask(priv, 0x05, lna_index, 0x0f);
-		if (rc < 0)
-			return rc;
+		return r82xx_set_manual_gain(priv, &r82xx_gain_table[i]);
+	}
 
-		/* set Mixer gain */
-		rc = r82xx_write_reg_mask(priv, 0x07, mix_index, 0x0f);
-		if (rc < 0)
-			return rc;
-	} else {
-		/* LNA */
-		rc = r82xx_write_reg_mask(priv, 0x05, 0, 0x10);
-		if (rc < 0)
-			return rc;
+	r82xx_stage(priv);
 
-		/* Mixer */
-		rc = r82xx_write_reg_mask(priv, 0x07, 0x10, 0x10);
-		if (rc < 0)
-			return rc;
+	/* LNA */
+	rc = r82xx_write_reg_mask(priv, 0x05, 0, 0x10);
+	if (rc < 0)
+		goto err;
 
-		/* set fixed VGA gain for now (26.5 dB) */
-		rc = r82xx_write_reg_mask(priv, 0x0c, 0x0b, 0x9f);
-		if (rc < 0)
-			return rc;
-	}
+	/* Mixer */
+	rc = r82xx_write_reg_mask(priv, 0x07, 0x10, 0x10);
+	if (rc < 0)
+		goto err;
 
-	return 0;
+	/* set fixed VGA gain for now (26.5 dB) */
+	rc = r82xx_write_reg_mask(priv, 0x0c, 0x0b, 0x9f);
+	if (rc < 0)
+		goto err;
+
+	return r82xx_flush(priv);
+
+err:
+	priv->staging = 0;
+	return rc;
 }
 
 /* Bandwidth contribution by low-pass filter. */
@@ -1108,11 +1244,14 @@ int r82xx_set_bandwidth(struct r82xx_priv *priv, int bw, uint32_t rate)
 		priv->int_freq -= real_bw / 2;
 	}
 
-	rc = r82xx_write_reg_mask(priv, 0x0a, reg_0a, 0x10);
-	if (rc < 0)
-		return rc;
+	r82xx_stage(priv);
 
-	rc = r82xx_write_reg_mask(priv, 0x0b, reg_0b, 0xef);
+	rc = r82xx_write_reg_mask(priv, 0x0a, reg_0a, 0x10);
+	if (rc >= 0)
+		rc = r82xx_write_reg_mask(priv, 0x0b, reg_0b, 0xef);
+	if (rc >= 0)
+		rc = r82xx_flush(priv);
+	priv->staging = 0;
 	if (rc < 0)
 		return rc;
 
@@ -1133,6 +1272,7 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 	uint8_t cable_2_in;
 	uint8_t cable_1_in;
 	uint8_t air_in;
+	uint8_t input = priv->input;
 
 	is_rtlsdr_blog_v4 = rtlsdr_check_dongle_model(priv->rtl_dev, "RTLSDRBlog", "Blog V4");
 
@@ -1142,6 +1282,10 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 
 	lo_freq = upconvert_freq + priv->int_freq;
 
+	/* collect the register image for the new frequency, it is written
+	 * by r82xx_set_pll() in two parts: the mux settings, then the PLL */
+	r82xx_stage(priv);
+
 	rc = r82xx_set_mux(priv, lo_freq);
 	if (rc < 0)
 		goto err;
@@ -1150,6 +1294,9 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 	if (rc < 0 || !priv->has_lock)
 		goto err;
 
+	/* the input and notch settings only change on a locked PLL */
+	r82xx_stage(priv);
+
 	if (is_rtlsdr_blog_v4) {
 		/* determine if notch filters should be on or off notches are turned OFF
 		 * when tuned within the notch band and ON when tuned outside the notch band.
@@ -1158,7 +1305,7 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 		rc = r82xx_write_reg_mask(priv, 0x17, open_d, 0x08);
 
 		if (rc < 0)
-			return rc;
+			goto err;
 
 		/* select tuner band based on frequency and only switch if there is a band change
 		 *(to avoid excessive register writes when tuning rapidly)
@@ -1167,7 +1314,7 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 
 		/* switch between tuner inputs on the RTL-SDR Blog V4 */
 		if (band != priv->input) {
-			priv->input = band;
+			input = band;
 
 			/* activate cable 2 (HF input) */
 			cable_2_in = (band == HF) ? 0x08 : 0x00;
@@ -1176,6 +1323,13 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 			if (rc < 0)
 				goto err;
 
+			/* the GPIO write isn't staged, 0x06 has to reach
+			 * the tuner first */
+			rc = r82xx_flush(priv);
+			if (rc < 0)
+				goto err;
+			r82xx_stage(priv);
+
 			/* Control upconverter GPIO switch on newer batches */
 			rc = rtlsdr_set_bias_tee_gpio(priv->rtl_dev, 5, !cable_2_in);
 
@@ -1207,12 +1361,22 @@ int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq)
 
 		if ((priv->cfg->rafael_chip == CHIP_R828D) &&
 			(air_cable1_in != priv->input)) {
-			priv->input = air_cable1_in;
+			input = air_cable1_in;
 			rc = r82xx_write_reg_mask(priv, 0x05, air_cable1_in, 0x60);
+			if (rc < 0)
+				goto err;
 		}
 	}
 
+	rc = r82xx_flush(priv);
+
+	/* the input only counts as switched once it has been written */
+	if (rc >= 0)
+		priv->input = input;
+
 err:
+	/* drop whatever wasn't written */
+	priv->staging = 0;
 	if (rc < 0)
 		fprintf(stderr, "%s: failed=%d\n", __FUNCTION__, rc);
 	return rc;